@@ -0,0 +1,303 @@
+/**
+ * afpacket.cpp
+ *
+ * Live capture from a Linux TPACKET_V3 ring; see afpacket.h.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "afpacket.h"
+
+#include <vector>
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
+#endif
+
+#if defined(HAVE_LINUX_IF_PACKET_H) && defined(TPACKET3_HDRLEN)
+
+#ifndef ETHERTYPE_IPV6
+# define ETHERTYPE_IPV6 0x86DD
+#endif
+
+bool afpacket_available() { return true; }
+
+/* One socket of the fanout group and its ring. */
+class afpacket_ring {
+public:
+    afpacket_ring():fd(-1),map(0),map_len(0),block_size(0),blocks(0),next(0){}
+    ~afpacket_ring(){
+	if(map) munmap(map,map_len);
+	if(fd>=0) close(fd);
+    }
+    int		fd;
+    uint8_t	*map;
+    size_t	map_len;
+    size_t	block_size;
+    uint32_t	blocks;
+    uint32_t	next;			// the block we expect the kernel to hand over next
+
+    tpacket_block_desc *block(uint32_t i) const {
+	return reinterpret_cast<tpacket_block_desc *>(map + (size_t)i * block_size);
+    }
+private:
+    /* not implemented */
+    afpacket_ring(const afpacket_ring &);
+    afpacket_ring &operator=(const afpacket_ring &);
+};
+
+/* Where the packets go. */
+class afpacket_sink {
+public:
+    afpacket_sink(pcap_handler handler_,bool ethernet_):handler(handler_),ethernet(ethernet_){}
+    pcap_handler handler;
+    bool	ethernet;		// frames have an ethernet header (SOCK_RAW)
+};
+
+/**
+ * Compile expression for the link type the socket delivers and attach
+ * it to the socket, so that the kernel drops unwanted packets before
+ * they take up room in the ring.
+ */
+static void attach_filter(int fd,int dlt,const std::string &expression)
+{
+    if(expression=="") return;
+#ifdef HAVE_LIBPCAP
+    pcap_t *dead = pcap_open_dead(dlt,SNAPLEN);
+    struct bpf_program fcode;
+    if(dead==0) die("pcap_open_dead failed");
+    if(pcap_compile(dead,&fcode,expression.c_str(),1,0) < 0){
+	die("%s", pcap_geterr(dead));
+    }
+    /* struct bpf_insn and struct sock_filter have the same layout */
+    struct sock_fprog prog;
+    prog.len    = fcode.bf_len;
+    prog.filter = reinterpret_cast<struct sock_filter *>(fcode.bf_insns);
+    if(setsockopt(fd,SOL_SOCKET,SO_ATTACH_FILTER,&prog,sizeof(prog))){
+	die("SO_ATTACH_FILTER: %s",strerror(errno));
+    }
+    pcap_freecode(&fcode);
+    pcap_close(dead);
+#else
+    die("filter expressions require libpcap");
+#endif
+}
+
+static void open_ring(afpacket_ring &r,int ifindex,int socktype,int dlt,const std::string &expression,
+		      bool promisc,const afpacket_options &opt,int fanout_group)
+{
+    /* With protocol 0 the socket receives nothing until bind() names
+     * ETH_P_ALL, after the filter and the ring are in place.
+     */
+    r.fd = socket(AF_PACKET,socktype,0);
+    if(r.fd<0) die("AF_PACKET socket: %s",strerror(errno));
+
+    int version = TPACKET_V3;
+    if(setsockopt(r.fd,SOL_PACKET,PACKET_VERSION,&version,sizeof(version))){
+	die("PACKET_VERSION: %s",strerror(errno));
+    }
+
+    /* The filter goes on before bind() so that no unfiltered packet gets in. */
+    attach_filter(r.fd,dlt,expression);
+
+    /* With TPACKET_V3 the frame size only has to divide the block size;
+     * packets are packed into blocks at their real length.
+     */
+    struct tpacket_req3 req;
+    memset(&req,0,sizeof(req));
+    req.tp_block_size = opt.block_size;
+    req.tp_block_nr   = opt.blocks;
+    req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+    req.tp_frame_nr   = (opt.block_size / req.tp_frame_size) * opt.blocks;
+    req.tp_retire_blk_tov = opt.block_timeout;
+    if(setsockopt(r.fd,SOL_PACKET,PACKET_RX_RING,&req,sizeof(req))){
+	die("PACKET_RX_RING (%d blocks of %d bytes): %s",
+	    (int)opt.blocks,(int)opt.block_size,strerror(errno));
+    }
+    r.block_size = opt.block_size;
+    r.blocks     = opt.blocks;
+    r.map_len    = (size_t)opt.block_size * opt.blocks;
+    void *map = mmap(0,r.map_len,PROT_READ|PROT_WRITE,MAP_SHARED,r.fd,0);
+    if(map==MAP_FAILED) die("mmap of packet ring: %s",strerror(errno));
+    r.map = static_cast<uint8_t *>(map);
+
+    struct sockaddr_ll sll;
+    memset(&sll,0,sizeof(sll));
+    sll.sll_family   = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex  = ifindex;
+    if(bind(r.fd,reinterpret_cast<struct sockaddr *>(&sll),sizeof(sll))){
+	die("bind AF_PACKET socket: %s",strerror(errno));
+    }
+
+    if(promisc && ifindex!=0){
+	struct packet_mreq mr;
+	memset(&mr,0,sizeof(mr));
+	mr.mr_ifindex = ifindex;
+	mr.mr_type    = PACKET_MR_PROMISC;
+	if(setsockopt(r.fd,SOL_PACKET,PACKET_ADD_MEMBERSHIP,&mr,sizeof(mr))){
+	    DEBUG(1)("warning: cannot enable promiscuous mode: %s",strerror(errno));
+	}
+    }
+
+    if(opt.fanout>1){
+	/* PACKET_FANOUT_HASH sends both directions of a connection to
+	 * the same socket; DEFRAG keeps IP fragments together.
+	 */
+	int arg = fanout_group | (PACKET_FANOUT_HASH << 16);
+#ifdef PACKET_FANOUT_FLAG_DEFRAG
+	arg |= (PACKET_FANOUT_FLAG_DEFRAG << 16);
+#endif
+	if(setsockopt(r.fd,SOL_PACKET,PACKET_FANOUT,&arg,sizeof(arg))){
+	    die("PACKET_FANOUT: %s",strerror(errno));
+	}
+    }
+}
+
+/* Hand every packet of a block to the datalink handler, in place. */
+#pragma GCC diagnostic ignored "-Wcast-align"
+static void process_block(const tpacket_block_desc *bd,const afpacket_sink &sink)
+{
+    const uint8_t *base = reinterpret_cast<const uint8_t *>(bd);
+    const tpacket3_hdr *ppd = reinterpret_cast<const tpacket3_hdr *>(base + bd->hdr.bh1.offset_to_first_pkt);
+    for(uint32_t i=0;i<bd->hdr.bh1.num_pkts;i++){
+	const uint8_t *frame = reinterpret_cast<const uint8_t *>(ppd);
+	const struct sockaddr_ll *sll =
+	    reinterpret_cast<const struct sockaddr_ll *>(frame + TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+
+	/* The loopback device shows every packet twice, once going out
+	 * and once coming in; keep only the second.  Without the link
+	 * layer (SOCK_DGRAM) only sll_protocol says what a frame is, and
+	 * the DLT_RAW handler takes IP.
+	 */
+	bool skip = (sll->sll_pkttype==PACKET_OUTGOING && sll->sll_hatype==ARPHRD_LOOPBACK);
+	if(!sink.ethernet && sll->sll_protocol!=htons(ETH_P_IP) && sll->sll_protocol!=htons(ETH_P_IPV6)){
+	    skip = true;
+	}
+	if(!skip){
+	    struct pcap_pkthdr h;
+	    h.ts.tv_sec  = ppd->tp_sec;
+	    h.ts.tv_usec = ppd->tp_nsec / 1000;
+	    h.caplen     = ppd->tp_snaplen;
+	    h.len        = ppd->tp_len;
+	    const u_char *p = frame + ppd->tp_mac;
+
+	    if(sink.ethernet && (ppd->tp_status & TP_STATUS_VLAN_VALID) && h.caplen >= sizeof(struct ether_header)){
+		/* The NIC took the VLAN tag off and the kernel put it in
+		 * the header; what is left is an untagged frame.
+		 */
+		const struct ether_header *eth = reinterpret_cast<const struct ether_header *>(p);
+		uint16_t type = ntohs(eth->ether_type);
+		if(type==ETHERTYPE_IP || type==ETHERTYPE_IPV6){
+		    decoded_packet pi(h.ts,p+sizeof(struct ether_header),h.caplen-sizeof(struct ether_header),
+				   ppd->hv1.tp_vlan_tci);
+		    process_packet_info(pi);
+		}
+	    } else {
+		(*sink.handler)(0,&h,p);
+	    }
+	}
+	ppd = reinterpret_cast<const tpacket3_hdr *>(frame + ppd->tp_next_offset);
+    }
+}
+#pragma GCC diagnostic warning "-Wcast-align"
+
+void afpacket_capture(const char *device,const std::string &expression,bool promisc,
+		      const afpacket_options &opt)
+{
+    if(device==0) die("AF_PACKET capture needs an interface (-i)");
+    long pagesize = sysconf(_SC_PAGESIZE);
+    if(opt.block_size==0 || opt.block_size % pagesize){
+	die("afpacket_block_size must be a multiple of the page size (%ld)",pagesize);
+    }
+    if(opt.blocks==0) die("afpacket_blocks must be at least 1");
+    if(opt.fanout==0 || opt.fanout>256) die("afpacket_fanout must be between 1 and 256");
+
+    /* Ethernet and loopback devices deliver ethernet frames; for
+     * anything else (and "any") the kernel strips the link layer and we
+     * get bare IP packets.
+     */
+    int ifindex = 0;
+    bool ethernet = false;
+    if(strcmp(device,"any")!=0){
+	ifindex = if_nametoindex(device);
+	if(ifindex==0) die("%s: no such interface",device);
+	int s = socket(AF_PACKET,SOCK_DGRAM,0);
+	if(s<0) die("AF_PACKET socket: %s",strerror(errno));
+	struct ifreq ifr;
+	memset(&ifr,0,sizeof(ifr));
+	strncpy(ifr.ifr_name,device,sizeof(ifr.ifr_name)-1);
+	if(ioctl(s,SIOCGIFHWADDR,&ifr)) die("SIOCGIFHWADDR %s: %s",device,strerror(errno));
+	close(s);
+	ethernet = (ifr.ifr_hwaddr.sa_family==ARPHRD_ETHER || ifr.ifr_hwaddr.sa_family==ARPHRD_LOOPBACK);
+    }
+    int socktype = ethernet ? SOCK_RAW : SOCK_DGRAM;
+    int dlt      = ethernet ? DLT_EN10MB : DLT_RAW;
+    afpacket_sink sink(find_handler(dlt,device),ethernet);
+
+    /* The rings live until tcpflow exits. */
+    std::vector<afpacket_ring *> rings;
+    int fanout_group = getpid() & 0xffff;
+    for(uint32_t i=0;i<opt.fanout;i++){
+	rings.push_back(new afpacket_ring());
+	open_ring(*rings.back(),ifindex,socktype,dlt,expression,promisc,opt,fanout_group);
+    }
+    std::vector<struct pollfd> pfds(rings.size());
+    for(size_t i=0;i<rings.size();i++){
+	pfds[i].fd      = rings[i]->fd;
+	pfds[i].events  = POLLIN|POLLERR;
+	pfds[i].revents = 0;
+    }
+
+    DEBUG(1)("listening on %s with %d AF_PACKET ring%s of %d x %d bytes",
+	     device,(int)rings.size(),rings.size()==1 ? "" : "s",(int)opt.blocks,(int)opt.block_size);
+
+    /* Drain every ring that has a block ready; sleep in poll() only
+     * when none has.  Runs until a signal terminates tcpflow, which
+     * also wakes up poll().
+     */
+    while(!terminate_requested){
+	bool any = false;
+	for(size_t i=0;i<rings.size();i++){
+	    afpacket_ring &r = *rings[i];
+	    tpacket_block_desc *bd = r.block(r.next);
+	    if((bd->hdr.bh1.block_status & TP_STATUS_USER)==0) continue;
+	    __sync_synchronize();	// read the packets only after seeing the status
+	    process_block(bd,sink);
+	    __sync_synchronize();	// finish with the packets before giving the block back
+	    bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+	    r.next = (r.next + 1) % r.blocks;
+	    any = true;
+	}
+	if(!any){
+	    if(poll(&pfds[0],pfds.size(),-1)<0 && errno!=EINTR){
+		die("poll: %s",strerror(errno));
+	    }
+	}
+    }
+    for(size_t i=0;i<rings.size();i++){
+	delete rings[i];
+    }
+}
+
+#else
+
+bool afpacket_available() { return false; }
+
+void afpacket_capture(const char *device,const std::string &expression,bool promisc,
+		      const afpacket_options &opt)
+{
+    die("this tcpflow was built without AF_PACKET support");
+}
+
+#endif
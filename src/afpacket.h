@@ -0,0 +1,42 @@
+#ifndef AFPACKET_H
+#define AFPACKET_H
+
+/**
+ * afpacket.h
+ *
+ * Native Linux live capture from a memory-mapped TPACKET_V3 ring, for
+ * links where libpcap's default buffer drops packets.  The kernel fills
+ * blocks of packets in memory shared with tcpflow; packets are handed
+ * to the datalink handlers where they lie, and a block goes back to the
+ * kernel once every packet in it has been processed.
+ *
+ * With fanout > 1 there are several sockets in one PACKET_FANOUT group.
+ * The kernel hashes each connection to one of them, both directions to
+ * the same socket, so the capture load and the buffering are spread
+ * across several rings.
+ */
+
+#include <string>
+#include <stdint.h>
+
+class afpacket_options {
+public:
+    afpacket_options():enabled(false),block_size(1024*1024),blocks(64),fanout(1),block_timeout(100){}
+    bool	enabled;		// -S afpacket=1
+    uint32_t	block_size;		// bytes per ring block; a multiple of the page size
+    uint32_t	blocks;			// blocks per ring
+    uint32_t	fanout;			// sockets in the fanout group
+    uint32_t	block_timeout;		// msec before the kernel hands over a partly filled block
+};
+
+/* true if this tcpflow was built with AF_PACKET support */
+bool afpacket_available();
+
+/**
+ * Capture from device until terminated by a signal.  device "any"
+ * captures on all interfaces.  expression is a libpcap filter.
+ */
+void afpacket_capture(const char *device,const std::string &expression,bool promisc,
+		      const afpacket_options &opt);
+
+#endif
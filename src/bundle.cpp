@@ -0,0 +1,515 @@
+/**
+ * bundle.cpp
+ *
+ * Flow output as chunks in segment files plus a sorted index, and the
+ * "tcpflow extract" command that turns them back into flow files; see
+ * bundle.h.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "bundle.h"
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <queue>
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#endif
+
+const std::string flow_bundle::index_name("bundle.idx");
+
+flow_bundle::stats_t &flow_bundle::stats_t::operator+=(const stats_t &b)
+{
+    segments += b.segments;
+    bytes    += b.bytes;
+    chunks   += b.chunks;
+    records  += b.records;
+    runs     += b.runs;
+    return *this;
+}
+
+static unsigned int next_tag = 0;
+
+flow_bundle::flow_bundle(const std::string &outdir_,uint64_t segment_size_):
+    stats(),outdir(outdir_),segment_size(segment_size_),tag(__sync_fetch_and_add(&next_tag,1)),
+    segment(0),fd(-1),seg_pos(0),buf(new uint8_t[WRITE_BUFFER]),buf_len(0),
+    records(),records_size(0),runs()
+{
+}
+
+flow_bundle::~flow_bundle()
+{
+    finish();
+    delete [] buf;
+}
+
+std::string flow_bundle::segment_name(uint32_t n) const
+{
+    char name[64];
+    snprintf(name,sizeof(name),"bundle.%u.%06u.seg",tag,n);
+    return std::string(name);
+}
+
+static void write_all(int fd,const uint8_t *data,size_t length,const std::string &name)
+{
+    while(length>0){
+	ssize_t r = write(fd,data,length);
+	if(r<0 && errno==EINTR) continue;
+	if(r<=0) die("%s: %s",name.c_str(),r<0 ? strerror(errno) : "short write");
+	data   += r;
+	length -= r;
+    }
+}
+
+void flow_bundle::open_segment()
+{
+    std::string path = outdir + "/" + segment_name(segment);
+    fd = ::open(path.c_str(),O_WRONLY | O_BINARY | O_CREAT | O_TRUNC,0666);
+    if(fd<0) die("%s: %s",path.c_str(),strerror(errno));
+    seg_pos = 0;
+    stats.segments++;
+}
+
+void flow_bundle::flush()
+{
+    if(buf_len==0) return;
+    write_all(fd,buf,buf_len,segment_name(segment));
+    buf_len = 0;
+}
+
+flow_bundle::chunk flow_bundle::append(const uint8_t *data,size_t length)
+{
+    if(fd<0){
+	open_segment();
+    } else if(seg_pos>0 && seg_pos+length > segment_size){
+	flush();			// start the next segment
+	::close(fd);
+	segment++;
+	open_segment();
+    }
+    chunk c;
+    c.segment    = segment;
+    c.seg_offset = seg_pos;
+    c.length     = length;
+    if(length >= WRITE_BUFFER){
+	flush();
+	write_all(fd,data,length,segment_name(segment));
+    } else {
+	if(buf_len+length > WRITE_BUFFER) flush();
+	memcpy(buf+buf_len,data,length);
+	buf_len += length;
+    }
+    seg_pos += length;
+    stats.chunks++;
+    stats.bytes += length;
+    return c;
+}
+
+static bool before_in_flow(const flow_bundle::chunk &a,const flow_bundle::chunk &b)
+{
+    return a.offset < b.offset;
+}
+
+/* For a flow that was not written in order from its start, so that its
+ * digests could not be computed as it was stored.  Where chunks overlap
+ * the later one wins, as it would have in a file of its own.
+ */
+void flow_bundle::digest_flow(const chunks_t &chunks,digest_set &ds)
+{
+    /* the parts of each chunk that no later chunk overwrote, in flow order */
+    chunks_t pieces;
+    range_set covered;
+    for(chunks_t::const_reverse_iterator it=chunks.rbegin();it!=chunks.rend();it++){
+	range_set::ranges_t fresh;
+	covered.missing(it->offset,it->offset+it->length,fresh);
+	for(range_set::ranges_t::const_iterator r=fresh.begin();r!=fresh.end();r++){
+	    chunk c(*it);
+	    c.seg_offset += r->first - it->offset;
+	    c.offset      = r->first;
+	    c.length      = r->second - r->first;
+	    pieces.push_back(c);
+	}
+	covered.add(it->offset,it->offset+it->length);
+    }
+    std::sort(pieces.begin(),pieces.end(),before_in_flow);
+
+    flush();				// the flow's last chunks may still be in buf
+    std::vector<uint8_t> block(64*1024);
+    int sfd = -1;
+    uint32_t sfd_segment = 0;
+    uint64_t at = 0;			// in the flow
+    for(chunks_t::const_iterator it=pieces.begin();it!=pieces.end();it++){
+	if(at < it->offset){		// a hole
+	    memset(&block[0],0,block.size());
+	    while(at < it->offset){
+		size_t n = std::min((uint64_t)block.size(),it->offset - at);
+		ds.update(&block[0],n);
+		at += n;
+	    }
+	}
+	if(sfd<0 || sfd_segment!=it->segment){
+	    if(sfd>=0) ::close(sfd);
+	    std::string path = outdir + "/" + segment_name(it->segment);
+	    sfd = ::open(path.c_str(),O_RDONLY|O_BINARY);
+	    if(sfd<0) die("%s: %s",path.c_str(),strerror(errno));
+	    sfd_segment = it->segment;
+	}
+	for(uint64_t done=0;done<it->length;){
+	    size_t n = std::min((uint64_t)block.size(),it->length - done);
+	    ssize_t r = pread(sfd,&block[0],n,it->seg_offset + done);
+	    if(r<0 && errno==EINTR) continue;
+	    if(r<=0){
+		die("%s: cannot read %d bytes at %"PRIu64,segment_name(it->segment).c_str(),
+		    (int)n,it->seg_offset + done);
+	    }
+	    ds.update(&block[0],r);
+	    done += r;
+	}
+	at = it->offset + it->length;
+    }
+    if(sfd>=0) ::close(sfd);
+}
+
+/* Addresses are written out in full so that the index is easy to parse. */
+static void format_addr(char *out,size_t outlen,const ipaddr &a,sa_family_t family)
+{
+    if(family==AF_INET6){
+	snprintf(out,outlen,"%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x",
+		 a.addr[0],a.addr[1],a.addr[2],a.addr[3],a.addr[4],a.addr[5],a.addr[6],a.addr[7],
+		 a.addr[8],a.addr[9],a.addr[10],a.addr[11],a.addr[12],a.addr[13],a.addr[14],a.addr[15]);
+    } else {
+	snprintf(out,outlen,"%d.%d.%d.%d",a.addr[0],a.addr[1],a.addr[2],a.addr[3]);
+    }
+}
+
+void flow_bundle::add_flow(flow &f,const chunks_t &chunks)
+{
+    if(chunks.empty()) return;
+
+    /* everything up to the segment is the same for all the flow's records */
+    char src[64],dst[64],line[512];
+    format_addr(src,sizeof(src),f.src,f.family);
+    format_addr(dst,sizeof(dst),f.dst,f.family);
+    snprintf(line,sizeof(line),"\t%s\t%d\t%s\t%d\t%d\t%010ld.%06ld\t%010ld.%06ld\t%u.%"PRIu64"\t",
+	     src,(int)f.sport,dst,(int)f.dport,(int)f.vlan,
+	     (long)f.tstart.tv_sec,(long)f.tstart.tv_usec,(long)f.tlast.tv_sec,(long)f.tlast.tv_usec,
+	     tag,f.id);
+    std::string head;
+    f.filename(head);
+    head += line;
+
+    for(chunks_t::const_iterator it=chunks.begin();it!=chunks.end();it++){
+	snprintf(line,sizeof(line),"%s\t%"PRIu64"\t%"PRIu64"\t%u",
+		 segment_name(it->segment).c_str(),it->seg_offset,it->offset,it->length);
+	records.push_back(head + line);
+	records_size += records.back().size() + sizeof(std::string);
+	stats.records++;
+    }
+    if(records_size >= RUN_SIZE) spill();
+}
+
+void flow_bundle::spill()
+{
+    char name[64];
+    snprintf(name,sizeof(name),"bundle.%u.%06u.run",tag,(unsigned int)runs.size());
+    std::string path = outdir + "/" + name;
+
+    std::sort(records.begin(),records.end());
+    FILE *f = fopen(path.c_str(),"w");
+    if(f==0) die("%s: %s",path.c_str(),strerror(errno));
+    for(std::vector<std::string>::const_iterator it=records.begin();it!=records.end();it++){
+	fputs(it->c_str(),f);
+	fputc('\n',f);
+    }
+    if(fclose(f)) die("%s: %s",path.c_str(),strerror(errno));
+    runs.push_back(path);
+    std::vector<std::string>().swap(records);
+    records_size = 0;
+    stats.runs++;
+}
+
+void flow_bundle::finish()
+{
+    if(fd>=0){
+	flush();
+	::close(fd);
+	fd = -1;
+	segment++;			// appends after this go to a new segment
+    }
+    if(records.size()) spill();
+}
+
+void flow_bundle::write_index(const std::string &outdir,const std::vector<flow_bundle *> &bundles)
+{
+    std::vector<std::string> all;
+    for(std::vector<flow_bundle *>::const_iterator it=bundles.begin();it!=bundles.end();it++){
+	(*it)->finish();
+	all.insert(all.end(),(*it)->runs.begin(),(*it)->runs.end());
+	(*it)->runs.clear();
+    }
+    std::string path = outdir + "/" + index_name;
+    if(all.size()==1){
+	if(rename(all[0].c_str(),path.c_str())) die("%s: %s",path.c_str(),strerror(errno));
+	return;
+    }
+
+    /* k-way merge of the sorted runs */
+    FILE *out = fopen(path.c_str(),"w");
+    if(out==0) die("%s: %s",path.c_str(),strerror(errno));
+    typedef std::pair<std::string,size_t> head_t;	// next line of run n
+    std::priority_queue<head_t,std::vector<head_t>,std::greater<head_t> > heads;
+    std::vector<std::ifstream *> in;
+    for(size_t i=0;i<all.size();i++){
+	in.push_back(new std::ifstream(all[i].c_str()));
+	std::string line;
+	if(std::getline(*in[i],line)) heads.push(head_t(line,i));
+    }
+    while(!heads.empty()){
+	head_t h = heads.top();
+	heads.pop();
+	fputs(h.first.c_str(),out);
+	fputc('\n',out);
+	if(std::getline(*in[h.second],h.first)) heads.push(h);
+    }
+    for(size_t i=0;i<all.size();i++){
+	delete in[i];
+	unlink(all[i].c_str());
+    }
+    if(fclose(out)) die("%s: %s",path.c_str(),strerror(errno));
+}
+
+
+/****************************************************************
+ *** tcpflow extract
+ ****************************************************************/
+
+/* bundle.idx, mapped or read into memory */
+class bundle_index {
+public:
+    bundle_index(const std::string &path):data(0),size(0),mapped(false){
+	int fd = ::open(path.c_str(),O_RDONLY|O_BINARY);
+	struct stat st;
+	if(fd<0 || fstat(fd,&st)) die("%s: %s",path.c_str(),strerror(errno));
+	size = st.st_size;
+	if(size==0){
+	    ::close(fd);
+	    return;
+	}
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+	void *m = mmap(0,size,PROT_READ,MAP_SHARED,fd,0);
+	if(m!=MAP_FAILED){
+	    data = static_cast<const char *>(m);
+	    mapped = true;
+	    ::close(fd);
+	    return;
+	}
+#endif
+	char *b = new char[size];
+	if(pread(fd,b,size,0)!=(ssize_t)size) die("%s: %s",path.c_str(),strerror(errno));
+	data = b;
+	::close(fd);
+    }
+    ~bundle_index(){
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+	if(mapped){
+	    munmap(const_cast<char *>(data),size);
+	    return;
+	}
+#endif
+	delete [] data;
+    }
+    size_t line_end(size_t at) const {	// just past the '\n' ending the line at at
+	const char *nl = static_cast<const char *>(memchr(data+at,'\n',size-at));
+	return nl ? nl-data+1 : size;
+    }
+    size_t line_len(size_t at,size_t end) const { // without the '\n'
+	return (end>at && data[end-1]=='\n') ? end-at-1 : end-at;
+    }
+    /* compares the start of the line at at with key */
+    int compare(size_t at,const std::string &key) const {
+	size_t len = line_end(at) - at;
+	int r = memcmp(data+at,key.data(),std::min(len,key.size()));
+	if(r==0 && len<key.size()) return -1;
+	return r;
+    }
+    /* the first line that does not sort before key */
+    size_t lower_bound(const std::string &key) const {
+	size_t lo = 0,hi = size;	// both at line starts
+	while(lo<hi){
+	    size_t s = lo + (hi-lo)/2;
+	    while(s>lo && data[s-1]!='\n') s--;
+	    if(compare(s,key)<0) lo = line_end(s);
+	    else hi = s;
+	}
+	return lo;
+    }
+    const char *data;
+    size_t	size;
+private:
+    bool	mapped;
+    bundle_index(const bundle_index &);
+    bundle_index &operator=(const bundle_index &);
+};
+
+/* Writes the flows of consecutive index records to their files. */
+class bundle_extractor {
+public:
+    bundle_extractor(const std::string &bundledir_,const std::string &outdir_):
+	flows(0),bundledir(bundledir_),outdir(outdir_),segments(),buf(),
+	name(),instance(),fd(-1),base(0),extent(0),tstart(){}
+    ~bundle_extractor(){
+	close_flow();
+	for(std::map<std::string,int>::const_iterator it=segments.begin();it!=segments.end();it++){
+	    ::close(it->second);
+	}
+    }
+    void record(const char *line,size_t len);
+    void close_flow();
+    uint64_t flows;			// files written
+
+private:
+    int segment_fd(const std::string &seg);
+    std::string bundledir,outdir;
+    std::map<std::string,int> segments;	// open segment files
+    std::vector<char> buf;
+    std::string name;			// flow being written
+    std::string instance;		// tstart and instance of its current record group
+    int		fd;
+    uint64_t	base;			// flow offset 0 of this instance in the file
+    uint64_t	extent;			// end of the data in the file so far
+    struct timeval tstart;
+    bundle_extractor(const bundle_extractor &);
+    bundle_extractor &operator=(const bundle_extractor &);
+};
+
+int bundle_extractor::segment_fd(const std::string &seg)
+{
+    std::map<std::string,int>::const_iterator it = segments.find(seg);
+    if(it!=segments.end()) return it->second;
+    std::string path = bundledir + "/" + seg;
+    int sfd = ::open(path.c_str(),O_RDONLY|O_BINARY);
+    if(sfd<0) die("%s: %s",path.c_str(),strerror(errno));
+    segments[seg] = sfd;
+    return sfd;
+}
+
+void bundle_extractor::close_flow()
+{
+    if(fd<0) return;
+    set_file_times(fd,tstart);
+    ::close(fd);
+    fd = -1;
+    name.clear();
+    flows++;
+}
+
+void bundle_extractor::record(const char *line,size_t len)
+{
+    std::vector<std::string> fields;
+    const char *end = line+len;
+    while(line<=end){
+	const char *tab = static_cast<const char *>(memchr(line,'\t',end-line));
+	if(tab==0) tab = end;
+	fields.push_back(std::string(line,tab));
+	line = tab+1;
+    }
+    if(fields.size()!=13){
+	DEBUG(1)("bundle index: bad record for %s",fields[0].c_str());
+	return;
+    }
+    enum { NAME=0,TSTART=6,INSTANCE=8,SEGMENT=9,SEG_OFFSET=10,OFFSET=11,LENGTH=12 };
+
+    if(fields[NAME]!=name){
+	close_flow();
+	name = fields[NAME];
+	instance.clear();
+	base = extent = 0;
+	std::string path = outdir + "/" + name;
+	for(size_t i=outdir.size()+1;(i=path.find('/',i))!=std::string::npos;i++){
+	    MKDIR(path.substr(0,i).c_str(),0777); // names may have directories in them
+	}
+	fd = ::open(path.c_str(),O_WRONLY|O_BINARY|O_CREAT|O_TRUNC,0666);
+	if(fd<0) die("%s: %s",path.c_str(),strerror(errno));
+	DEBUG(5)("extracting %s",path.c_str());
+    }
+    std::string inst = fields[TSTART] + "\t" + fields[INSTANCE];
+    if(inst!=instance){			// the next instance goes after the last, as it would in a file
+	instance = inst;
+	base = extent;
+	tstart.tv_sec  = strtol(fields[TSTART].c_str(),0,10);
+	tstart.tv_usec = strtol(fields[TSTART].c_str()+fields[TSTART].find('.')+1,0,10);
+    }
+
+    uint64_t seg_offset = strtoull(fields[SEG_OFFSET].c_str(),0,10);
+    uint64_t offset     = base + strtoull(fields[OFFSET].c_str(),0,10);
+    size_t   length     = strtoul(fields[LENGTH].c_str(),0,10);
+    buf.resize(length);
+    if(length==0) return;
+    if(pread(segment_fd(fields[SEGMENT]),&buf[0],length,seg_offset)!=(ssize_t)length){
+	die("%s: cannot read %d bytes at %"PRIu64,fields[SEGMENT].c_str(),(int)length,seg_offset);
+    }
+    if(pwrite(fd,&buf[0],length,offset)!=(ssize_t)length){
+	die("%s/%s: %s",outdir.c_str(),name.c_str(),strerror(errno));
+    }
+    if(offset+length > extent) extent = offset+length;
+}
+
+int bundle_extract(int argc,char **argv)
+{
+    std::string outdir(".");
+    int arg;
+    while ((arg = getopt(argc, argv, "d:o:")) != EOF) {
+	switch(arg){
+	case 'd': debug = atoi(optarg); break;
+	case 'o': outdir = optarg; break;
+	default:
+	    std::cerr << "usage: " << progname << " extract [-d debug] [-o outdir] bundledir [name ...]\n";
+	    return 1;
+	}
+    }
+    if(optind>=argc){
+	std::cerr << "usage: " << progname << " extract [-d debug] [-o outdir] bundledir [name ...]\n";
+	return 1;
+    }
+    std::string bundledir = argv[optind++];
+    struct stat sbuf;
+    if(stat(outdir.c_str(),&sbuf) && MKDIR(outdir.c_str(),0777)){
+	std::cerr << "cannot create " << outdir << ": " << strerror(errno) << "\n";
+	return 1;
+    }
+
+    bundle_index idx(bundledir + "/" + flow_bundle::index_name);
+    bundle_extractor ex(bundledir,outdir);
+    int missing = 0;
+    if(optind==argc){			// all of them
+	for(size_t at=0;at<idx.size;){
+	    size_t end = idx.line_end(at);
+	    ex.record(idx.data+at,idx.line_len(at,end));
+	    at = end;
+	}
+    }
+    for(;optind<argc;optind++){		// the flows whose names start with each argument
+	std::string key(argv[optind]);
+	size_t at = idx.lower_bound(key);
+	if(at>=idx.size || idx.compare(at,key)!=0){
+	    std::cerr << key << ": no such flow in " << bundledir << "\n";
+	    missing++;
+	    continue;
+	}
+	while(at<idx.size && idx.compare(at,key)==0){
+	    size_t end = idx.line_end(at);
+	    ex.record(idx.data+at,idx.line_len(at,end));
+	    at = end;
+	}
+	ex.close_flow();
+    }
+    ex.close_flow();
+    DEBUG(1)("%"PRIu64" flows extracted to %s",ex.flows,outdir.c_str());
+    return missing ? 1 : 0;
+}
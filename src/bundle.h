@@ -0,0 +1,107 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+/**
+ * bundle.h
+ *
+ * Bundle output (-S bundle=1): instead of a file per flow, flow data is
+ * appended as chunks to a few large segment files in the output
+ * directory, and bundle.idx says where each flow's bytes went.
+ *
+ * Each tcpdemux (each shard) has its own flow_bundle, which writes
+ * bundle.<tag>.<n>.seg segments of up to segment_size bytes.  A flow's
+ * writes become chunks: segment, offset in the segment, offset in the
+ * flow, length.  When the flow is deleted its chunks become index
+ * records, which are kept in memory, sorted, and spilled to run files;
+ * at the end all the runs are merged into bundle.idx, a text file with
+ * one record per line, sorted by flow name:
+ *
+ *   name src sport dst dport vlan tstart tlast instance segment seg_offset offset length
+ *
+ * separated by tabs.  A flow that is seen more than once has a record
+ * group per instance, and extracting it appends the instances in order,
+ * as the per-flow files would have.  "tcpflow extract" (bundle_extract())
+ * finds flows in the index by binary search and writes them out.
+ */
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/time.h>
+
+class flow;
+class digest_set;
+
+class flow_bundle {
+public:
+    enum { DEFAULT_SEGMENT_SIZE=1024*1024*1024 };
+    static const std::string index_name;	// "bundle.idx"
+
+    class chunk {
+    public:
+	chunk():segment(0),length(0),seg_offset(0),offset(0){}
+	uint32_t segment;		// number of the segment holding the bytes
+	uint32_t length;
+	uint64_t seg_offset;		// where they are in it
+	uint64_t offset;		// where they go in the flow
+    };
+    typedef std::vector<chunk> chunks_t;
+
+    class stats_t {
+    public:
+	stats_t():segments(0),bytes(0),chunks(0),records(0),runs(0){}
+	uint64_t segments;		// segment files written
+	uint64_t bytes;			// flow bytes appended to them
+	uint64_t chunks;		// writes that appended them
+	uint64_t records;		// index records
+	uint64_t runs;			// sorted runs spilled before the final merge
+	stats_t &operator+=(const stats_t &b);
+    };
+
+    flow_bundle(const std::string &outdir,uint64_t segment_size);
+    ~flow_bundle();			// finish()es
+
+    chunk append(const uint8_t *data,size_t length); // into the current segment
+    void add_flow(flow &f,const chunks_t &chunks);   // index records for a deleted flow
+    void finish();			// flush the segment and spill the last run
+
+    /* Run a flow's bytes through ds, read back from the segments, as
+     * "tcpflow extract" would lay them out: holes are zeros.
+     */
+    void digest_flow(const chunks_t &chunks,digest_set &ds);
+
+    /* Merge the runs of every bundle into outdir/bundle.idx. */
+    static void write_index(const std::string &outdir,const std::vector<flow_bundle *> &bundles);
+
+    stats_t	stats;
+
+private:
+    enum { WRITE_BUFFER=1024*1024 };	// segment writes are gathered into this much
+    enum { RUN_SIZE=64*1024*1024 };	// bytes of index records kept before a run is spilled
+
+    std::string segment_name(uint32_t n) const;
+    void	open_segment();
+    void	flush();
+    void	spill();			// sort records into a run file
+
+    std::string	outdir;
+    uint64_t	segment_size;
+    unsigned int tag;			// distinguishes the bundles of a run's shards
+    uint32_t	segment;		// number of the open segment
+    int		fd;			// the open segment; -1 before the first append
+    uint64_t	seg_pos;		// bytes in it, counting buf
+    uint8_t	*buf;			// WRITE_BUFFER bytes not yet written
+    size_t	buf_len;
+    std::vector<std::string> records;	// index records not yet spilled
+    size_t	records_size;
+    std::vector<std::string> runs;	// files of sorted records
+
+    /* not implemented */
+    flow_bundle(const flow_bundle &);
+    flow_bundle &operator=(const flow_bundle &);
+};
+
+/* tcpflow extract [-o outdir] bundledir [name-prefix ...] */
+int bundle_extract(int argc,char **argv);
+
+#endif
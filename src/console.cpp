@@ -0,0 +1,290 @@
+/**
+ * console.cpp
+ *
+ * Batched console output; see console.h.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "console.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* AVX2 is used through a function-level target attribute, so the rest
+ * of tcpflow is built for any x86-64.
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))
+#define CONSOLE_AVX2
+#include <immintrin.h>
+#endif
+
+/****************************************************************
+ *** Stripping non-printable bytes
+ ****************************************************************/
+
+/* isprint() in the C locale, which tcpflow runs in, and the line ends */
+static inline bool printable(u_char c)
+{
+    return (c>=0x20 && c<0x7f) || c=='\n' || c=='\r';
+}
+
+typedef size_t strip_fn_t(char *out,const u_char *p,size_t n);
+
+/* Copy the printable bytes of [p,p+n) to out; returns how many there were. */
+static size_t strip_c(char *out,const u_char *p,size_t n)
+{
+    size_t o = 0;
+    for(size_t i=0;i<n;i++){
+	out[o] = p[i];
+	o += printable(p[i]);
+    }
+    return o;
+}
+
+/* The same for a block whose printable bytes are the bits set in mask */
+static inline size_t strip_mask(char *out,const u_char *p,uint32_t mask,unsigned int n)
+{
+    size_t o = 0;
+    for(unsigned int j=0;j<n;j++){
+	out[o] = p[j];
+	o += (mask >> j) & 1;
+    }
+    return o;
+}
+
+/* Adding 0x60 takes ' '..'~' to -128..-34 as signed bytes, and every
+ * other byte above that, so one signed compare finds them.  A block
+ * that is all printable, as text mostly is, is copied in one store.
+ */
+#ifdef __SSE2__
+static size_t strip_sse2(char *out,const u_char *p,size_t n)
+{
+    const __m128i bias  = _mm_set1_epi8(0x60);
+    const __m128i limit = _mm_set1_epi8(-33);
+    const __m128i nl    = _mm_set1_epi8('\n');
+    const __m128i cr    = _mm_set1_epi8('\r');
+    size_t o = 0,i = 0;
+    for(;i+16<=n;i+=16){
+	__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p+i));
+	__m128i keep = _mm_or_si128(_mm_cmplt_epi8(_mm_add_epi8(v,bias),limit),
+				    _mm_or_si128(_mm_cmpeq_epi8(v,nl),_mm_cmpeq_epi8(v,cr)));
+	uint32_t mask = (uint32_t)_mm_movemask_epi8(keep);
+	if(mask==0xffff){
+	    _mm_storeu_si128(reinterpret_cast<__m128i *>(out+o),v);
+	    o += 16;
+	} else {
+	    o += strip_mask(out+o,p+i,mask,16);
+	}
+    }
+    return o + strip_c(out+o,p+i,n-i);
+}
+#endif
+
+#ifdef CONSOLE_AVX2
+__attribute__((target("avx2")))
+static size_t strip_avx2(char *out,const u_char *p,size_t n)
+{
+    const __m256i bias  = _mm256_set1_epi8(0x60);
+    const __m256i limit = _mm256_set1_epi8(-33);
+    const __m256i nl    = _mm256_set1_epi8('\n');
+    const __m256i cr    = _mm256_set1_epi8('\r');
+    size_t o = 0,i = 0;
+    for(;i+32<=n;i+=32){
+	__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p+i));
+	__m256i keep = _mm256_or_si256(_mm256_cmpgt_epi8(limit,_mm256_add_epi8(v,bias)),
+				       _mm256_or_si256(_mm256_cmpeq_epi8(v,nl),_mm256_cmpeq_epi8(v,cr)));
+	uint32_t mask = (uint32_t)_mm256_movemask_epi8(keep);
+	if(mask==0xffffffffU){
+	    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out+o),v);
+	    o += 32;
+	} else {
+	    o += strip_mask(out+o,p+i,mask,32);
+	}
+    }
+    return o + strip_c(out+o,p+i,n-i);
+}
+
+static bool cpu_has_avx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#else
+static bool cpu_has_avx2() { return false; }
+#endif
+
+static const bool have_avx2 = cpu_has_avx2();
+#if defined(CONSOLE_AVX2)
+static strip_fn_t *const strip = have_avx2 ? strip_avx2 : strip_sse2;
+#elif defined(__SSE2__)
+static strip_fn_t *const strip = strip_sse2;
+#else
+static strip_fn_t *const strip = strip_c;
+#endif
+
+bool console_writer::avx2()
+{
+    return have_avx2;
+}
+
+/****************************************************************
+ *** console_writer
+ ****************************************************************/
+
+static uint64_t msec_between(const struct timeval &t0,const struct timeval &t1)
+{
+    return (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_usec - t0.tv_usec) / 1000;
+}
+
+#ifdef HAVE_PTHREAD
+class console_writer::sync {
+public:
+    sync():lock(),tick(),timer(),running(false){
+	pthread_mutex_init(&lock,0);
+	pthread_cond_init(&tick,0);
+    }
+    ~sync(){
+	pthread_cond_destroy(&tick);
+	pthread_mutex_destroy(&lock);
+    }
+    pthread_mutex_t lock;		// buf and the counters
+    pthread_cond_t  tick;		// signalled to stop the timer
+    pthread_t	timer;
+    bool	running;
+private:
+    /* not implemented */
+    sync(const sync &);
+    sync &operator=(const sync &);
+};
+#else
+class console_writer::sync {};
+#endif
+
+console_writer::console_writer(size_t flush_bytes_,unsigned int flush_msec_):
+    flush_bytes(flush_bytes_),flush_msec(flush_msec_),writes(0),segments(0),
+    buf(),oldest(),stopping(false),threads(new sync())
+{
+    buf.reserve(flush_bytes + 4096);
+#ifdef HAVE_PTHREAD
+    if(flush_bytes>0){
+	if(pthread_create(&threads->timer,0,run,this)) die("pthread_create: %s",strerror(errno));
+	threads->running = true;
+    }
+#endif
+}
+
+console_writer::~console_writer()
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&threads->lock);
+    stopping = true;
+    pthread_cond_signal(&threads->tick);
+    pthread_mutex_unlock(&threads->lock);
+    if(threads->running) pthread_join(threads->timer,0);
+#endif
+    flush();
+    DEBUG(2)("console: %" PRIu64 " segments in %" PRIu64 " writes",segments,writes);
+    delete threads;
+}
+
+void console_writer::lock()
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&threads->lock);
+#endif
+    if(buf.empty()) gettimeofday(&oldest,0);
+}
+
+void console_writer::unlock()
+{
+    segments++;
+    if(buf.size() >= flush_bytes){
+	write_buffer();
+    } else {
+	struct timeval now;
+	gettimeofday(&now,0);
+	if(msec_between(oldest,now) >= flush_msec) write_buffer();
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&threads->lock);
+#endif
+}
+
+void console_writer::append(const char *s,size_t length)
+{
+    buf.append(s,length);
+}
+
+void console_writer::append_printable(const u_char *data,size_t length)
+{
+    size_t at = buf.size();
+    buf.resize(at + length);
+    buf.resize(at + strip(&buf[at],data,length));
+}
+
+void console_writer::flush()
+{
+    lock();
+    if(buf.size()) write_buffer();
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&threads->lock);
+#endif
+}
+
+/* One write for the whole batch, and the -L semaphore once for it */
+void console_writer::write_buffer()
+{
+#ifdef HAVE_PTHREAD
+    if(semlock){
+	if(sem_wait(semlock)){
+	    fprintf(stderr,"%s: attempt to acquire semaphore failed: %s\n",progname,strerror(errno));
+	    exit(1);
+	}
+    }
+#endif
+
+    if(fwrite(buf.data(),1,buf.size(),stdout) != buf.size() || fflush(stdout)){
+	std::cerr << "\nwrite error to stdout\n";
+    }
+    writes++;
+    buf.clear();
+
+#ifdef HAVE_PTHREAD
+    if(semlock){
+	if(sem_post(semlock)){
+	    fprintf(stderr,"%s: attempt to post semaphore failed: %s\n",progname,strerror(errno));
+	    exit(1);
+	}
+    }
+#endif
+}
+
+/* The timer: write a buffer that has waited flush_msec, even if no
+ * more segments come to do it.
+ */
+void *console_writer::run(void *arg)
+{
+#ifdef HAVE_PTHREAD
+    console_writer *c = reinterpret_cast<console_writer *>(arg);
+    pthread_mutex_lock(&c->threads->lock);
+    while(!c->stopping){
+	struct timeval now;
+	gettimeofday(&now,0);
+	uint64_t usec = (uint64_t)now.tv_usec + (c->flush_msec ? c->flush_msec : 1) * 1000ULL;
+	struct timespec deadline;
+	deadline.tv_sec  = now.tv_sec + usec / 1000000;
+	deadline.tv_nsec = (usec % 1000000) * 1000;
+	pthread_cond_timedwait(&c->threads->tick,&c->threads->lock,&deadline);
+	if(c->buf.size()){
+	    gettimeofday(&now,0);
+	    if(msec_between(c->oldest,now) >= c->flush_msec) c->write_buffer();
+	}
+    }
+    pthread_mutex_unlock(&c->threads->lock);
+#endif
+    return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+/**
+ * console.h
+ *
+ * Output of -c and -C: the segments that tcpip::print_packet() prints,
+ * collected in one buffer and written to stdout in batches.
+ *
+ * A segment is put together between lock() and unlock(), so that the
+ * segments of different shards do not run into each other.  unlock()
+ * writes the buffer once it holds flush_bytes, or once its oldest
+ * segment has waited flush_msec; with threads, a timer thread also
+ * writes a buffer that has waited that long, so a quiet live capture
+ * still shows its last packets.  The -L semaphore is held for each
+ * write, not for each segment.  flush_bytes=0 writes every segment as
+ * it is printed.
+ */
+
+#include <string>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+class console_writer {
+public:
+    enum { DEFAULT_BUFFER=1024*1024 };
+    enum { DEFAULT_FLUSH_MSEC=100 };
+
+    console_writer(size_t flush_bytes_,unsigned int flush_msec_);
+    ~console_writer();			// flush()es
+
+    void lock();
+    void unlock();			// flushing if it is time
+    void append(const char *s,size_t length);
+    void append(const char *s) { append(s,strlen(s)); }
+    void append(const std::string &s) { append(s.data(),s.size()); }
+    void append_printable(const u_char *data,size_t length); // without the non-printable bytes but \n and \r
+    void flush();			// write what is buffered
+
+    static bool avx2();			// true if append_printable() uses AVX2
+
+    size_t	flush_bytes;
+    unsigned int flush_msec;
+    uint64_t	writes;			// batches written
+    uint64_t	segments;		// segments printed
+
+private:
+    class sync;				// the lock and the timer thread (console.cpp)
+    static void *run(void *arg);
+    void	write_buffer();		// with the lock held
+
+    std::string	buf;
+    struct timeval oldest;		// when the first segment in buf was printed
+    bool	stopping;
+    sync	*threads;
+
+    /* not implemented */
+    console_writer(const console_writer &);
+    console_writer &operator=(const console_writer &);
+};
+
+#endif
@@ -83,7 +83,7 @@ void dl_null(u_char *user, const struct pcap_pkthdr *h, const u_char *p)
 #endif
 
     //process_packet(h->ts,p + NULL_HDRLEN, caplen - NULL_HDRLEN,flow::NO_VLAN);
-    packet_info pi(h->ts,p+NULL_HDRLEN,caplen - NULL_HDRLEN,flow::NO_VLAN);
+    decoded_packet pi(h->ts,p+NULL_HDRLEN,caplen - NULL_HDRLEN,flow::NO_VLAN);
     process_packet_info(pi);
 }
 #pragma GCC diagnostic warning "-Wcast-align"
@@ -129,7 +129,7 @@ void dl_ethernet(u_char *user, const struct pcap_pkthdr *h, const u_char *p)
     case ETHERTYPE_IPV6:
 	//process_packet_info(h->ts,ether_data, caplen - sizeof(struct ether_header),vlan);
     {
-	packet_info pi(h->ts,ether_data, caplen - sizeof(struct ether_header),vlan);
+	decoded_packet pi(h->ts,ether_data, caplen - sizeof(struct ether_header),vlan);
 	process_packet_info(pi);
 	return;
     }
@@ -173,7 +173,7 @@ void dl_ppp(u_char *user, const struct pcap_pkthdr *h, const u_char *p)
     }
 
     //process_packet_info(h->ts,p + PPP_HDRLEN, caplen - PPP_HDRLEN,flow::NO_VLAN);
-    packet_info pi(h->ts,p + PPP_HDRLEN, caplen - PPP_HDRLEN,flow::NO_VLAN);
+    decoded_packet pi(h->ts,p + PPP_HDRLEN, caplen - PPP_HDRLEN,flow::NO_VLAN);
     process_packet_info(pi);
 }
 
@@ -191,7 +191,7 @@ void dl_raw(u_char *user, const struct pcap_pkthdr *h, const u_char *p)
 		  caplen, length);
     }
     //process_packet_info(h->ts,p, caplen,flow::NO_VLAN);
-    packet_info pi(h->ts,p, caplen,flow::NO_VLAN);
+    decoded_packet pi(h->ts,p, caplen,flow::NO_VLAN);
     process_packet_info(pi);
 }
 
@@ -212,7 +212,7 @@ void dl_linux_sll(u_char *user, const struct pcap_pkthdr *h, const u_char *p){
     }
   
     //process_packet_info(h->ts,p + SLL_HDR_LEN, caplen - SLL_HDR_LEN,flow::NO_VLAN);
-    packet_info pi(h->ts,p + SLL_HDR_LEN, caplen - SLL_HDR_LEN,flow::NO_VLAN);
+    decoded_packet pi(h->ts,p + SLL_HDR_LEN, caplen - SLL_HDR_LEN,flow::NO_VLAN);
     process_packet_info(pi);
 }
 
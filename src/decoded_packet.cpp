@@ -0,0 +1,139 @@
+/**
+ * decoded_packet.cpp
+ *
+ * Decoding a packet's IP and TCP headers once, for every packet
+ * callback; see class decoded_packet in tcpdemux.h.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+
+/* Note: we don't support IPv6 extended headers */
+
+struct private_ip6_hdr {
+	union {
+		struct ip6_hdrctl {
+			uint32_t ip6_un1_flow;	/* 20 bits of flow-ID */
+			uint16_t ip6_un1_plen;	/* payload length */
+			uint8_t  ip6_un1_nxt;	/* next header */
+			uint8_t  ip6_un1_hlim;	/* hop limit */
+		} ip6_un1;
+		uint8_t ip6_un2_vfc;	/* 4 bits version, top 4 bits class */
+	} ip6_ctlun;
+	struct private_in6_addr ip6_src;	/* source address */
+	struct private_in6_addr ip6_dst;	/* destination address */
+} __attribute__((__packed__));
+
+/* These might be defined from an include file, so undef them to be sure */
+#undef ip6_vfc
+#undef ip6_flow
+#undef ip6_plen
+#undef ip6_nxt
+#undef ip6_hlim
+#undef ip6_hops
+
+#define ip6_vfc		ip6_ctlun.ip6_un2_vfc
+#define ip6_flow	ip6_ctlun.ip6_un1.ip6_un1_flow
+#define ip6_plen	ip6_ctlun.ip6_un1.ip6_un1_plen
+#define ip6_nxt		ip6_ctlun.ip6_un1.ip6_un1_nxt
+#define ip6_hlim	ip6_ctlun.ip6_un1.ip6_un1_hlim
+#define ip6_hops	ip6_ctlun.ip6_un1.ip6_un1_hlim
+
+/* The checks are the ones tcpdemux has always made, in the same order,
+ * so that tcpdemux::process_ip() drops the same packets for the same
+ * reasons; it reports them, as this is silent.  Anything whose version
+ * is not 6 is taken to be IPv4.
+ */
+#pragma GCC diagnostic ignored "-Wcast-align"
+decoded_packet::decoded_packet(const struct timeval &ts_,const u_char *data_,uint32_t caplen_,int32_t vlan_):
+    packet_info(ts_,data_,caplen_,vlan_),
+    status(SHORT),family(0),ip_proto(0),ip_len(0),src(),dst(),l4_off(0),
+    sport(0),dport(0),seq(0),tcp_flags(0),payload(0),payload_len(0)
+{
+    if (caplen < sizeof(struct ip)) return;
+
+    uint32_t ip_end;			// where the datagram ends in what was captured
+    if ((data[0] >> 4) == 6) {
+	const struct private_ip6_hdr *ip6_header = (struct private_ip6_hdr *) data;
+	family = AF_INET6;
+	if (caplen < sizeof(struct private_ip6_hdr)) return;
+	ip_proto = ip6_header->ip6_nxt;
+	src = ipaddr(ip6_header->ip6_src.s6_addr);
+	dst = ipaddr(ip6_header->ip6_dst.s6_addr);
+	if (ip_proto != IPPROTO_TCP) {
+	    status = NOT_TCP;
+	    return;
+	}
+	l4_off = sizeof(struct private_ip6_hdr);
+	ip_len = l4_off + ntohs(ip6_header->ip6_plen);
+	ip_end = ip_len < caplen ? ip_len : caplen;
+	if (ip_end == l4_off) {
+	    status = TRUNCATED_IP;
+	    return;
+	}
+    } else {
+	const struct ip *ip_header = (struct ip *) data;
+	family = AF_INET;
+	ip_proto = ip_header->ip_p;
+	src = ipaddr(ip_header->ip_src.s_addr);
+	dst = ipaddr(ip_header->ip_dst.s_addr);
+	if (ip_proto != IPPROTO_TCP) {
+	    status = NOT_TCP;
+	    return;
+	}
+	/* we may have captured bytes beyond the end of the datagram
+	 * (e.g. ethernet padding), or fewer than it holds
+	 */
+	ip_len = ntohs(ip_header->ip_len);
+	ip_end = ip_len < caplen ? ip_len : caplen;
+
+	/* this version doesn't know how to do fragment reassembly */
+	if (ntohs(ip_header->ip_off) & 0x1fff) {
+	    status = FRAGMENT;
+	    return;
+	}
+	l4_off = ip_header->ip_hl * 4;
+	if (l4_off > ip_end) {
+	    status = TRUNCATED_IP;
+	    return;
+	}
+    }
+
+    uint32_t length = ip_end - l4_off;
+    if (length < sizeof(struct tcphdr)) {
+	status = TRUNCATED_TCP;
+	return;
+    }
+    const struct tcphdr *tcp_header = (struct tcphdr *) (data + l4_off);
+    sport     = ntohs(tcp_header->th_sport);
+    dport     = ntohs(tcp_header->th_dport);
+    seq       = ntohl(tcp_header->th_seq);
+    tcp_flags = tcp_header->th_flags;
+
+    u_int tcp_header_len = tcp_header->th_off * 4;
+    if (tcp_header_len > length) {
+	status = TRUNCATED_TCP_OPTIONS;
+	return;
+    }
+    status      = TCP;
+    payload     = data + l4_off + tcp_header_len;
+    payload_len = length - tcp_header_len;
+}
+#pragma GCC diagnostic warning "-Wcast-align"
+
+/**
+ * A hash of the packet's connection that is the same in both
+ * directions: the two endpoints are put in a fixed order before they
+ * are hashed.
+ */
+uint64_t decoded_packet::connection_hash() const
+{
+    if(!has_tcp_header()) return 0;
+    int c = memcmp(src.addr,dst.addr,sizeof(src.addr));
+    if(c > 0 || (c==0 && sport > dport)){
+	return flow_hash(dst.addr,src.addr,dport,sport,family,flow_addr::hash_seed);
+    }
+    return flow_hash(src.addr,dst.addr,sport,dport,family,flow_addr::hash_seed);
+}
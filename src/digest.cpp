@@ -0,0 +1,343 @@
+/**
+ * digest.cpp:
+ * MD5, SHA-1 and SHA-256 of flows in one pass; see digest.h.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "config.h"
+#include "digest.h"
+
+#include <string.h>
+
+/* The SHA extensions are used through function-level target
+ * attributes, so the rest of tcpflow is built for any x86-64.
+ */
+#if defined(__x86_64__) && defined(HAVE_ASM_CPUID) && defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))
+#define DIGEST_SHA_NI
+#include <immintrin.h>
+#endif
+
+typedef void sha_blocks_t(uint32_t *h,const uint8_t *p,size_t nblocks);
+
+static inline uint32_t rol32(uint32_t x,int n) { return (x << n) | (x >> (32-n)); }
+static inline uint32_t ror32(uint32_t x,int n) { return (x >> n) | (x << (32-n)); }
+static inline uint32_t load_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/****************************************************************
+ *** portable SHA-1 and SHA-256 (FIPS 180-4)
+ ****************************************************************/
+
+static void sha1_blocks_c(uint32_t *h,const uint8_t *p,size_t nblocks)
+{
+    for(;nblocks>0;nblocks--,p+=64){
+	uint32_t w[80];
+	for(int t=0;t<16;t++) w[t] = load_be32(p+t*4);
+	for(int t=16;t<80;t++) w[t] = rol32(w[t-3] ^ w[t-8] ^ w[t-14] ^ w[t-16],1);
+	uint32_t a=h[0], b=h[1], c=h[2], d=h[3], e=h[4];
+#define SHA1_ROUND(f,k) { \
+	    uint32_t tmp = rol32(a,5) + (f) + e + k + w[t]; \
+	    e = d; d = c; c = rol32(b,30); b = a; a = tmp; }
+	int t=0;
+	for(;t<20;t++) SHA1_ROUND(d ^ (b & (c ^ d)),0x5a827999);
+	for(;t<40;t++) SHA1_ROUND(b ^ c ^ d,0x6ed9eba1);
+	for(;t<60;t++) SHA1_ROUND((b & c) | (d & (b | c)),0x8f1bbcdc);
+	for(;t<80;t++) SHA1_ROUND(b ^ c ^ d,0xca62c1d6);
+#undef SHA1_ROUND
+	h[0]+=a; h[1]+=b; h[2]+=c; h[3]+=d; h[4]+=e;
+    }
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+    0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+    0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+    0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+    0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+    0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+    0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+    0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+};
+
+static void sha256_blocks_c(uint32_t *h,const uint8_t *p,size_t nblocks)
+{
+    for(;nblocks>0;nblocks--,p+=64){
+	uint32_t w[64];
+	for(int t=0;t<16;t++) w[t] = load_be32(p+t*4);
+	for(int t=16;t<64;t++){
+	    uint32_t s0 = ror32(w[t-15],7) ^ ror32(w[t-15],18) ^ (w[t-15] >> 3);
+	    uint32_t s1 = ror32(w[t-2],17) ^ ror32(w[t-2],19)  ^ (w[t-2] >> 10);
+	    w[t] = w[t-16] + s0 + w[t-7] + s1;
+	}
+	uint32_t a=h[0], b=h[1], c=h[2], d=h[3], e=h[4], f=h[5], g=h[6], hh=h[7];
+	for(int t=0;t<64;t++){
+	    uint32_t t1 = hh + (ror32(e,6) ^ ror32(e,11) ^ ror32(e,25)) + ((e & f) ^ (~e & g)) + sha256_k[t] + w[t];
+	    uint32_t t2 = (ror32(a,2) ^ ror32(a,13) ^ ror32(a,22)) + ((a & b) ^ (a & c) ^ (b & c));
+	    hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+	}
+	h[0]+=a; h[1]+=b; h[2]+=c; h[3]+=d; h[4]+=e; h[5]+=f; h[6]+=g; h[7]+=hh;
+    }
+}
+
+/****************************************************************
+ *** SHA extensions
+ ****************************************************************/
+
+#ifdef DIGEST_SHA_NI
+#define SHA_NI_TARGET __attribute__((target("sha,ssse3,sse4.1")))
+
+/* Four rounds each; W_g is the message for rounds 4g..4g+3, and for
+ * g>=4 it replaces W_(g-4) (m0) from W_(g-3..g-1) (m1..m3).
+ */
+#define SHA1_SCHEDULE(m0,m1,m2,m3) \
+    m0 = _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(m0,m1),m2),m3)
+#define SHA1_ROUNDS(g,e_this,e_next,m) \
+    e_this = _mm_sha1nexte_epu32(e_this,m); \
+    e_next = abcd; \
+    abcd = _mm_sha1rnds4_epu32(abcd,e_this,(g)/5)
+
+SHA_NI_TARGET
+static void sha1_blocks_ni(uint32_t *h,const uint8_t *p,size_t nblocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h),0x1b);
+    __m128i e0 = _mm_set_epi32(h[4],0,0,0);
+    for(;nblocks>0;nblocks--,p+=64){
+	const __m128i abcd_save = abcd;
+	const __m128i e0_save = e0;
+	__m128i m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p+0)),mask);
+	__m128i m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p+16)),mask);
+	__m128i m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p+32)),mask);
+	__m128i m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p+48)),mask);
+	__m128i e1;
+
+	e0 = _mm_add_epi32(e0,m0);	// rounds 0-3 take e as it is
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd,e0,0);
+	SHA1_ROUNDS(1,e1,e0,m1);
+	SHA1_ROUNDS(2,e0,e1,m2);
+	SHA1_ROUNDS(3,e1,e0,m3);
+	SHA1_SCHEDULE(m0,m1,m2,m3); SHA1_ROUNDS(4,e0,e1,m0);
+	SHA1_SCHEDULE(m1,m2,m3,m0); SHA1_ROUNDS(5,e1,e0,m1);
+	SHA1_SCHEDULE(m2,m3,m0,m1); SHA1_ROUNDS(6,e0,e1,m2);
+	SHA1_SCHEDULE(m3,m0,m1,m2); SHA1_ROUNDS(7,e1,e0,m3);
+	SHA1_SCHEDULE(m0,m1,m2,m3); SHA1_ROUNDS(8,e0,e1,m0);
+	SHA1_SCHEDULE(m1,m2,m3,m0); SHA1_ROUNDS(9,e1,e0,m1);
+	SHA1_SCHEDULE(m2,m3,m0,m1); SHA1_ROUNDS(10,e0,e1,m2);
+	SHA1_SCHEDULE(m3,m0,m1,m2); SHA1_ROUNDS(11,e1,e0,m3);
+	SHA1_SCHEDULE(m0,m1,m2,m3); SHA1_ROUNDS(12,e0,e1,m0);
+	SHA1_SCHEDULE(m1,m2,m3,m0); SHA1_ROUNDS(13,e1,e0,m1);
+	SHA1_SCHEDULE(m2,m3,m0,m1); SHA1_ROUNDS(14,e0,e1,m2);
+	SHA1_SCHEDULE(m3,m0,m1,m2); SHA1_ROUNDS(15,e1,e0,m3);
+	SHA1_SCHEDULE(m0,m1,m2,m3); SHA1_ROUNDS(16,e0,e1,m0);
+	SHA1_SCHEDULE(m1,m2,m3,m0); SHA1_ROUNDS(17,e1,e0,m1);
+	SHA1_SCHEDULE(m2,m3,m0,m1); SHA1_ROUNDS(18,e0,e1,m2);
+	SHA1_SCHEDULE(m3,m0,m1,m2); SHA1_ROUNDS(19,e1,e0,m3);
+
+	e0 = _mm_sha1nexte_epu32(e0,e0_save);
+	abcd = _mm_add_epi32(abcd,abcd_save);
+    }
+    _mm_storeu_si128((__m128i *)h,_mm_shuffle_epi32(abcd,0x1b));
+    h[4] = _mm_extract_epi32(e0,3);
+}
+
+#define SHA256_SCHEDULE(m0,m1,m2,m3) \
+    m0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m0,m1),_mm_alignr_epi8(m3,m2,4)),m3)
+#define SHA256_ROUNDS(g,m) \
+    msg = _mm_add_epi32(m,_mm_loadu_si128((const __m128i *)(sha256_k+4*(g)))); \
+    cdgh = _mm_sha256rnds2_epu32(cdgh,abef,msg); \
+    abef = _mm_sha256rnds2_epu32(abef,cdgh,_mm_shuffle_epi32(msg,0x0e))
+
+SHA_NI_TARGET
+static void sha256_blocks_ni(uint32_t *h,const uint8_t *p,size_t nblocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,0x0405060700010203ULL);
+    __m128i tmp  = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(h+0)),0xb1); // CDAB
+    __m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(h+4)),0x1b); // EFGH
+    __m128i abef = _mm_alignr_epi8(tmp,cdgh,8);
+    cdgh = _mm_blend_epi16(cdgh,tmp,0xf0);
+    for(;nblocks>0;nblocks--,p+=64){
+	const __m128i abef_save = abef;
+	const __m128i cdgh_save = cdgh;
+	__m128i m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p+0)),mask);
+	__m128i m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p+16)),mask);
+	__m128i m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p+32)),mask);
+	__m128i m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p+48)),mask);
+	__m128i msg;
+
+	SHA256_ROUNDS(0,m0);
+	SHA256_ROUNDS(1,m1);
+	SHA256_ROUNDS(2,m2);
+	SHA256_ROUNDS(3,m3);
+	SHA256_SCHEDULE(m0,m1,m2,m3); SHA256_ROUNDS(4,m0);
+	SHA256_SCHEDULE(m1,m2,m3,m0); SHA256_ROUNDS(5,m1);
+	SHA256_SCHEDULE(m2,m3,m0,m1); SHA256_ROUNDS(6,m2);
+	SHA256_SCHEDULE(m3,m0,m1,m2); SHA256_ROUNDS(7,m3);
+	SHA256_SCHEDULE(m0,m1,m2,m3); SHA256_ROUNDS(8,m0);
+	SHA256_SCHEDULE(m1,m2,m3,m0); SHA256_ROUNDS(9,m1);
+	SHA256_SCHEDULE(m2,m3,m0,m1); SHA256_ROUNDS(10,m2);
+	SHA256_SCHEDULE(m3,m0,m1,m2); SHA256_ROUNDS(11,m3);
+	SHA256_SCHEDULE(m0,m1,m2,m3); SHA256_ROUNDS(12,m0);
+	SHA256_SCHEDULE(m1,m2,m3,m0); SHA256_ROUNDS(13,m1);
+	SHA256_SCHEDULE(m2,m3,m0,m1); SHA256_ROUNDS(14,m2);
+	SHA256_SCHEDULE(m3,m0,m1,m2); SHA256_ROUNDS(15,m3);
+
+	abef = _mm_add_epi32(abef,abef_save);
+	cdgh = _mm_add_epi32(cdgh,cdgh_save);
+    }
+    tmp  = _mm_shuffle_epi32(abef,0x1b);		// FEBA
+    cdgh = _mm_shuffle_epi32(cdgh,0xb1);		// DCHG
+    _mm_storeu_si128((__m128i *)(h+0),_mm_blend_epi16(tmp,cdgh,0xf0)); // DCBA
+    _mm_storeu_si128((__m128i *)(h+4),_mm_alignr_epi8(cdgh,tmp,8));   // HGFE
+}
+
+static void cpuid(uint32_t leaf,uint32_t &a,uint32_t &b,uint32_t &c,uint32_t &d)
+{
+    __asm__("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(leaf), "c"(0));
+}
+
+static bool cpu_has_sha()
+{
+    uint32_t a,b,c,d;
+    cpuid(0,a,b,c,d);
+    if(a<7) return false;
+    cpuid(1,a,b,c,d);
+    if(!(c & (1<<9)) || !(c & (1<<19))) return false; // SSSE3, SSE4.1
+    cpuid(7,a,b,c,d);
+    return (b & (1<<29))!=0;			// SHA
+}
+#else
+static bool cpu_has_sha() { return false; }
+#endif
+
+static const bool have_sha = cpu_has_sha();
+#ifdef DIGEST_SHA_NI
+static sha_blocks_t *const sha1_blocks   = have_sha ? sha1_blocks_ni   : sha1_blocks_c;
+static sha_blocks_t *const sha256_blocks = have_sha ? sha256_blocks_ni : sha256_blocks_c;
+#else
+static sha_blocks_t *const sha1_blocks   = sha1_blocks_c;
+static sha_blocks_t *const sha256_blocks = sha256_blocks_c;
+#endif
+
+/****************************************************************
+ *** digest_set
+ ****************************************************************/
+
+static void sha_update(digest_set::sha_state &s,uint32_t *h,sha_blocks_t *blocks,
+		       const uint8_t *data,size_t length)
+{
+    size_t have = s.length % 64;
+    s.length += length;
+    if(have){
+	size_t n = 64-have < length ? 64-have : length;
+	memcpy(s.block+have,data,n);
+	data += n;
+	length -= n;
+	if(have+n < 64) return;
+	blocks(h,s.block,1);
+    }
+    if(length>=64){
+	blocks(h,data,length/64);
+	data += length & ~(size_t)63;
+	length &= 63;
+    }
+    if(length) memcpy(s.block,data,length);
+}
+
+static void sha_final(digest_set::sha_state &s,uint32_t *h,sha_blocks_t *blocks,int words,uint8_t *out)
+{
+    uint64_t bits = s.length * 8;
+    uint8_t pad[72];
+    size_t have = s.length % 64;
+    size_t padlen = have < 56 ? 56-have : 120-have;
+    memset(pad,0,padlen);
+    pad[0] = 0x80;
+    for(int i=0;i<8;i++) pad[padlen+i] = bits >> (56-8*i);
+    sha_update(s,h,blocks,pad,padlen+8);
+    for(int i=0;i<words;i++){
+	out[i*4]   = h[i] >> 24;
+	out[i*4+1] = h[i] >> 16;
+	out[i*4+2] = h[i] >> 8;
+	out[i*4+3] = h[i];
+    }
+}
+
+static void append_digest(std::string &xml,const char *type,const uint8_t *digest,size_t len)
+{
+    static const char hexdigits[] = "0123456789abcdef";
+    xml += "<hashdigest type='";
+    xml += type;
+    xml += "'>";
+    for(size_t i=0;i<len;i++){
+	xml += hexdigits[digest[i]>>4];
+	xml += hexdigits[digest[i] & 0xf];
+    }
+    xml += "</hashdigest>";
+}
+
+bool digest_set::parse(const std::string &names,unsigned int &algs)
+{
+    algs = 0;
+    size_t start = 0;
+    while(start<=names.size()){
+	size_t comma = names.find(',',start);
+	if(comma==std::string::npos) comma = names.size();
+	std::string name = names.substr(start,comma-start);
+	if(name=="md5")         algs |= MD5;
+	else if(name=="sha1")   algs |= SHA1;
+	else if(name=="sha256") algs |= SHA256;
+	else if(name.size())    return false;
+	start = comma+1;
+    }
+    return true;
+}
+
+bool digest_set::sha_extensions()
+{
+    return have_sha;
+}
+
+digest_set::digest_set(unsigned int algs_):algs(algs_),md5(),sha1_h(),sha1(),sha256_h(),sha256()
+{
+    static const uint32_t sha1_init[5] = {0x67452301,0xefcdab89,0x98badcfe,0x10325476,0xc3d2e1f0};
+    static const uint32_t sha256_init[8] = {0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,
+					    0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19};
+    if(algs & MD5) MD5Init(&md5);
+    memcpy(sha1_h,sha1_init,sizeof(sha1_h));
+    memcpy(sha256_h,sha256_init,sizeof(sha256_h));
+}
+
+void digest_set::update(const uint8_t *data,size_t length)
+{
+    /* a slice at a time, so that each algorithm finds it in the cache */
+    static const size_t SLICE = 16384;
+    while(length>0){
+	size_t n = length < SLICE ? length : SLICE;
+	if(algs & MD5)    MD5Update(&md5,data,n);
+	if(algs & SHA1)   sha_update(sha1,sha1_h,sha1_blocks,data,n);
+	if(algs & SHA256) sha_update(sha256,sha256_h,sha256_blocks,data,n);
+	data += n;
+	length -= n;
+    }
+}
+
+void digest_set::final(std::string &xml)
+{
+    uint8_t digest[32];
+    if(algs & MD5){
+	MD5Final(digest,&md5);
+	append_digest(xml,"MD5",digest,16);
+    }
+    if(algs & SHA1){
+	sha_final(sha1,sha1_h,sha1_blocks,5,digest);
+	append_digest(xml,"SHA1",digest,20);
+    }
+    if(algs & SHA256){
+	sha_final(sha256,sha256_h,sha256_blocks,8,digest);
+	append_digest(xml,"SHA256",digest,32);
+    }
+}
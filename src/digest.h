@@ -0,0 +1,56 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+/**
+ * digest.h
+ *
+ * The digests of a flow for the DFXML file: any of MD5, SHA-1 and
+ * SHA-256, all computed in one pass over the data.  Each block of a
+ * flow is run through every selected algorithm while it is still in
+ * the cache, so asking for more digests adds their CPU time but not
+ * another read of the flow.
+ *
+ * SHA-1 and SHA-256 use the x86 SHA extensions when the CPU has them
+ * (checked once, with CPUID), and portable C otherwise.
+ */
+
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+#include "md5.h"
+
+class digest_set {
+public:
+    enum { MD5=1, SHA1=2, SHA256=4 };	// bits of the algs mask
+
+    /* "md5,sha1,sha256" (any of them, in any order) to an algs mask;
+     * false if a name is not known.
+     */
+    static bool parse(const std::string &names,unsigned int &algs);
+    static bool sha_extensions();	// SHA-1/SHA-256 use the SHA instructions
+
+    explicit digest_set(unsigned int algs_);
+    void update(const uint8_t *data,size_t length);
+    /* Finish, and append a <hashdigest type='...'> element for each
+     * algorithm to xml.  The set can't be updated afterwards.
+     */
+    void final(std::string &xml);
+
+    /* Blocks of 64 bytes, big-endian words, shared by SHA-1 and SHA-256. */
+    class sha_state {
+    public:
+	sha_state():length(0),block(){}
+	uint64_t length;		// bytes so far
+	uint8_t	 block[64];		// the last length%64 of them
+    };
+
+private:
+    unsigned int algs;
+    context_md5_t md5;
+    uint32_t	sha1_h[5];
+    sha_state	sha1;
+    uint32_t	sha256_h[8];
+    sha_state	sha256;
+};
+
+#endif
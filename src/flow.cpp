@@ -17,7 +17,7 @@
 
 #include <assert.h>
 #include <iostream>
-#include <sstream>
+#include <vector>
 
 #define ETH_ALEN 6
 #ifndef HAVE_INET_NTOP
@@ -25,6 +25,7 @@
 #endif
 
 std::string flow::filename_template("%A.%a-%B.%b%V%v%C%c");
+uint64_t flow_addr::hash_seed = 0;
 
 void flow::usage()
 {
@@ -33,86 +34,255 @@ void flow::usage()
     std::cout << "  %c/%# - connection_count;                %C - 'c' if connection_count >0\n";
     std::cout << "  %V/%v - VLAN number, '--' if no vlan/'' if no vlan\n";
     std::cout << "  %T/%t - Timestamp in ISO8601 format/unix time_t\n";
+    std::cout << "  %Y/%m/%d/%H - year/month/day/hour of the timestamp (UTC)\n";
+    std::cout << "  %K/%k - two hex digits of a hash of the flow, first/second byte\n";
+    std::cout << "  %N/%n - source/dest network: first two bytes of an IPv4 address,\n";
+    std::cout << "          first two groups of an IPv6 one\n";
+    std::cout << "  A '/' in the template puts the files in subdirectories, created as needed\n";
     std::cout << "  %% - Output a '%'\n";
     std::cout << "\n";
 }
 
-std::string flow::filename()
+/* A hash of the 5-tuple for %K and %k.  Unlike flow_addr::hash() it is
+ * not seeded and does not use CRC32C when SSE4.2 is there, so that a
+ * flow goes to the same directory on every run.
+ */
+static uint64_t dir_hash(const flow_addr &f)
 {
-    std::stringstream ss;
+    uint64_t h = 0;
+    for(int i=0;i<16;i+=8){
+	uint64_t s,d;
+	memcpy(&s,f.src.addr+i,8);
+	memcpy(&d,f.dst.addr+i,8);
+	h = flow_hash_round(h,s);
+	h = flow_hash_round(h,d);
+    }
+    h = flow_hash_round(h,((uint64_t)f.sport << 32) | ((uint64_t)f.dport << 16) | f.family);
+    return h;
+}
+
+/*
+ * The filename template is compiled once, by compile_template(), into a
+ * list of operations.  Naming a flow is then a walk over the list that
+ * formats each piece with the small integer formatters below and
+ * appends it to the caller's string; there is no parsing, no iostream
+ * and no printf per flow.
+ */
+class template_op {
+public:
+    enum kind_t { LITERAL,SRC_ADDR,SRC_PORT,DST_ADDR,DST_PORT,ISO8601,TIME_T,
+		  YEAR,MONTH,DAY,HOUR,HASH_HI,HASH_LO,SRC_NET,DST_NET,
+		  VLAN_DASHES,VLAN,C_IF_COUNT,COUNT_IF,COUNT };
+    template_op(kind_t kind_,const std::string &text_):kind(kind_),text(text_){}
+    kind_t	kind;
+    std::string	text;			// for LITERAL
+};
+
+static std::vector<template_op> template_ops;
+static bool template_compiled = false;	// template_ops is filename_template
 
-    for(unsigned int i=0;i<filename_template.size();i++){
-	switch(filename_template.at(i)){
+bool flow::compile_template(std::string &error)
+{
+    std::vector<template_op> ops;
+    std::string literal;
+    for(size_t i=0;i<filename_template.size();i++){
+	char ch = filename_template[i];
+	if(ch!='%'){
+	    literal += ch;
+	    continue;
+	}
+	if(i+1==filename_template.size()){
+	    error = "it cannot end with a %";
+	    return false;
+	}
+	template_op::kind_t kind;
+	switch(filename_template[++i]){
+	case '%': literal += '%'; continue;
+	case 'A': kind = template_op::SRC_ADDR; break;
+	case 'a': kind = template_op::SRC_PORT; break;
+	case 'B': kind = template_op::DST_ADDR; break;
+	case 'b': kind = template_op::DST_PORT; break;
+	case 'T': kind = template_op::ISO8601; break;
+	case 't': kind = template_op::TIME_T; break;
+	case 'Y': kind = template_op::YEAR; break;
+	case 'm': kind = template_op::MONTH; break;
+	case 'd': kind = template_op::DAY; break;
+	case 'H': kind = template_op::HOUR; break;
+	case 'K': kind = template_op::HASH_HI; break;
+	case 'k': kind = template_op::HASH_LO; break;
+	case 'N': kind = template_op::SRC_NET; break;
+	case 'n': kind = template_op::DST_NET; break;
+	case 'V': kind = template_op::VLAN_DASHES; break;
+	case 'v': kind = template_op::VLAN; break;
+	case 'C': kind = template_op::C_IF_COUNT; break;
+	case 'c': kind = template_op::COUNT_IF; break;
+	case '#': kind = template_op::COUNT; break;
 	default:
-	    ss << filename_template.at(i);
-	    break;
-	case '%':
-	    if(i==filename_template.size()-1){
-		std::cerr << "Invalid filename_template: " << filename_template << " cannot end with a %\n";
-		exit(1);
+	    error = std::string("unknown character: ") + filename_template[i];
+	    return false;
+	}
+	if(literal.size()){
+	    ops.push_back(template_op(template_op::LITERAL,literal));
+	    literal.clear();
+	}
+	ops.push_back(template_op(kind,""));
+    }
+    if(literal.size()) ops.push_back(template_op(template_op::LITERAL,literal));
+    template_ops.swap(ops);
+    template_compiled = true;
+    return true;
+}
+
+/* Integer formatting for names: each writes at p and returns the end. */
+static inline char *put_dec(char *p,uint64_t v)
+{
+    char tmp[20];
+    int n = 0;
+    do {
+	tmp[n++] = '0' + v%10;
+	v /= 10;
+    } while(v);
+    while(n) *p++ = tmp[--n];
+    return p;
+}
+
+static inline char *put_dec_width(char *p,unsigned int v,int width) // zero-padded
+{
+    for(int i=width-1;i>=0;i--){
+	p[i] = '0' + v%10;
+	v /= 10;
+    }
+    return p+width;
+}
+
+static const char hexdigits[] = "0123456789abcdef";
+
+static inline char *put_hex(char *p,unsigned int v) // no leading zeros
+{
+    int shift = 28;
+    while(shift>0 && (v>>shift)==0) shift -= 4;
+    for(;shift>=0;shift-=4) *p++ = hexdigits[(v>>shift) & 0xf];
+    return p;
+}
+
+static inline char *put_hex2(char *p,unsigned int v)
+{
+    *p++ = hexdigits[(v>>4) & 0xf];
+    *p++ = hexdigits[v & 0xf];
+    return p;
+}
+
+static char *put_addr(char *p,const ipaddr &a,sa_family_t family)
+{
+    if(family==AF_INET6){
+	inet_ntop(family,a.addr,p,INET6_ADDRSTRLEN);
+	return p+strlen(p);
+    }
+    for(int i=0;i<4;i++){
+	if(i) *p++ = '.';
+	p = put_dec_width(p,a.addr[i],3);
+    }
+    return p;
+}
+
+/* first two bytes of an IPv4 address, or first two groups of an IPv6 one */
+static char *put_net(char *p,const ipaddr &a,sa_family_t family)
+{
+    if(family==AF_INET6){
+	p = put_hex(p,(a.addr[0]<<8) | a.addr[1]);
+	*p++ = ':';
+	return put_hex(p,(a.addr[2]<<8) | a.addr[3]);
+    }
+    p = put_dec_width(p,a.addr[0],3);
+    *p++ = '.';
+    return put_dec_width(p,a.addr[1],3);
+}
+
+void flow::filename(std::string &out)
+{
+    assert(template_compiled);		// by main(), before any flow is named
+
+    struct tm tm;
+    bool have_tm = false;
+    uint64_t hash = 0;
+    bool have_hash = false;
+    char buf[64];			// longer than any one piece but a literal
+    for(std::vector<template_op>::const_iterator op=template_ops.begin();op!=template_ops.end();op++){
+	char *p = buf;
+	switch(op->kind){
+	case template_op::LITERAL:
+	    out += op->text;
+	    continue;
+	case template_op::SRC_ADDR: p = put_addr(p,src,family); break;
+	case template_op::DST_ADDR: p = put_addr(p,dst,family); break;
+	case template_op::SRC_PORT: p = put_dec_width(p,sport,5); break;
+	case template_op::DST_PORT: p = put_dec_width(p,dport,5); break;
+	case template_op::SRC_NET:  p = put_net(p,src,family); break;
+	case template_op::DST_NET:  p = put_net(p,dst,family); break;
+	case template_op::HASH_HI:
+	case template_op::HASH_LO:
+	    if(!have_hash){
+		hash = dir_hash(*this);
+		have_hash = true;
 	    }
-	    /* put the substitute in ss or buf */
-	    char buf[1024];
-	    buf[0] = 0;
-	    switch(filename_template.at(++i)){
-	    case 'A': // source IP address
-		switch(family){
-		case AF_INET:
-		    snprintf(buf,sizeof(buf),"%03d.%03d.%03d.%03d", src.addr[0], src.addr[1], src.addr[2], src.addr[3]);
-		    break;
-		case AF_INET6:
-		    inet_ntop(family, src.addr, buf,sizeof(buf));
-		}
-		break;
-	    case 'a': // source IP port
-		snprintf(buf,sizeof(buf),"%05d",sport);
-		break;
-	    case 'B': // dest IP address
-		switch(family){
-		case AF_INET:
-		    snprintf(buf,sizeof(buf),"%03d.%03d.%03d.%03d", dst.addr[0], dst.addr[1], dst.addr[2], dst.addr[3]);
-		    break;
-		case AF_INET6:
-		    inet_ntop(family, dst.addr, buf,sizeof(buf));
-		}
-		break;
-	    case 'b': // dest IP port
-		snprintf(buf,sizeof(buf),"%05d",dport);
-		break;
-	    case 'T': // Timestamp in ISO8601 format
-	      {
+	    p = put_hex2(p,(unsigned int)(hash >> (op->kind==template_op::HASH_HI ? 56 : 48)));
+	    break;
+	case template_op::TIME_T:
+	    if(tstart.tv_sec<0) *p++ = '-';
+	    p = put_dec(p,tstart.tv_sec<0 ? -(int64_t)tstart.tv_sec : tstart.tv_sec);
+	    break;
+	case template_op::ISO8601:
+	case template_op::YEAR:
+	case template_op::MONTH:
+	case template_op::DAY:
+	case template_op::HOUR:
+	    if(!have_tm){
 		time_t t = tstart.tv_sec;
-		strftime(buf,sizeof(buf),"%Y-%m-%dT%H:%M:%SZ",gmtime(&t));
-		break;
-	      }
-	    case 't': // Unix time_t
-		ss << tstart.tv_sec;
-		break;
-	    case 'V': // '--' if VLAN is present
-		if(vlan!=NO_VLAN) ss << "--";
-		break;
-	    case 'v': // VLAN number if VLAN is present
-		if(vlan!=NO_VLAN) ss << vlan;
-		break;
-	    case 'C': // 'c' if connection_count >0
-		if(connection_count>0) ss << "c";
-		break;
-	    case 'c': // connection_count if connection_count >0
-		if(connection_count>0) ss << connection_count;
-		break;
-	    case '#': // always output connection count
-		ss << connection_count;
-		break;
-	    case '%': // Output a '%'
-		ss << "%";
-		break;
-	    default:
-		std::cerr << "Invalid filename_template: " << filename_template << "\n";
-		std::cerr << "unknown character: " << filename_template.at(i+1) << "\n";
-		exit(1);
+#ifdef HAVE_GMTIME_R
+		gmtime_r(&t,&tm);	// shards name flows concurrently
+#else
+		tm = *gmtime(&t);
+#endif
+		have_tm = true;
 	    }
-	    if(buf[0]) ss << buf;
+	    switch(op->kind){
+	    case template_op::YEAR:  p = put_dec_width(p,tm.tm_year+1900,4); break;
+	    case template_op::MONTH: p = put_dec_width(p,tm.tm_mon+1,2); break;
+	    case template_op::DAY:   p = put_dec_width(p,tm.tm_mday,2); break;
+	    case template_op::HOUR:  p = put_dec_width(p,tm.tm_hour,2); break;
+	    default:			// 2013-01-31T12:34:56Z
+		p = put_dec_width(p,tm.tm_year+1900,4); *p++ = '-';
+		p = put_dec_width(p,tm.tm_mon+1,2);     *p++ = '-';
+		p = put_dec_width(p,tm.tm_mday,2);      *p++ = 'T';
+		p = put_dec_width(p,tm.tm_hour,2);      *p++ = ':';
+		p = put_dec_width(p,tm.tm_min,2);       *p++ = ':';
+		p = put_dec_width(p,tm.tm_sec,2);       *p++ = 'Z';
+	    }
+	    break;
+	case template_op::VLAN_DASHES:
+	    if(vlan!=NO_VLAN){ *p++ = '-'; *p++ = '-'; }
+	    break;
+	case template_op::VLAN:
+	    if(vlan!=NO_VLAN) p = put_dec(p,(uint32_t)vlan);
+	    break;
+	case template_op::C_IF_COUNT:
+	    if(connection_count>0) *p++ = 'c';
+	    break;
+	case template_op::COUNT_IF:
+	    if(connection_count>0) p = put_dec(p,connection_count);
+	    break;
+	case template_op::COUNT:
+	    p = put_dec(p,connection_count);
+	    break;
 	}
+	out.append(buf,p-buf);
     }
-    return ss.str();
+}
+
+std::string flow::filename()
+{
+    std::string name;
+    name.reserve(64);
+    filename(name);
+    return name;
 }
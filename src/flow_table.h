@@ -0,0 +1,319 @@
+#ifndef FLOW_TABLE_H
+#define FLOW_TABLE_H
+
+/**
+ * flow_table.h
+ *
+ * An open-addressing hash table for the flow database.
+ *
+ * The layout follows Google's SwissTable: every slot has a one-byte
+ * control value that is either EMPTY, DELETED, or the low 7 bits of
+ * the key's hash (the "tag").  Slots are probed 16 at a time; a group
+ * of control bytes is compared against the tag in one step (with SSE2
+ * when available), so a lookup normally touches one cache line of
+ * control bytes and then exactly one slot.  Keys and values are
+ * stored inline in the slot array; there are no per-entry nodes.
+ *
+ * KEY must be a plain structure with operator== and a hash() method
+ * that returns a well-mixed 64-bit value.  VALUE is typically a pointer.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <vector>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+template <class KEY,class VALUE>
+class flow_table {
+public:
+    class slot_t {
+    public:
+	slot_t():first(),second(){}
+	KEY	first;
+	VALUE	second;
+    };
+
+    class iterator {
+    public:
+	iterator(const flow_table *t_,size_t i_):t(t_),i(i_){}
+	iterator(const iterator &b):t(b.t),i(b.i){}
+	iterator &operator=(const iterator &b){ t=b.t; i=b.i; return *this; }
+	slot_t *operator->() const { return &t->slots[i]; }
+	slot_t &operator*()  const { return t->slots[i]; }
+	iterator &operator++(){ i = t->next_full(i+1); return *this; }
+	iterator operator++(int){ iterator r(*this); i = t->next_full(i+1); return r; }
+	bool operator==(const iterator &b) const { return i==b.i; }
+	bool operator!=(const iterator &b) const { return i!=b.i; }
+	size_t index() const { return i; }
+    private:
+	const flow_table *t;
+	size_t i;
+    };
+    typedef iterator const_iterator;
+
+    enum { GROUP=16, MIN_CAPACITY=GROUP };
+
+    /** Distribution statistics, for checking the quality of KEY::hash() */
+    class stats_t {
+    public:
+	stats_t():size(0),capacity(0),tombstones(0),probe_length(),group_fill(),
+		  tag_false_matches(0),hash_collisions(0){}
+	size_t	size;
+	size_t	capacity;
+	size_t	tombstones;			// DELETED control bytes
+	std::vector<uint64_t> probe_length;	// [n]: keys found in the (n+1)th group probed
+	std::vector<uint64_t> group_fill;	// [n]: groups holding n keys
+	uint64_t tag_false_matches;		// tag matches on other keys, over a lookup of every key
+	uint64_t hash_collisions;		// keys whose full 64-bit hash equals another key's
+
+	/** add the statistics of another table to these */
+	void add(const stats_t &b) {
+	    size       += b.size;
+	    capacity   += b.capacity;
+	    tombstones += b.tombstones;
+	    if(probe_length.size() < b.probe_length.size()) probe_length.resize(b.probe_length.size());
+	    for(size_t i=0;i<b.probe_length.size();i++) probe_length[i] += b.probe_length[i];
+	    if(group_fill.size() < b.group_fill.size()) group_fill.resize(b.group_fill.size());
+	    for(size_t i=0;i<b.group_fill.size();i++) group_fill[i] += b.group_fill[i];
+	    tag_false_matches += b.tag_false_matches;
+	    hash_collisions   += b.hash_collisions;
+	}
+    };
+
+    flow_table():ctrl(0),slots(0),capacity_(0),size_(0),growth_left(0){
+	allocate(MIN_CAPACITY);
+    }
+    ~flow_table(){
+	free(ctrl);
+	delete [] slots;
+    }
+
+    size_t size() const     { return size_; }
+    size_t capacity() const { return capacity_; }
+    bool   empty() const    { return size_==0; }
+
+    /** bytes of memory used by the table itself */
+    size_t memory_used() const {
+	return capacity_ * (sizeof(slot_t) + 1);
+    }
+
+    iterator begin() const { return iterator(this,next_full(0)); }
+    iterator end()   const { return iterator(this,capacity_); }
+
+    iterator find(const KEY &key) const {
+	return iterator(this,find_index(key,key.hash()));
+    }
+
+    /** insert key=>value, replacing any existing value for key */
+    iterator insert(const KEY &key,const VALUE &value) {
+	uint64_t h = key.hash();
+	size_t i = find_index(key,h);
+	if(i==capacity_){
+	    i = prepare_insert(h);
+	    slots[i].first = key;
+	    size_++;
+	}
+	slots[i].second = value;
+	return iterator(this,i);
+    }
+
+    void erase(const iterator &it) {
+	size_t i = it.index();
+	if(i>=capacity_ || ctrl[i]<0) return;
+	size_--;
+	/* A slot may become EMPTY again only if its group already has
+	 * an empty slot; otherwise a probe that passed through this
+	 * (previously full) group could stop here and miss its key.
+	 */
+	if(match_empty(ctrl + (i & ~(size_t)(GROUP-1)))){
+	    ctrl[i] = EMPTY;
+	    growth_left++;
+	} else {
+	    ctrl[i] = DELETED;
+	}
+	slots[i] = slot_t();
+    }
+
+    size_t erase(const KEY &key) {
+	iterator it = find(key);
+	if(it==end()) return 0;
+	erase(it);
+	return 1;
+    }
+
+    void clear() {
+	memset(ctrl,EMPTY,capacity_);
+	for(size_t i=0;i<capacity_;i++) slots[i] = slot_t();
+	size_ = 0;
+	growth_left = max_load(capacity_);
+    }
+
+    /** true if the next insert of a new key will rehash the table */
+    bool full() const { return growth_left==0; }
+
+    /** Walk the whole table; O(n log n), so only for reporting. */
+    void get_stats(stats_t &st) const {
+	st = stats_t();
+	st.size = size_;
+	st.capacity = capacity_;
+	st.group_fill.resize(GROUP+1);
+	std::vector<uint64_t> hashes;
+	hashes.reserve(size_);
+	const size_t gmask = capacity_/GROUP - 1;
+	for(size_t g=0;g*GROUP<capacity_;g++){
+	    int n=0;
+	    for(int j=0;j<GROUP;j++){
+		if(ctrl[g*GROUP+j]>=0) n++;
+		if(ctrl[g*GROUP+j]==DELETED) st.tombstones++;
+	    }
+	    st.group_fill[n]++;
+	}
+	for(size_t i=0;i<capacity_;i++){
+	    if(ctrl[i]<0) continue;
+	    uint64_t h = slots[i].first.hash();
+	    hashes.push_back(h);
+	    size_t g = h1(h) & gmask;
+	    size_t probes = 0;
+	    for(size_t step=1;;step++){
+		for(uint32_t m = match(ctrl + g*GROUP,tag(h)); m; m &= m-1){
+		    if(g*GROUP + ctz(m) != i) st.tag_false_matches++;
+		}
+		if(g == i/GROUP) break;
+		g = (g + step) & gmask;
+		probes++;
+	    }
+	    if(st.probe_length.size() <= probes) st.probe_length.resize(probes+1);
+	    st.probe_length[probes]++;
+	}
+	std::sort(hashes.begin(),hashes.end());
+	for(size_t i=1;i<hashes.size();i++){
+	    if(hashes[i]==hashes[i-1]) st.hash_collisions++;
+	}
+    }
+
+    /** make room for at least n entries without rehashing */
+    void reserve(size_t n) {
+	size_t cap = MIN_CAPACITY;
+	while(max_load(cap) < n) cap *= 2;
+	if(cap > capacity_) rehash(cap);
+    }
+
+private:
+    enum { EMPTY=-128, DELETED=-2 };
+
+    int8_t	*ctrl;			// one control byte per slot
+    slot_t	*slots;			// keys and values, inline
+    size_t	capacity_;		// always a power of two and a multiple of GROUP
+    size_t	size_;			// number of full slots
+    size_t	growth_left;		// EMPTY slots we may still fill before rehashing
+
+    /* not implemented */
+    flow_table(const flow_table &);
+    flow_table &operator=(const flow_table &);
+
+    static size_t max_load(size_t cap) { return cap - cap/8; } // 7/8 load factor
+    static int8_t tag(uint64_t h) { return (int8_t)(h & 0x7f); }
+    static size_t h1(uint64_t h)  { return (size_t)(h >> 7); }
+
+    static int ctz(uint32_t m) { return __builtin_ctz(m); }
+
+    /* bitmask of the slots in a group whose control byte equals c */
+    static uint32_t match(const int8_t *g,int8_t c) {
+#ifdef __SSE2__
+	__m128i grp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(g));
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(grp,_mm_set1_epi8(c)));
+#else
+	uint32_t m = 0;
+	for(int j=0;j<GROUP;j++) if(g[j]==c) m |= (1U<<j);
+	return m;
+#endif
+    }
+    static uint32_t match_empty(const int8_t *g) { return match(g,(int8_t)EMPTY); }
+
+    /* bitmask of the slots in a group that are EMPTY or DELETED (high bit set) */
+    static uint32_t match_free(const int8_t *g) {
+#ifdef __SSE2__
+	return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(g)));
+#else
+	uint32_t m = 0;
+	for(int j=0;j<GROUP;j++) if(g[j]<0) m |= (1U<<j);
+	return m;
+#endif
+    }
+
+    size_t next_full(size_t i) const {
+	while(i<capacity_ && ctrl[i]<0) i++;
+	return i;
+    }
+
+    /* Groups are probed with triangular steps, which visits every
+     * group when the number of groups is a power of two.
+     */
+    size_t find_index(const KEY &key,uint64_t h) const {
+	const size_t gmask = capacity_/GROUP - 1;
+	const int8_t t = tag(h);
+	size_t g = h1(h) & gmask;
+	for(size_t step=1;;step++){
+	    const int8_t *c = ctrl + g*GROUP;
+	    for(uint32_t m = match(c,t); m; m &= m-1){
+		size_t i = g*GROUP + ctz(m);
+		if(slots[i].first==key) return i;
+	    }
+	    if(match_empty(c)) return capacity_;
+	    g = (g + step) & gmask;
+	}
+    }
+
+    /* find a slot for a key known not to be present and mark it full */
+    size_t prepare_insert(uint64_t h) {
+	if(growth_left==0){
+	    /* mostly tombstones? clean up in place; otherwise grow */
+	    rehash(size_ < max_load(capacity_)/2 ? capacity_ : capacity_*2);
+	}
+	const size_t gmask = capacity_/GROUP - 1;
+	size_t g = h1(h) & gmask;
+	for(size_t step=1;;step++){
+	    uint32_t m = match_free(ctrl + g*GROUP);
+	    if(m){
+		size_t i = g*GROUP + ctz(m);
+		if(ctrl[i]==EMPTY) growth_left--;
+		ctrl[i] = tag(h);
+		return i;
+	    }
+	    g = (g + step) & gmask;
+	}
+    }
+
+    void allocate(size_t cap) {
+	ctrl  = static_cast<int8_t *>(malloc(cap));
+	if(ctrl==0) throw std::bad_alloc();
+	memset(ctrl,EMPTY,cap);
+	slots = new slot_t[cap];
+	capacity_ = cap;
+	size_ = 0;
+	growth_left = max_load(cap);
+    }
+
+    void rehash(size_t cap) {
+	int8_t *old_ctrl  = ctrl;
+	slot_t *old_slots = slots;
+	size_t  old_cap   = capacity_;
+	allocate(cap);
+	for(size_t i=0;i<old_cap;i++){
+	    if(old_ctrl[i]<0) continue;
+	    size_t j = prepare_insert(old_slots[i].first.hash());
+	    slots[j] = old_slots[i];
+	    size_++;
+	}
+	free(old_ctrl);
+	delete [] old_slots;
+    }
+};
+
+#endif
@@ -0,0 +1,321 @@
+/**
+ * iouring.cpp
+ *
+ * Asynchronous flow file output through io_uring; see iouring.h.
+ * The ring is driven with the raw system calls, so liburing is not
+ * needed.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "iouring.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+iouring_queue::stats_t &iouring_queue::stats_t::operator+=(const stats_t &b)
+{
+    writes       += b.writes;
+    bytes        += b.bytes;
+    errors       += b.errors;
+    wait_count   += b.wait_count;
+    latency_usec += b.latency_usec;
+    if(b.depth_peak > depth_peak) depth_peak = b.depth_peak;
+    if(b.latency_usec_max > latency_usec_max) latency_usec_max = b.latency_usec_max;
+    return *this;
+}
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+
+/* One queued write. */
+class iouring_queue::op {
+public:
+    op(int fd_,uint64_t offset_,const uint8_t *data,size_t length_):
+	fd(fd_),offset(offset_),buf(new uint8_t[length_]),length(length_),done(0),queued(),iov(){
+	memcpy(buf,data,length);
+	gettimeofday(&queued,0);
+    }
+    ~op(){ delete [] buf; }
+    int		fd;
+    uint64_t	offset;
+    uint8_t	*buf;
+    size_t	length;
+    size_t	done;			// bytes written so far; writes can come back short
+    struct timeval queued;
+    struct iovec iov;			// IORING_OP_WRITEV works back to the first io_uring kernels
+private:
+    op(const op &);
+    op &operator=(const op &);
+};
+
+/* The writes waiting for one file; the first of them is in flight. */
+class iouring_queue::fd_state {
+public:
+    fd_state():name(),waiting(),closing(false),mtime(){}
+    std::string	name;
+    std::deque<op *> waiting;		// behind the one in flight
+    bool	closing;		// close() was called
+    struct timeval mtime;
+};
+
+bool iouring_queue::available() { return true; }
+
+iouring_queue::iouring_queue():depth(0),outstanding(0),stats(),ring_fd(-1),
+			       sq_map(0),sq_map_len(0),cq_map(0),cq_map_len(0),sqes(0),sqes_len(0),
+			       sq_head(0),sq_tail(0),sq_mask(0),sq_array(0),
+			       cq_head(0),cq_tail(0),cq_mask(0),cqes(0),
+			       unsubmitted(0),in_flight(0),fds()
+{
+}
+
+iouring_queue::~iouring_queue()
+{
+    if(ring_fd<0) return;
+    drain();
+    if(cq_map && cq_map!=sq_map) munmap(cq_map,cq_map_len);
+    if(sq_map) munmap(sq_map,sq_map_len);
+    if(sqes) munmap(sqes,sqes_len);
+    ::close(ring_fd);
+}
+
+bool iouring_queue::setup(unsigned int depth_)
+{
+    struct io_uring_params p;
+    memset(&p,0,sizeof(p));
+    ring_fd = syscall(__NR_io_uring_setup,depth_,&p);
+    if(ring_fd<0){
+	DEBUG(1)("warning: io_uring_setup: %s; writing flow files synchronously",strerror(errno));
+	return false;
+    }
+
+    sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_map_len = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+	single = true;
+	if(cq_map_len > sq_map_len) sq_map_len = cq_map_len;
+	cq_map_len = sq_map_len;
+    }
+#endif
+    void *m = mmap(0,sq_map_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_SQ_RING);
+    if(m==MAP_FAILED) die("io_uring: mmap: %s",strerror(errno));
+    sq_map = static_cast<uint8_t *>(m);
+    if(single){
+	cq_map = sq_map;
+    } else {
+	m = mmap(0,cq_map_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_CQ_RING);
+	if(m==MAP_FAILED) die("io_uring: mmap: %s",strerror(errno));
+	cq_map = static_cast<uint8_t *>(m);
+    }
+    sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(0,sqes_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_SQES);
+    if(sqes==MAP_FAILED) die("io_uring: mmap: %s",strerror(errno));
+
+    sq_head  = reinterpret_cast<unsigned int *>(sq_map + p.sq_off.head);
+    sq_tail  = reinterpret_cast<unsigned int *>(sq_map + p.sq_off.tail);
+    sq_mask  = reinterpret_cast<unsigned int *>(sq_map + p.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned int *>(sq_map + p.sq_off.array);
+    cq_head  = reinterpret_cast<unsigned int *>(cq_map + p.cq_off.head);
+    cq_tail  = reinterpret_cast<unsigned int *>(cq_map + p.cq_off.tail);
+    cq_mask  = reinterpret_cast<unsigned int *>(cq_map + p.cq_off.ring_mask);
+    cqes     = cq_map + p.cq_off.cqes;
+
+    depth = depth_ < p.sq_entries ? depth_ : p.sq_entries;
+    DEBUG(2)("io_uring: %d entries; at most %d writes outstanding",(int)p.sq_entries,(int)depth);
+    return true;
+}
+
+void iouring_queue::enter(unsigned int to_submit,unsigned int min_complete)
+{
+    while(true){
+	int r = syscall(__NR_io_uring_enter,ring_fd,to_submit,min_complete,
+			min_complete ? IORING_ENTER_GETEVENTS : 0,(void *)0,0);
+	if(r>=0){
+	    unsubmitted -= r;
+	    return;
+	}
+	if(errno==EINTR) continue;
+	if(errno==EAGAIN || errno==EBUSY){	// the kernel wants us to reap first
+	    if(min_complete) continue;
+	    return;
+	}
+	die("io_uring_enter: %s",strerror(errno));
+    }
+}
+
+void iouring_queue::submit(op *o)
+{
+    unsigned int tail = *sq_tail;
+    unsigned int idx  = tail & *sq_mask;
+    struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(sqes) + idx;
+    o->iov.iov_base = o->buf + o->done;
+    o->iov.iov_len  = o->length - o->done;
+    memset(sqe,0,sizeof(*sqe));
+    sqe->opcode    = IORING_OP_WRITEV;
+    sqe->fd        = o->fd;
+    sqe->off       = o->offset + o->done;
+    sqe->addr      = reinterpret_cast<uintptr_t>(&o->iov);
+    sqe->len       = 1;
+    sqe->user_data = reinterpret_cast<uintptr_t>(o);
+    sq_array[idx]  = idx;
+    __atomic_store_n(sq_tail,tail+1,__ATOMIC_RELEASE);	// the kernel may read the sqe now
+    unsubmitted++;
+    in_flight++;
+}
+
+void iouring_queue::write(int fd,const std::string &name,uint64_t offset,const uint8_t *data,size_t length)
+{
+    while(outstanding >= depth){
+	stats.wait_count++;
+	reap(true);
+    }
+    op *o = new op(fd,offset,data,length);
+    outstanding++;
+    if(outstanding > stats.depth_peak) stats.depth_peak = outstanding;
+
+    fd_map_t::iterator it = fds.find(fd);
+    if(it==fds.end()){
+	fd_state *s = new fd_state();
+	s->name = name;
+	fds[fd] = s;
+	submit(o);
+    } else {
+	it->second->waiting.push_back(o); // goes after the one in flight
+    }
+    reap(false);			// starts the write, and collects whatever has finished
+}
+
+void iouring_queue::close(int fd,const struct timeval &mtime)
+{
+    fd_map_t::iterator it = fds.find(fd);
+    if(it==fds.end()){
+	set_file_times(fd,mtime);
+	::close(fd);
+	return;
+    }
+    it->second->closing = true;
+    it->second->mtime   = mtime;
+}
+
+void iouring_queue::finish_fd(fd_map_t::iterator it)
+{
+    fd_state *s = it->second;
+    if(s->closing){
+	set_file_times(it->first,s->mtime);
+	::close(it->first);
+    }
+    fds.erase(it);
+    delete s;
+}
+
+void iouring_queue::complete(op *o,int res)
+{
+    in_flight--;
+    fd_map_t::iterator it = fds.find(o->fd);
+    assert(it!=fds.end());
+    fd_state *s = it->second;
+
+    if(res==-EINTR || res==-EAGAIN){
+	submit(o);			// try again
+	return;
+    }
+    if(res>0){
+	o->done += res;
+	if(o->done < o->length){	// short write: the rest goes next
+	    submit(o);
+	    return;
+	}
+    }
+    if(o->done < o->length){
+	DEBUG(1) ("write to %s failed: %s",s->name.c_str(),res<0 ? strerror(-res) : "no space");
+	stats.errors++;
+    }
+
+    struct timeval now;
+    gettimeofday(&now,0);
+    uint64_t usec = (now.tv_sec - o->queued.tv_sec) * 1000000 + (now.tv_usec - o->queued.tv_usec);
+    stats.writes++;
+    stats.bytes += o->done;
+    stats.latency_usec += usec;
+    if(usec > stats.latency_usec_max) stats.latency_usec_max = usec;
+    delete o;
+    outstanding--;
+
+    if(s->waiting.empty()){
+	finish_fd(it);
+    } else {
+	op *next = s->waiting.front();
+	s->waiting.pop_front();
+	submit(next);
+    }
+}
+
+void iouring_queue::reap(bool wait)
+{
+    if(ring_fd<0) return;
+    if(unsubmitted || (wait && in_flight)) enter(unsubmitted,(wait && in_flight) ? 1 : 0);
+    while(true){
+	unsigned int head = *cq_head;
+	if(head == __atomic_load_n(cq_tail,__ATOMIC_ACQUIRE)) break;
+	const struct io_uring_cqe *cqe = static_cast<const struct io_uring_cqe *>(cqes) + (head & *cq_mask);
+	op *o = reinterpret_cast<op *>(cqe->user_data);
+	int res = cqe->res;
+	__atomic_store_n(cq_head,head+1,__ATOMIC_RELEASE); // the kernel may reuse the cqe now
+	complete(o,res);
+    }
+    if(unsubmitted) enter(unsubmitted,0); // resubmissions and next writes from complete()
+}
+
+void iouring_queue::wait_fd(int fd)
+{
+    while(fds.find(fd)!=fds.end()){
+	reap(true);
+    }
+}
+
+void iouring_queue::drain()
+{
+    while(outstanding){
+	reap(true);
+    }
+}
+
+#else
+
+/* Without io_uring setup() fails and tcpflow writes synchronously. */
+class iouring_queue::op {};
+class iouring_queue::fd_state {};
+
+bool iouring_queue::available() { return false; }
+iouring_queue::iouring_queue():depth(0),outstanding(0),stats(),ring_fd(-1),
+			       sq_map(0),sq_map_len(0),cq_map(0),cq_map_len(0),sqes(0),sqes_len(0),
+			       sq_head(0),sq_tail(0),sq_mask(0),sq_array(0),
+			       cq_head(0),cq_tail(0),cq_mask(0),cqes(0),
+			       unsubmitted(0),in_flight(0),fds(){}
+iouring_queue::~iouring_queue(){}
+bool iouring_queue::setup(unsigned int depth_)
+{
+    DEBUG(1)("warning: this tcpflow was built without io_uring; writing flow files synchronously");
+    return false;
+}
+void iouring_queue::write(int fd,const std::string &name,uint64_t offset,const uint8_t *data,size_t length)
+{
+    die("iouring_queue::write: no io_uring");
+}
+void iouring_queue::close(int fd,const struct timeval &mtime)
+{
+    set_file_times(fd,mtime);
+    ::close(fd);
+}
+void iouring_queue::wait_fd(int fd){}
+void iouring_queue::drain(){}
+void iouring_queue::reap(bool wait){}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef IOURING_H
+#define IOURING_H
+
+/**
+ * iouring.h
+ *
+ * Asynchronous output of flow files through a Linux io_uring, so that
+ * a slow output disk does not hold up the capture loop.
+ *
+ * Writes are copied and queued; a file's writes go to the kernel one at
+ * a time, in the order they were queued, while different files' writes
+ * proceed side by side.  A close waits in the queue until the file's
+ * writes are done, and then sets the file's times and closes it.  At
+ * most depth operations are outstanding; queuing one more first waits
+ * for a completion.  Completions are reaped whenever something is
+ * queued, so the capture loop does the reaping as it goes.
+ *
+ * One iouring_queue belongs to one tcpdemux and is not thread-safe.
+ */
+
+#include <map>
+#include <deque>
+#include <string>
+#include <stdint.h>
+#include <sys/time.h>
+
+class iouring_queue {
+public:
+    class stats_t {
+    public:
+	stats_t():writes(0),bytes(0),errors(0),depth_peak(0),wait_count(0),
+		  latency_usec(0),latency_usec_max(0){}
+	uint64_t writes;		// write completions reaped
+	uint64_t bytes;			// bytes they wrote
+	uint64_t errors;		// writes that failed
+	uint64_t depth_peak;		// most operations outstanding at once
+	uint64_t wait_count;		// times the queue was full and had to wait
+	uint64_t latency_usec;		// sum of queue-to-completion time over writes
+	uint64_t latency_usec_max;	// longest of them
+	stats_t &operator+=(const stats_t &b);
+    };
+
+    static bool available();		// true if built with io_uring support
+
+    iouring_queue();
+    ~iouring_queue();			// drain()s first
+    bool setup(unsigned int depth);	// false if the kernel will not give us a ring
+
+    /* Queue a copy of [data,data+length) for fd at offset; name is for messages. */
+    void write(int fd,const std::string &name,uint64_t offset,const uint8_t *data,size_t length);
+    /* Set fd's times to mtime and close it once its writes are done. */
+    void close(int fd,const struct timeval &mtime);
+    void wait_fd(int fd);		// until fd has nothing queued or in flight
+    void drain();			// until nothing is
+    void reap(bool wait);		// handle completions; with wait, at least one
+
+    unsigned int depth;			// most operations outstanding
+    unsigned int outstanding;		// queued or in flight
+    stats_t	stats;
+
+private:
+    class op;
+    class fd_state;
+    typedef std::map<int,fd_state *> fd_map_t;
+
+    void submit(op *o);			// hand o to the kernel
+    void complete(op *o,int res);
+    void enter(unsigned int to_submit,unsigned int min_complete);
+    void finish_fd(fd_map_t::iterator it); // nothing left for it: close if asked to, and forget it
+
+    int		ring_fd;
+    uint8_t	*sq_map;
+    size_t	sq_map_len;
+    uint8_t	*cq_map;
+    size_t	cq_map_len;
+    void	*sqes;
+    size_t	sqes_len;
+    unsigned int *sq_head,*sq_tail,*sq_mask,*sq_array;
+    unsigned int *cq_head,*cq_tail,*cq_mask;
+    void	*cqes;
+    unsigned int unsubmitted;		// sqes filled in but not yet entered
+    unsigned int in_flight;		// submitted and not yet reaped
+    fd_map_t	fds;
+
+    /* not implemented */
+    iouring_queue(const iouring_queue &);
+    iouring_queue &operator=(const iouring_queue &);
+};
+
+#endif
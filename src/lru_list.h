@@ -0,0 +1,85 @@
+#ifndef LRU_LIST_H
+#define LRU_LIST_H
+
+/**
+ * lru_list.h
+ *
+ * An intrusive, doubly-linked list kept in order of use: the most
+ * recently used object is at the front and the least recently used
+ * at the back.  Adding, removing and moving an object to the front
+ * are O(1), and nothing is allocated.
+ *
+ * An object that can be on a list embeds an lru_hook; an object can be
+ * on several lists at once by embedding one hook for each:
+ *
+ *     class tcpip { ... lru_hook<tcpip> fd_lru; ... };
+ *     lru_list<tcpip,&tcpip::fd_lru> openflows;
+ */
+
+#include <stddef.h>
+
+template <class T>
+class lru_hook {
+public:
+    lru_hook():prev(0),next(0),linked(false){}
+    T	*prev;			// toward the front (more recent)
+    T	*next;			// toward the back (less recent)
+    bool linked;
+private:
+    /* not implemented */
+    lru_hook(const lru_hook &);
+    lru_hook &operator=(const lru_hook &);
+};
+
+template <class T,lru_hook<T> T::*HOOK>
+class lru_list {
+public:
+    lru_list():head(0),tail(0),count(0){}
+
+    size_t size() const  { return count; }
+    bool   empty() const { return count==0; }
+    T *front() const { return head; }	// most recently used
+    T *back() const  { return tail; }	// least recently used
+    static bool contains(const T *t) { return (t->*HOOK).linked; }
+
+    void push_front(T *t) {
+	lru_hook<T> &h = t->*HOOK;
+	h.prev = 0;
+	h.next = head;
+	h.linked = true;
+	if(head) (head->*HOOK).prev = t;
+	head = t;
+	if(tail==0) tail = t;
+	count++;
+    }
+
+    /** take t off the list; does nothing if it is not on it */
+    void erase(T *t) {
+	lru_hook<T> &h = t->*HOOK;
+	if(!h.linked) return;
+	if(h.prev) (h.prev->*HOOK).next = h.next; else head = h.next;
+	if(h.next) (h.next->*HOOK).prev = h.prev; else tail = h.prev;
+	h.prev = h.next = 0;
+	h.linked = false;
+	count--;
+    }
+
+    /** t was just used; move it to the front */
+    void touch(T *t) {
+	if(head!=t){
+	    erase(t);
+	    push_front(t);
+	}
+    }
+
+private:
+    T		*head;
+    T		*tail;
+    size_t	count;
+
+    /* not implemented */
+    lru_list(const lru_list &);
+    lru_list &operator=(const lru_list &);
+};
+
+#endif
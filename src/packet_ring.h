@@ -0,0 +1,172 @@
+#ifndef PACKET_RING_H
+#define PACKET_RING_H
+
+/**
+ * packet_ring.h
+ *
+ * A single-producer, single-consumer ring of packets, used to hand
+ * packets from the capture thread to a demux shard's thread without
+ * locks.
+ *
+ * Packets are copied into one contiguous byte buffer as variable-length
+ * records (a header followed by the packet bytes), so a ring of small
+ * packets holds many more than a ring of fixed-size slots would.  A
+ * record never wraps; if it does not fit before the end of the buffer
+ * the producer skips to the start.  The producer only writes head and
+ * the consumer only writes tail.  Each side publishes its index with a
+ * release store and reads the other's with an acquire load, so the
+ * bytes one side wrote (or finished reading) are visible to the other
+ * before the index moves.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <new>
+
+class packet_ring {
+public:
+    class packet {
+    public:
+	struct timeval ts;
+	uint32_t caplen;
+	int32_t  vlan;
+	uint32_t len;			// bytes in this record, header included
+	uint8_t  skip;			// padding to the end of the buffer; not a packet
+	uint8_t  start_new;		// demux.start_new_connections for this packet
+	uint8_t  tick;			// not a packet: only ts, the capture time, for the consumer's timers
+	const u_char *data() const { return reinterpret_cast<const u_char *>(this+1); }
+    };
+
+    /** bytes is rounded up to a power of two */
+    packet_ring(size_t bytes):buf(0),size(0),mask(0),head(0),tail_cache(0),pad0(),
+			      tail(0),head_cache(0),pad1(),is_closed(0){
+	size = 4096;
+	while(size < bytes) size *= 2;
+	mask = size-1;
+	buf = static_cast<uint8_t *>(malloc(size));
+	if(buf==0) throw std::bad_alloc();
+    }
+    ~packet_ring(){ free(buf); }
+
+    /** the largest packet that push() accepts */
+    size_t max_packet() const { return size/2 - sizeof(packet); }
+
+    /**
+     * Producer: copy a packet into the ring, or with tick a record of
+     * the time alone.  Returns false if there is not room for it right now.
+     */
+    bool push(const struct timeval &ts,const u_char *data,uint32_t caplen,int32_t vlan,bool start_new,
+	      bool tick=false) {
+	size_t need = align(sizeof(packet) + caplen);
+	size_t pos  = head & mask;
+	size_t skip = (size - pos < need) ? size - pos : 0;
+	if((head - tail_cache) + skip + need > size){
+	    tail_cache = load(&tail);
+	    if((head - tail_cache) + skip + need > size) return false;
+	}
+	size_t h = head;
+	if(skip){
+	    if(skip >= sizeof(packet)){
+		packet *p = reinterpret_cast<packet *>(buf + pos);
+		p->len  = skip;
+		p->skip = 1;
+	    }
+	    h += skip;
+	    pos = 0;
+	}
+	packet *p = reinterpret_cast<packet *>(buf + pos);
+	p->ts     = ts;
+	p->caplen = caplen;
+	p->vlan   = vlan;
+	p->len    = need;
+	p->skip   = 0;
+	p->start_new = start_new;
+	p->tick   = tick;
+	if(caplen) memcpy(p+1,data,caplen);
+	store(&head,h + need);
+	return true;
+    }
+
+    /** Consumer: the oldest packet in the ring, or 0 if it is empty. */
+    const packet *front() {
+	while(true){
+	    if(tail==head_cache){
+		head_cache = load(&head);
+		if(tail==head_cache) return 0;
+	    }
+	    size_t pos = tail & mask;
+	    if(size - pos < sizeof(packet)){	// too small for a header; producer skipped it
+		release(tail + (size - pos));
+		continue;
+	    }
+	    const packet *p = reinterpret_cast<const packet *>(buf + pos);
+	    if(p->skip){
+		release(tail + p->len);
+		continue;
+	    }
+	    return p;
+	}
+    }
+
+    /** Consumer: done with the packet returned by front(). */
+    void pop() {
+	release(tail + reinterpret_cast<const packet *>(buf + (tail & mask))->len);
+    }
+
+    /** Producer: no more packets will be pushed. */
+    void close() { store(&is_closed,1); }
+    bool closed() const { return load(&is_closed)!=0; }
+
+    /** Wait a little while the ring is full (producer) or empty (consumer). */
+    static void backoff(unsigned int &spins) {
+	if(spins++ < 64) sched_yield();
+	else usleep(50);
+    }
+
+private:
+    uint8_t	*buf;
+    size_t	size;			// power of two
+    size_t	mask;
+    /* producer's cache line */
+    size_t	head;			// bytes ever pushed; wraps
+    size_t	tail_cache;		// last tail the producer read
+    char	pad0[64];
+    /* consumer's cache line */
+    size_t	tail;			// bytes ever popped; wraps
+    size_t	head_cache;		// last head the consumer read
+    char	pad1[64];
+    size_t	is_closed;
+
+    /* not implemented */
+    packet_ring(const packet_ring &);
+    packet_ring &operator=(const packet_ring &);
+
+    static size_t align(size_t n) { return (n + 7) & ~(size_t)7; }
+
+    /* Older compilers lack the __atomic builtins; a volatile access
+     * next to a full barrier is as strong, only slower.
+     */
+#ifdef __ATOMIC_ACQUIRE
+    static size_t load(const size_t *p)   { return __atomic_load_n(p,__ATOMIC_ACQUIRE); }
+    static void store(size_t *p,size_t v) { __atomic_store_n(p,v,__ATOMIC_RELEASE); }
+#else
+    static size_t load(const size_t *p) {
+	size_t v = *const_cast<const volatile size_t *>(p);
+	__sync_synchronize();
+	return v;
+    }
+    static void store(size_t *p,size_t v) {
+	__sync_synchronize();
+	*const_cast<volatile size_t *>(p) = v;
+    }
+#endif
+
+    void release(size_t t) { store(&tail,t); }	// the producer may now reuse the bytes before t
+};
+
+#endif
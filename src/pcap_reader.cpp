@@ -0,0 +1,185 @@
+/**
+ * pcap_reader.cpp
+ *
+ * Memory-mapped reader for classic pcap files; see pcap_reader.h.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "pcap_reader.h"
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+
+static const size_t   WINDOW_SIZE   = 64*1024*1024;	// bytes of the file mapped at once
+static const uint32_t MAX_RECORD    = 262144;		// libpcap's largest snapshot length
+static const size_t   FILE_HEADER   = 24;
+static const size_t   RECORD_HEADER = 16;
+
+static const uint32_t MAGIC_USEC = 0xa1b2c3d4;
+static const uint32_t MAGIC_NSEC = 0xa1b23c4d;
+
+static const uint32_t LINKTYPE_RAW = 101;		// DLT_RAW differs between platforms
+
+static uint32_t swap32(uint32_t v)
+{
+    return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+
+/* The pcap file format has its own numbers for link types (LINKTYPE_);
+ * most are the same as the DLT_ values, but not all.
+ */
+static int linktype_to_dlt(uint32_t linktype)
+{
+    linktype &= 0x03ffffff;		// the upper bits describe FCS; we do not care
+    if(linktype==LINKTYPE_RAW) return DLT_RAW;
+    return (int)linktype;
+}
+
+pcap_reader::pcap_reader():fname(),fd(-1),file_size(0),swapped(false),nsec(false),dlt(0),snap(0),
+			   window(0),window_off(0),window_len(0)
+{
+}
+
+pcap_reader::~pcap_reader()
+{
+    unmap();
+    if(fd>=0) ::close(fd);
+}
+
+uint32_t pcap_reader::get32(const uint8_t *p) const
+{
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    return swapped ? swap32(v) : v;
+}
+
+void pcap_reader::unmap()
+{
+    if(window) munmap(window,window_len);
+    window = 0;
+    window_off = 0;
+    window_len = 0;
+}
+
+/**
+ * Return a pointer to bytes [off,off+len) of the file, moving the window
+ * if they are not all in it; 0 if the file is not that long.  Moving the
+ * window invalidates pointers returned before.
+ */
+const uint8_t *pcap_reader::map(uint64_t off,size_t len)
+{
+    if(off+len > file_size) return 0;
+    if(window && off >= window_off && off+len <= window_off+window_len){
+	return window + (off - window_off);
+    }
+    unmap();
+    static const uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = off - (off % page);
+    uint64_t end   = start + WINDOW_SIZE;
+    if(end < off+len) end = off+len;
+    if(end > file_size) end = file_size;
+    void *p = mmap(0,end-start,PROT_READ,MAP_SHARED,fd,start);
+    if(p==MAP_FAILED) die("%s: mmap: %s",fname.c_str(),strerror(errno));
+    window     = static_cast<uint8_t *>(p);
+    window_off = start;
+    window_len = end-start;
+#ifdef MADV_SEQUENTIAL
+    madvise(window,window_len,MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_WILLNEED
+    madvise(window,window_len,MADV_WILLNEED);	// start reading the whole window now
+#endif
+    return window + (off - window_off);
+}
+
+bool pcap_reader::open(const std::string &fname_)
+{
+    fname = fname_;
+    if(fname=="-") return false;	// standard input cannot be mapped
+    fd = ::open(fname.c_str(),O_RDONLY);
+    if(fd<0) return false;
+    struct stat st;
+    if(fstat(fd,&st) || !S_ISREG(st.st_mode) || (uint64_t)st.st_size < FILE_HEADER){
+	::close(fd);
+	fd = -1;
+	return false;
+    }
+    file_size = st.st_size;
+
+    const uint8_t *h = map(0,FILE_HEADER);
+    uint32_t magic;
+    memcpy(&magic,h,sizeof(magic));
+    if(magic==MAGIC_USEC || magic==MAGIC_NSEC){
+	swapped = false;
+    } else if(swap32(magic)==MAGIC_USEC || swap32(magic)==MAGIC_NSEC){
+	swapped = true;
+	magic = swap32(magic);
+    } else {
+	unmap();
+	::close(fd);
+	fd = -1;
+	return false;			// pcapng, compressed, or not a capture at all
+    }
+    nsec = (magic==MAGIC_NSEC);
+    snap = get32(h+16);
+    dlt  = linktype_to_dlt(get32(h+20));
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+#endif
+    DEBUG(2)("%s: reading with mmap (%s byte order, %s timestamps)",fname.c_str(),
+	     swapped ? "swapped" : "native",nsec ? "nanosecond" : "microsecond");
+    return true;
+}
+
+uint64_t pcap_reader::loop(pcap_handler handler,u_char *user,const struct bpf_program *filter)
+{
+    uint64_t count = 0;
+    uint64_t off = FILE_HEADER;
+    while(off < file_size && !terminate_requested){
+	const uint8_t *rh = map(off,RECORD_HEADER);
+	if(rh==0){
+	    DEBUG(1)("warning: %s: truncated packet header at offset %"PRIu64,fname.c_str(),off);
+	    break;
+	}
+	struct pcap_pkthdr h;
+	uint32_t frac = get32(rh+4);
+	h.ts.tv_sec  = get32(rh);
+	h.ts.tv_usec = nsec ? frac/1000 : frac;
+	h.caplen     = get32(rh+8);
+	h.len        = get32(rh+12);
+	if(h.caplen > MAX_RECORD){
+	    die("%s: bad packet length %u at offset %"PRIu64"; the file is corrupt",
+		fname.c_str(),h.caplen,off);
+	}
+	const uint8_t *p = map(off+RECORD_HEADER,h.caplen);
+	if(p==0){
+	    DEBUG(1)("warning: %s: truncated packet at offset %"PRIu64,fname.c_str(),off);
+	    break;
+	}
+	off += RECORD_HEADER + h.caplen;
+#ifdef HAVE_LIBPCAP
+	if(filter && !pcap_offline_filter(filter,&h,p)) continue;
+#endif
+	(*handler)(user,&h,p);
+	count++;
+    }
+    unmap();
+    return count;
+}
+
+#else
+
+/* Without mmap every file goes through libpcap. */
+pcap_reader::pcap_reader():fname(),fd(-1),file_size(0),swapped(false),nsec(false),dlt(0),snap(0),
+			   window(0),window_off(0),window_len(0){}
+pcap_reader::~pcap_reader(){}
+bool pcap_reader::open(const std::string &fname_) { return false; }
+uint64_t pcap_reader::loop(pcap_handler handler,u_char *user,const struct bpf_program *filter) { return 0; }
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef PCAP_READER_H
+#define PCAP_READER_H
+
+/**
+ * pcap_reader.h
+ *
+ * A reader for classic pcap files that maps the file into memory and
+ * hands each packet to a pcap_handler where it lies, without going
+ * through libpcap's read buffer.  Both byte orders and both microsecond
+ * and nanosecond timestamps are understood; anything else (pcapng,
+ * compressed files) is left to libpcap.
+ *
+ * The file is mapped a window at a time, so arbitrarily large files can
+ * be read on 32-bit systems too, and the kernel is told that the window
+ * will be read sequentially so that it reads ahead and drops pages
+ * behind us.
+ */
+
+#include <string>
+#include <stdint.h>
+#include <sys/types.h>
+
+class pcap_reader {
+public:
+    pcap_reader();
+    ~pcap_reader();
+
+    /**
+     * Open fname.  Returns false, with nothing open, if it cannot be
+     * opened or is not a classic pcap file.
+     */
+    bool open(const std::string &fname);
+
+    int      datalink() const { return dlt; }	// a DLT_ value, as pcap_datalink() returns
+    uint32_t snaplen() const  { return snap; }
+
+    /**
+     * Call handler for every packet that passes filter (0 for no filter).
+     * Returns the number of packets handed to handler.
+     */
+    uint64_t loop(pcap_handler handler,u_char *user,const struct bpf_program *filter);
+
+private:
+    std::string	fname;
+    int		fd;
+    uint64_t	file_size;
+    bool	swapped;		// the file was written with the other byte order
+    bool	nsec;			// timestamps are in nanoseconds
+    int		dlt;
+    uint32_t	snap;
+    uint8_t	*window;		// the part of the file mapped now
+    uint64_t	window_off;		// file offset of window; a multiple of the page size
+    size_t	window_len;
+
+    /* not implemented */
+    pcap_reader(const pcap_reader &);
+    pcap_reader &operator=(const pcap_reader &);
+
+    const uint8_t *map(uint64_t off,size_t len);
+    void unmap();
+    uint32_t get32(const uint8_t *p) const;
+};
+
+#endif
@@ -0,0 +1,155 @@
+/**
+ * post_queue.cpp
+ *
+ * Worker threads for the work done when a flow is closed; see
+ * post_queue.h.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "post_queue.h"
+
+#include <vector>
+
+#ifdef HAVE_PTHREAD
+
+static pthread_key_t worker_key;	// set on the workers
+static bool          worker_key_created = false;
+
+class post_queue::sync {
+public:
+    sync():workers(),lock(),ready(){
+	pthread_mutex_init(&lock,0);
+	pthread_cond_init(&ready,0);
+    }
+    ~sync(){
+	pthread_cond_destroy(&ready);
+	pthread_mutex_destroy(&lock);
+    }
+    std::vector<pthread_t> workers;
+    pthread_mutex_t lock;		// waiting, stopping and stats
+    pthread_cond_t  ready;		// a job is waiting, or stopping is set
+private:
+    /* not implemented */
+    sync(const sync &);
+    sync &operator=(const sync &);
+};
+
+bool post_queue::available() { return true; }
+
+bool post_queue::on_worker()
+{
+    return worker_key_created && pthread_getspecific(worker_key)!=0;
+}
+
+post_queue::post_queue(tcpdemux &demux_,unsigned int nthreads,size_t depth_):
+    depth(depth_),stats(),demux(demux_),waiting(),stopping(false),threads(new sync())
+{
+    if(!worker_key_created){
+	if(pthread_key_create(&worker_key,0)) die("pthread_key_create: %s",strerror(errno));
+	worker_key_created = true;
+    }
+    DEBUG(2)("starting %d post-processing threads",(int)nthreads);
+    for(unsigned int i=0;i<nthreads;i++){
+	pthread_t t;
+	if(pthread_create(&t,0,run,this)) die("pthread_create: %s",strerror(errno));
+	threads->workers.push_back(t);
+    }
+}
+
+post_queue::~post_queue()
+{
+    stop();
+    delete threads;
+}
+
+bool post_queue::submit(post_job *job)
+{
+    pthread_mutex_lock(&threads->lock);
+    if(stopping || waiting.size() >= depth){
+	if(!stopping) stats.full++;
+	pthread_mutex_unlock(&threads->lock);
+	return false;
+    }
+    gettimeofday(&job->queued,0);
+    waiting.push_back(job);
+    if(waiting.size() > stats.depth_peak) stats.depth_peak = waiting.size();
+    pthread_cond_signal(&threads->ready);
+    pthread_mutex_unlock(&threads->lock);
+    return true;
+}
+
+void post_queue::stop()
+{
+    pthread_mutex_lock(&threads->lock);
+    if(stopping){
+	pthread_mutex_unlock(&threads->lock);
+	return;
+    }
+    stopping = true;
+    pthread_cond_broadcast(&threads->ready);
+    pthread_mutex_unlock(&threads->lock);
+    for(std::vector<pthread_t>::const_iterator it=threads->workers.begin();it!=threads->workers.end();it++){
+	pthread_join(*it,0);
+    }
+    threads->workers.clear();
+}
+
+void *post_queue::run(void *arg)
+{
+    post_queue *q = reinterpret_cast<post_queue *>(arg);
+    pthread_setspecific(worker_key,q);
+    q->work();
+    return 0;
+}
+
+/* Take jobs until stop() is called and none are left. */
+void post_queue::work()
+{
+    pthread_mutex_lock(&threads->lock);
+    while(true){
+	if(waiting.empty()){
+	    if(stopping) break;
+	    pthread_cond_wait(&threads->ready,&threads->lock);
+	    continue;
+	}
+	post_job *job = waiting.front();
+	waiting.pop_front();
+	pthread_mutex_unlock(&threads->lock);
+
+	demux.post_process(*job);
+	struct timeval done;
+	gettimeofday(&done,0);
+	uint64_t usec = (done.tv_sec - job->queued.tv_sec) * 1000000 + (done.tv_usec - job->queued.tv_usec);
+	delete job;
+
+	pthread_mutex_lock(&threads->lock);
+	stats.jobs++;
+	stats.latency_usec += usec;
+	if(usec > stats.latency_usec_max) stats.latency_usec_max = usec;
+    }
+    pthread_mutex_unlock(&threads->lock);
+}
+
+#else
+
+/* Without threads every flow is finished by the thread that closes it. */
+class post_queue::sync {};
+
+bool post_queue::available() { return false; }
+bool post_queue::on_worker() { return false; }
+
+post_queue::post_queue(tcpdemux &demux_,unsigned int nthreads,size_t depth_):
+    depth(depth_),stats(),demux(demux_),waiting(),stopping(true),threads(0)
+{
+}
+
+post_queue::~post_queue() {}
+bool post_queue::submit(post_job *job) { return false; }
+void post_queue::stop() {}
+void *post_queue::run(void *arg) { return 0; }
+void post_queue::work() {}
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef POST_QUEUE_H
+#define POST_QUEUE_H
+
+/**
+ * post_queue.h
+ *
+ * The work left when a flow is closed: reading its file back for the
+ * digests and scanners that were not done as it was stored, and writing
+ * its <fileobject> to the DFXML file.
+ *
+ * By default the thread that closes the flow does this at once.  With
+ * -S post_threads=N, tcpip::~tcpip() instead hands flows that must be
+ * read back to N worker threads as post_jobs, so that a large flow's
+ * scanners do not hold up the packets behind it.  At most depth jobs
+ * wait; a flow closed while the queue is full is done by the closing
+ * thread itself, which slows capture to the pace of the workers
+ * instead of letting the queue grow.  The workers open files without
+ * going through a tcpdemux, so start_post() sets aside two descriptors
+ * each from max_fds: the flow file and an HTTP body.  Every
+ * <fileobject> is written under tcpdemux::lock_xreport(), one at a
+ * time, in the order the flows are finished.
+ */
+
+#include <deque>
+#include <string>
+#include <stdint.h>
+#include <sys/time.h>
+
+/* One closed flow: what tcpdemux::post_process() needs once the tcpip is gone. */
+class post_job {
+public:
+    post_job():flow_pathname(),filesize(0),attrs(),gapxml(),xmladd(),digests(0),scan(false),queued(){}
+    std::string	flow_pathname;
+    uint64_t	filesize;
+    std::string	attrs;			// of the <tcpflow> element
+    std::string	gapxml;			// its gaps' <byte_run>s
+    std::string	xmladd;			// digests computed as the flow was stored
+    unsigned int digests;		// digest_set algorithms to compute from the file
+    bool	scan;			// run the scanners on the file
+    struct timeval queued;
+};
+
+class post_queue {
+public:
+    class stats_t {
+    public:
+	stats_t():jobs(0),full(0),depth_peak(0),latency_usec(0),latency_usec_max(0){}
+	uint64_t jobs;			// done by the workers
+	uint64_t full;			// done by the closing thread because the queue was full
+	uint64_t depth_peak;		// most jobs waiting at once
+	uint64_t latency_usec;		// sum of queue-to-done time over jobs
+	uint64_t latency_usec_max;	// longest of them
+    };
+
+    static bool available();		// true if built with threads
+    static bool on_worker();		// true on one of the workers
+
+    post_queue(class tcpdemux &demux_,unsigned int threads,size_t depth_);
+    ~post_queue();			// stop()s first
+
+    /* Take job for a worker; false, leaving it to the caller, if the
+     * queue is full or stopped.
+     */
+    bool submit(post_job *job);
+    void stop();			// finish the waiting jobs and join the workers
+
+    size_t	depth;			// most jobs waiting
+    stats_t	stats;			// read once stop()ped
+
+private:
+    static void *run(void *arg);
+    void	work();
+
+    class sync;				// the workers, their lock and condition (post_queue.cpp)
+    class tcpdemux &demux;		// post_process()es the jobs
+    std::deque<post_job *> waiting;
+    bool	stopping;
+    sync	*threads;
+
+    /* not implemented */
+    post_queue(const post_queue &);
+    post_queue &operator=(const post_queue &);
+};
+
+#endif
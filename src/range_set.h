@@ -0,0 +1,111 @@
+#ifndef RANGE_SET_H
+#define RANGE_SET_H
+
+/**
+ * range_set.h
+ *
+ * A set of byte offsets kept as sorted, disjoint, non-adjacent
+ * [start,end) ranges in a vector.  A flow that arrives in order is a
+ * single range however long it gets, and reordering only adds ranges
+ * until the holes between them are filled, so the vector stays short
+ * and a lookup is a binary search over a few entries.
+ *
+ * tcpip uses one to remember which bytes of its file have been
+ * written, so that retransmissions are not written again and the holes
+ * can be reported when the flow is closed.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+class range_set {
+public:
+    typedef std::pair<uint64_t,uint64_t> range; // [first,second)
+    typedef std::vector<range> ranges_t;
+
+    range_set():ranges(){}
+
+    size_t size() const { return ranges.size(); }
+    bool empty() const { return ranges.empty(); }
+    const range &operator[](size_t i) const { return ranges[i]; }
+    size_t memory_used() const { return ranges.capacity() * sizeof(range); }
+
+    /* offset just past the last byte in the set */
+    uint64_t extent() const { return ranges.empty() ? 0 : ranges.back().second; }
+
+    /* number of bytes in the set */
+    uint64_t covered() const {
+	uint64_t n = 0;
+	for(ranges_t::const_iterator it=ranges.begin();it!=ranges.end();it++) n += it->second - it->first;
+	return n;
+    }
+
+    /* true if all of [start,end) is in the set */
+    bool contains(uint64_t start,uint64_t end) const {
+	ranges_t::const_iterator it = first_ending_after(start);
+	return it!=ranges.end() && it->first <= start && end <= it->second;
+    }
+
+    /* append the parts of [start,end) that are not in the set to out */
+    void missing(uint64_t start,uint64_t end,ranges_t &out) const {
+	for(ranges_t::const_iterator it = first_ending_after(start);it!=ranges.end() && start<end;it++){
+	    if(it->first >= end) break;
+	    if(it->first > start) out.push_back(range(start,it->first));
+	    start = it->second;
+	}
+	if(start<end) out.push_back(range(start,end));
+    }
+
+    /* append the holes between 0 and extent() to out */
+    void gaps(ranges_t &out) const {
+	uint64_t at = 0;
+	for(ranges_t::const_iterator it=ranges.begin();it!=ranges.end();it++){
+	    if(it->first > at) out.push_back(range(at,it->first));
+	    at = it->second;
+	}
+    }
+
+    /* add [start,end), merging it with the ranges it overlaps or touches */
+    void add(uint64_t start,uint64_t end) {
+	if(start>=end) return;
+	if(ranges.empty() || ranges.back().second < start){ // the usual case: past the end
+	    ranges.push_back(range(start,end));
+	    return;
+	}
+	ranges_t::iterator first = ranges.begin();
+	while(first!=ranges.end() && first->second < start) first++; // cheaper than a search for short sets
+	ranges_t::iterator last = first;
+	while(last!=ranges.end() && last->first <= end){
+	    if(last->first  < start) start = last->first;
+	    if(last->second > end)   end   = last->second;
+	    last++;
+	}
+	if(first==last){
+	    ranges.insert(first,range(start,end));
+	} else {
+	    first->first  = start;
+	    first->second = end;
+	    ranges.erase(first+1,last);
+	}
+    }
+
+    /* move everything up by n, for bytes put in front of the file */
+    void shift(uint64_t n) {
+	for(ranges_t::iterator it=ranges.begin();it!=ranges.end();it++){
+	    it->first  += n;
+	    it->second += n;
+	}
+    }
+
+    void clear() { ranges_t().swap(ranges); }
+
+private:
+    static bool ends_before(const range &r,uint64_t offset) { return r.second <= offset; }
+    ranges_t::const_iterator first_ending_after(uint64_t offset) const {
+	return std::lower_bound(ranges.begin(),ranges.end(),offset,ends_before);
+    }
+    ranges_t ranges;
+};
+
+#endif
@@ -14,20 +14,22 @@
 #include "http-parser/http_parser.h"
 
 #include "mime_map.h"
+#include "scan_http.h"
+#include "post_queue.h"
 
 
 /***
  * data structures
  */
 
-typedef struct scan_http_data_t;
-typedef int(*write_data_fn_t)(scan_http_data_t * data, sbuf_t& buf);
+struct scan_http_data_t;
+typedef int(*write_data_fn_t)(scan_http_data_t * data, const char * buf, size_t length);
 
 /* define a data structure for sharing state between scan_http() and its callbacks */
-typedef struct scan_http_data_t {
+struct scan_http_data_t {
 	std::string path;
-	const sbuf_t * sbuf;
-	tcpdemux *d;
+	tcpdemux *d;			/* opens the body files; NULL to open them directly */
+	const tcpip *owner;		/* the flow, when it is parsed as it is stored */
 	int request_no;
 	
 	/* parsed headers */
@@ -37,28 +39,62 @@ typedef struct scan_http_data_t {
 	int header_state;
 	std::string header_value, header_field;
 	
+	/* the body being written; empty if there is none, or it can't be */
 	std::string output_path;
 	
-	int fd;
+	int fd;				/* output_path, if it is open */
 	write_data_fn_t write_fn;
 	void * write_fn_state;
 	
-	scan_http_data_t(const std::string& path_, const sbuf_t * sbuf_, tcpdemux * d_) :
-		path(path_), sbuf(sbuf_), d(d_), request_no(0),
+	/* With owner, the body files written and their sizes before,
+	 * so that scan_http_stream::abandon() can take them back */
+	std::vector<std::pair<std::string, off_t> > outputs;
+	
+	scan_http_data_t(const std::string& path_, tcpdemux * d_, const tcpip * owner_) :
+		path(path_), d(d_), owner(owner_), request_no(0),
 		headers(), header_state(0), header_value(), header_field(),
-		output_path(), fd(-1), write_fn(NULL), write_fn_state(NULL) {};
+		output_path(), fd(-1), write_fn(NULL), write_fn_state(NULL), outputs() {};
 	
-	scan_http_data_t(const scan_http_data_t& c) :
-		path(c.path), sbuf(c.sbuf), d(c.d), request_no(c.request_no),
-		headers(c.headers), header_state(c.header_state), header_value(c.header_value), header_field(c.header_field),
-		output_path(c.output_path), fd(c.fd), write_fn(c.write_fn), write_fn_state(c.write_fn_state) {};
+	~scan_http_data_t() {
+		end_body();
+	};
 	
 	void close_fd() {
-		if ((fd >= 0) && (close(fd) != 0)) {
+		if (fd < 0) return;
+		if (close(fd) != 0) {
 			perror("close() of http body");
 		}
+		if (d) d->http_body_fds--;
 		fd = -1;
 	};
+	
+	/* open output_path for appending; forget it if that fails.
+	 * With d the descriptor counts against d->max_fds. */
+	void open_body() {
+		const int oflag = O_WRONLY|O_CREAT|O_BINARY|O_APPEND;
+		fd = d ? d->retrying_open(output_path, oflag, 0644, owner) : ::open(output_path.c_str(), oflag, 0644);
+		if (fd < 0) {
+			DEBUG(1) ("unable to open HTTP body file %s", output_path.c_str());
+			output_path.clear();
+			return;
+		}
+		if (d) d->http_body_fds++;
+	};
+	
+	/* the body is complete, or will not be continued */
+	void end_body() {
+		if (write_fn) {
+			write_fn(this, NULL, 0);	/* an empty buffer signals EOF */
+			write_fn = NULL;
+		}
+		close_fd();
+		output_path.clear();
+	};
+	
+private:
+	/* not implemented */
+	scan_http_data_t(const scan_http_data_t &);
+	scan_http_data_t &operator=(const scan_http_data_t &);
 };
 
 
@@ -67,8 +103,11 @@ typedef struct scan_http_data_t {
  */
 
 /* write data to a file with no decoding */
-int scan_http_write_data_raw(scan_http_data_t * data, sbuf_t& buf) {
-	buf.raw_dump(data->fd, 0, buf.size());
+int scan_http_write_data_raw(scan_http_data_t * data, const char * buf, size_t length) {
+	if (length > 0 && write(data->fd, buf, length) != (ssize_t)length) {
+		DEBUG(3) ("writing HTTP body failed");
+		return -1;
+	}
 	return 0;
 }
 
@@ -85,11 +124,14 @@ int scan_http_write_data_raw(scan_http_data_t * data, sbuf_t& buf) {
 #define zs (reinterpret_cast<z_stream *>(data->write_fn_state))
 
 /* write gzipped data to a file, decompressing it as we go */
-int scan_http_write_data_zlib(scan_http_data_t * data, sbuf_t& buf) {
-	if (buf.size() == 0 && data->write_fn_state) {
+int scan_http_write_data_zlib(scan_http_data_t * data, const char * buf, size_t length) {
+	if (length == 0) {
 		/* EOF */
-		inflateEnd(zs);
-		free(zs);
+		if (data->write_fn_state) {
+			inflateEnd(zs);
+			free(zs);
+			data->write_fn_state = NULL;
+		}
 		return 0;
 	}
 	
@@ -102,8 +144,8 @@ int scan_http_write_data_zlib(scan_http_data_t * data, sbuf_t& buf) {
 	
 	/* set up this round of decompression, using a small local buffer */
 	char decompressed[65536];
-	zs->next_in = (Bytef*)buf.buf;
-	zs->avail_in = buf.size();
+	zs->next_in = (Bytef*)buf;
+	zs->avail_in = length;
 	zs->next_out = (Bytef*)decompressed;
 	zs->avail_out = sizeof(decompressed);
 	
@@ -177,15 +219,10 @@ int scan_http_cb_on_url(http_parser * parser, const char *at, size_t length) {
 }
 
 int scan_http_cb_on_header_field(http_parser * parser, const char *at, size_t length) {
-	const char * sbuf_head = reinterpret_cast<const char *>(data->sbuf->buf);
-	size_t offset = at - sbuf_head;
-	assert(offset < data->sbuf->size());
-	sbuf_t buf(*data->sbuf, offset, length);
-	
 	if (data->header_state == 1) {
 		/* we're a continuation of a partly-read header field */
 		/* append it */
-		data->header_field.append(buf.asString());
+		data->header_field.append(at, length);
 	} else {
 		/* we're a new header field */
 		if (data->header_state == 2) {
@@ -195,7 +232,7 @@ int scan_http_cb_on_header_field(http_parser * parser, const char *at, size_t le
 		}
 		
 		/* store this field name */
-		data->header_field = buf.asString();
+		data->header_field.assign(at, length);
 		
 		/* indicate that we just read a header field */
 		data->header_state = 1;
@@ -205,18 +242,13 @@ int scan_http_cb_on_header_field(http_parser * parser, const char *at, size_t le
 }
 
 int scan_http_cb_on_header_value(http_parser * parser, const char *at, size_t length) {
-	const char * sbuf_head = reinterpret_cast<const char *>(data->sbuf->buf);
-	size_t offset = at - sbuf_head;
-	assert(offset < data->sbuf->size());
-	sbuf_t buf(*data->sbuf, offset, length);
-	
 	if (data->header_state == 2) {
 		/* we're a continuation of a partly-read header value */
-		data->header_value.append(buf.asString());
+		data->header_value.append(at, length);
 	} else {
 		/* we're a new header value */
 		/* store the value */
-		data->header_value = buf.asString();
+		data->header_value.assign(at, length);
 		
 		/* indicate that we just read a header value */
 		data->header_state = 2;
@@ -264,9 +296,9 @@ int scan_http_cb_on_headers_complete(http_parser * parser) {
 	}
 	
 	/* Open the output path */
-	data->fd = data->d->retrying_open(data->output_path, O_WRONLY|O_CREAT|O_BINARY|O_APPEND, 0644);
-	if (data->fd < 0) {
-		DEBUG(1) ("unable to open HTTP body file %s", data->output_path.c_str());
+	data->open_body();
+	if (data->fd >= 0 && data->owner) {
+		data->outputs.push_back(std::make_pair(data->output_path, lseek(data->fd, 0, SEEK_END)));
 	}
 	
 	/* We can do something smart with the headers here.
@@ -280,18 +312,17 @@ int scan_http_cb_on_headers_complete(http_parser * parser) {
 }
 
 int scan_http_cb_on_body(http_parser * parser, const char *at, size_t length) {
-	/* Turn this back into an sbuf_t by mathing out the buffer offset */
-	const char * sbuf_head = reinterpret_cast<const char *>(data->sbuf->buf);
-	size_t offset = at - sbuf_head;
-	assert(offset < data->sbuf->size());
-	sbuf_t buf(*data->sbuf, offset, length);
+	/* a body parsed as it is stored is closed between packets when its flow's file is */
+	if (data->fd < 0 && data->output_path.size()) {
+		data->open_body();
+	}
 	
 	if (data->fd >= 0) {
 		/* Write this buffer to the output file via the appropriate function */
-		int rv = data->write_fn(data, buf);
+		int rv = data->write_fn(data, at, length);
 		if (rv) {
 			/* failed! close early */
-			data->close_fd();
+			data->end_body();
 		}
 	}
 	
@@ -299,18 +330,149 @@ int scan_http_cb_on_body(http_parser * parser, const char *at, size_t length) {
 }
 
 int scan_http_cb_on_message_complete(http_parser * parser) {
-	/* Call the write function with an empty buffer to signal EOF */
-	sbuf_t empty_buffer(*data->sbuf, 0, 0);
-	data->write_fn(data, empty_buffer);
-	
-	/* Close the file */
-	data->close_fd();
+	/* Signal EOF to the write function and close the file */
+	data->end_body();
 	
 	return 0;
 }
 
 #undef data
 
+static http_parser_settings make_parser_settings()
+{
+	http_parser_settings settings;
+	memset(&settings, 0, sizeof(settings));
+	settings.on_message_begin	= scan_http_cb_on_message_begin;
+	settings.on_url			= scan_http_cb_on_url;
+	settings.on_header_field	= scan_http_cb_on_header_field;
+	settings.on_header_value	= scan_http_cb_on_header_value;
+	settings.on_headers_complete	= scan_http_cb_on_headers_complete;
+	settings.on_body		= scan_http_cb_on_body;
+	settings.on_message_complete	= scan_http_cb_on_message_complete;
+	return settings;
+}
+
+static const http_parser_settings scan_http_parser_settings = make_parser_settings();
+
+static const char http_magic[] = "HTTP/1.";	/* what a flow must start with to be parsed */
+static const size_t http_magic_len = 7;
+
+/* Run parser over length bytes of the stream.  A parser that stops
+ * early (a parse error, or a response after Connection: close) is
+ * started again where it stopped, since there could be multiple
+ * responses.  fresh says that parser has just been initialized; it is
+ * kept up to date, so that the stream can be given in pieces.
+ * Returns false once parsing should end.
+ */
+static bool scan_http_parse(http_parser &parser, bool &fresh, const char *buf, size_t length)
+{
+	while (length > 0) {
+		size_t parsed = http_parser_execute(&parser, &scan_http_parser_settings, buf, length);
+		assert(parsed <= length);
+		
+		/* Keep going with the next piece if we parsed all of this one */
+		if (parsed == length) {
+			fresh = false;
+			return true;
+		}
+		
+		/* Stop parsing if a new parser parsed nothing */
+		if (parsed == 0 && fresh) {
+			return false;
+		}
+		
+		/* Stop parsing if we're a connection upgrade (e.g. WebSockets) */
+		if (parser.upgrade) {
+			DEBUG(9) ("upgrade connection detected (WebSockets?); cowardly refusing to dump further");
+			return false;
+		}
+		
+		/* Start a new parser where this one stopped */
+		void *data = parser.data;
+		http_parser_init(&parser, HTTP_RESPONSE);
+		parser.data = data;
+		fresh = true;
+		buf += parsed;
+		length -= parsed;
+	}
+	return true;
+}
+
+
+/***
+ * the HTTP responses of a flow as it is stored
+ */
+
+scan_http_stream::scan_http_stream(const std::string &flow_pathname, const tcpip *owner) :
+	data(new scan_http_data_t(flow_pathname, &owner->demux, owner)),
+	parser(), fresh(true), head(), parsing(true)
+{
+	http_parser_init(&parser, HTTP_RESPONSE);
+	parser.data = data;
+}
+
+scan_http_stream::~scan_http_stream()
+{
+	delete data;			/* ends the body, if one is open */
+}
+
+void scan_http_stream::update(const u_char *bytes, size_t length)
+{
+	if (!parsing) return;
+	const char *buf = reinterpret_cast<const char *>(bytes);
+	
+	/* See if there is an HTTP response, as scan_http() does */
+	if (head.size() < http_magic_len) {
+		size_t n = std::min(http_magic_len - head.size(), length);
+		head.append(buf, n);
+		buf += n;
+		length -= n;
+		if (head.size() < http_magic_len) return;
+		if (head != http_magic) {
+			parsing = false;
+			return;
+		}
+		parse(head.data(), head.size());
+	}
+	parse(buf, length);
+}
+
+void scan_http_stream::parse(const char *buf, size_t length)
+{
+	if (parsing && !scan_http_parse(parser, fresh, buf, length)) {
+		parsing = false;
+	}
+}
+
+void scan_http_stream::finish()
+{
+	if (parsing && head.size() == http_magic_len) {
+		/* Indicate EOF (flushing callbacks) */
+		http_parser_execute(&parser, &scan_http_parser_settings, NULL, 0);
+	}
+	parsing = false;
+	data->end_body();
+	data->outputs.clear();		/* they are final */
+}
+
+void scan_http_stream::abandon()
+{
+	parsing = false;
+	data->end_body();
+	for (size_t i = 0; i < data->outputs.size(); i++) {
+		const std::string &path = data->outputs[i].first;
+		off_t size = data->outputs[i].second;
+		if ((size == 0 ? unlink(path.c_str()) : truncate(path.c_str(), size)) != 0) {
+			DEBUG(1) ("unable to remove the HTTP body written to %s", path.c_str());
+		}
+	}
+	data->outputs.clear();
+}
+
+void scan_http_stream::close_body()
+{
+	data->close_fd();
+}
 
 
 /***
@@ -334,55 +496,21 @@ void  scan_http(const class scanner_params &sp,const recursion_control_block &rc
 
 	if(sp.phase==scanner_params::scan){
 		/* See if there is an HTTP response */
-		if(sp.sbuf.memcmp(reinterpret_cast<const uint8_t *>("HTTP/1."),0,7)==0){
+		if(sp.sbuf.memcmp(reinterpret_cast<const uint8_t *>(http_magic),0,http_magic_len)==0){
 			/* Smells enough like HTTP to try parsing */
-			/* Set up callbacks */
-			http_parser_settings scan_http_parser_settings;
-			scan_http_parser_settings.on_message_begin		= scan_http_cb_on_message_begin;
-			scan_http_parser_settings.on_url				= scan_http_cb_on_url;
-			scan_http_parser_settings.on_header_field		= scan_http_cb_on_header_field;
-			scan_http_parser_settings.on_header_value		= scan_http_cb_on_header_value;
-			scan_http_parser_settings.on_headers_complete	= scan_http_cb_on_headers_complete;
-			scan_http_parser_settings.on_body				= scan_http_cb_on_body;
-			scan_http_parser_settings.on_message_complete	= scan_http_cb_on_message_complete;
-			
 			/* Set up a struct for our callbacks */
-			scan_http_data_t data(sp.sbuf.pos0.path, &sp.sbuf, tcpdemux::getInstance());
+			/* A post_queue worker opens the body files itself */
+			scan_http_data_t data(sp.sbuf.pos0.path, post_queue::on_worker() ? NULL : tcpdemux::getInstance(), NULL);
+			
+			/* Set up the parser itself */
+			http_parser parser;
+			http_parser_init(&parser, HTTP_RESPONSE);
+			parser.data = &data;
+			bool fresh = true;
 			
-			/* Process the whole stream in a loop, since there could be multiple requests */
-			size_t offset = 0;
-			while (1) {
-				/* Set up the parser itself */
-				http_parser parser;
-				http_parser_init(&parser, HTTP_RESPONSE);
-				parser.data = &data;
-				
-				/* Make an sbuf for the remaining data */
-				sbuf_t sub_buf(sp.sbuf, offset);
-				
-				/* Parse */
-				size_t parsed = http_parser_execute(&parser, &scan_http_parser_settings, reinterpret_cast<const char*>(sub_buf.buf), sub_buf.size());
-				assert(parsed <= sub_buf.size());
-				
-				/* Indicate EOF (flushing callbacks) and terminate if we parsed the entire buffer */
-				if (parsed == sub_buf.size()) {
-					http_parser_execute(&parser, &scan_http_parser_settings, NULL, 0);
-					break;
-				}
-				
-				/* Stop parsing if we parsed nothing */
-				if (parsed == 0) {
-					break;
-				}
-				
-				/* Stop parsing if we're a connection upgrade (e.g. WebSockets) */
-				if (parser.upgrade) {
-					DEBUG(9) ("upgrade connection detected (WebSockets?); cowardly refusing to dump further");
-					break;
-				}
-				
-				/* Bump the offset for next iteration */
-				offset += parsed;
+			/* Process the whole stream; indicate EOF (flushing callbacks) if we parsed all of it */
+			if (scan_http_parse(parser, fresh, reinterpret_cast<const char*>(sp.sbuf.buf), sp.sbuf.size())) {
+				http_parser_execute(&parser, &scan_http_parser_settings, NULL, 0);
 			}
 		}
 	}
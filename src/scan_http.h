@@ -0,0 +1,50 @@
+#ifndef SCAN_HTTP_H
+#define SCAN_HTTP_H
+
+/**
+ * scan_http.h
+ *
+ * The HTTP responses of one flow, parsed as the flow is stored.
+ *
+ * scan_http parses a whole flow file once the flow is closed.  With
+ * -AH and the http scanner enabled, each tcpip instead feeds the bytes
+ * of its flow to a scan_http_stream as they are written, in order from
+ * the start of the flow, and response bodies are written as they
+ * arrive.  If the flow's bytes stop arriving in order, the stream is
+ * abandon()ed: the bodies it wrote are taken back, and scan_http reads
+ * the file when the flow is closed, as before.
+ */
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "http-parser/http_parser.h"
+
+class scan_http_stream {
+public:
+    /* owner is the flow being parsed; it is not closed to make room
+     * for the body files (see tcpdemux::retrying_open()).
+     */
+    scan_http_stream(const std::string &flow_pathname,const class tcpip *owner);
+    ~scan_http_stream();		// close_body()
+
+    void update(const u_char *data,size_t length); // the next bytes of the flow
+    void finish();			// all of them have been seen: end the last response
+    void abandon();			// they were not all seen in order: undo the bodies written
+    void close_body();			// give back the open body's descriptor; reopened as needed
+
+private:
+    struct scan_http_data_t *data;	// the callbacks' state (scan_http.cpp)
+    http_parser	parser;
+    bool	fresh;			// parser has not been given anything since http_parser_init()
+    std::string	head;			// the first 7 bytes of the flow, to see if it is HTTP
+    bool	parsing;		// false once it is not, or the parser has given up
+
+    void	parse(const char *buf,size_t length);
+
+    /* not implemented */
+    scan_http_stream(const scan_http_stream &);
+    scan_http_stream &operator=(const scan_http_stream &);
+};
+
+#endif
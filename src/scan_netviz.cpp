@@ -3,7 +3,9 @@
  */
 
 #include "config.h"
+#include "tcpflow.h"
 #include <iostream>
+#include <fstream>
 #include <sys/types.h>
 #include "bulk_extractor_i.h"
 #include "time_histogram.h"
@@ -11,64 +13,89 @@
 // previously the namespace time_plugin 
 
 
-/* This should become a class that runs all of the time histograms and then selects the correct one for plotting */
+// every packet is counted once into a base histogram, which is rolled up
+// into the histogram that is rendered.  Packets come from the capture
+// thread or, with several input files, from a reader thread for each
+// (tcpdemux_merge.cpp), so each thread counts into a histogram of its own
+// and they are merged at shutdown.
+static vector<base_histogram *> histograms;
+static time_histogram::histogram_config_t config;
+#ifdef HAVE_PTHREAD
+static pthread_key_t histogram_key;
+static pthread_mutex_t histograms_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-const int num_histograms = 6;
+static const char *titles[] = {
+    "TCP Packets Received", "TCP Bytes Received", "TCP Connections Opened",
+    "TCP Connections Active"
+};
 
-// this vector must hold histograms in order from greatest time resolution
-// to least
-static vector<time_histogram> histograms;
-
-/* select_for_render renders the actual one we want */
-
-time_histogram *select_for_render()
+void th_startup()
 {
-    // assume the lowest resolution histogram is best
-    time_histogram *best = &histograms.back();
-    
-    // use the highest resolution histogram with no overflowed packets, or
-    // use the lowest resolution histogram if all have overflow, since it
-    // should almost certainly have the least since it's span is the largest
-    // Histograms must be in descending order of resolution
-    for(vector<time_histogram>::iterator candidate = histograms.begin();
-	candidate != histograms.end(); candidate++) {
-	uint64_t dropped = candidate->underflow_count +
-	    candidate->overflow_count;
-	
-	if(dropped == 0) {
-	    // this seems bad, but I don't think there's a better way.
-	    best = &(*candidate);
-	    break;
-	}
-    }
-    
-    return best;
+    const tcpdemux::options &opt = tcpdemux::getInstance()->opt;
+    config = time_histogram::default_histogram_config;
+    config.metric = (time_histogram::metric_t) opt.netviz_metric;
+    config.graph.title = titles[config.metric];
+    config.graph.filename = "time_histogram.pdf";
+#ifdef HAVE_PTHREAD
+    if(pthread_key_create(&histogram_key,0)) die("pthread_key_create: %s",strerror(errno));
+#endif
 }
 
-void th_startup()
+// the histogram of this thread
+static base_histogram *thread_histogram()
 {
-    time_histogram::histogram_config_t config = time_histogram::default_histogram_config;
-    config.graph.title = "TCP Packets Received";
-    config.graph.filename = "time_histogram.pdf";
-    
-    // create and insert histograms in descending time resolution order
-    for(int ii = 0; ii < num_histograms; ii++) {
-	histograms.push_back(time_histogram((span_t)ii, config));
+#ifdef HAVE_PTHREAD
+    base_histogram *h = reinterpret_cast<base_histogram *>(pthread_getspecific(histogram_key));
+    if(h == 0) {
+	h = new base_histogram(config.bucket_count);
+	pthread_setspecific(histogram_key,h);
+	pthread_mutex_lock(&histograms_lock);
+	histograms.push_back(h);
+	pthread_mutex_unlock(&histograms_lock);
+    }
+    return h;
+#else
+    if(histograms.empty()) {
+	histograms.push_back(new base_histogram(config.bucket_count));
     }
+    return histograms[0];
+#endif
 }
 
+// the packet's headers were decoded by the datalink handler
 void histogram_process_packet(void *user,const packet_info &pi)
 {
-    for(vector<time_histogram>::iterator histogram = histograms.begin();
-	histogram != histograms.end(); histogram++) {
-	(*histogram).ingest_packet(pi);
-    }
+    thread_histogram()->ingest_packet(decoded_packet::of(pi));
 }
 
 void th_shutdown(const class scanner_params &sp)
 {
-    time_histogram *to_render = select_for_render();
-    to_render->render(sp.fs.outdir);
+    base_histogram all(config.bucket_count);
+    for(vector<base_histogram *>::iterator it = histograms.begin();
+	it != histograms.end(); it++) {
+	all.merge(**it);
+	delete *it;
+    }
+    histograms.clear();
+
+    time_histogram to_render(MINUTE, config); // rollup() sets its bucket width
+    all.rollup(to_render);
+    to_render.render(sp.fs.outdir);
+
+    const std::string &dump = tcpdemux::getInstance()->opt.netviz_dump;
+    if(dump.size()) {
+	std::string fname = sp.fs.outdir + "/time_histogram." + dump;
+	std::ofstream os(fname.c_str());
+	if(dump == "json") {
+	    to_render.write_json(os);
+	} else {
+	    to_render.write_csv(os);
+	}
+	if(!os.good()) {
+	    std::cerr << "netviz: cannot write " << fname << "\n";
+	}
+    }
 }
 
 
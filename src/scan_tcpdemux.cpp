@@ -20,7 +20,7 @@
 
 static void packet_handler(void *user,const packet_info &pi)
 {
-    reinterpret_cast<tcpdemux *>(user)->process_ip(pi.ts,pi.data,pi.caplen,pi.vlan);
+    reinterpret_cast<tcpdemux *>(user)->process_packet(decoded_packet::of(pi));
 }
 
 extern "C"
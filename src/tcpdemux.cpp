@@ -12,6 +12,9 @@
  */
 
 #include "tcpflow.h"
+#include "iouring.h"
+#include "bundle.h"
+#include "post_queue.h"
 
 #include <iostream>
 #include <sstream>
@@ -20,9 +23,12 @@
 
 
 tcpdemux::tcpdemux():outdir("."),flow_counter(0),packet_counter(0),
-		     xreport(0),max_fds(10),flow_map(),start_new_connections(false),
-		     openflows(),
-		     opt(),fs()
+		     xreport(0),max_fds(10),flow_map(),flow_map_peak(),flow_timers(),flows_expired(0),
+		     flow_lru(),flow_memory(0),flows_evicted(0),
+		     start_new_connections(false),
+		     openflows(),fd_evictions(0),fd_reopens(0),fd_reopen_usec(0),http_body_fds(0),known_dirs(),dirs_created(0),
+		     digests_streamed(0),digests_reread(0),http_streamed(0),http_reread(0),uring(0),bundle(0),post(0),console(0),
+		     shards(),shard_threads(),shard_tick(0),opt(),fs()
 		     
 {
     /* Find out how many files we can have open safely...subtract 4 for
@@ -36,6 +42,8 @@ tcpdemux::tcpdemux():outdir("."),flow_counter(0),packet_counter(0),
 tcpdemux *tcpdemux::getInstance()
 {
     static tcpdemux * theInstance = 0;
+    tcpdemux *shard = current_shard();
+    if(shard) return shard;
     if(theInstance==0) theInstance = new tcpdemux();
     return theInstance;
 }
@@ -46,13 +54,29 @@ tcpdemux *tcpdemux::getInstance()
 /**
  * Implement a list of openflows, each with an associated file descriptor.
  * When a new file needs to be opened, we can close a flow if necessary.
+ * The list is kept in the order the files were written, so the file to
+ * close is always at the back.
  */
 void tcpdemux::close_all()
 {
-    for(tcpset::iterator it = openflows.begin();it!=openflows.end();it++){
-	(*it)->close_file();
+    while(!openflows.empty()){
+	close_tcpip(openflows.back());
+    }
+    if(uring) uring->drain();		// the last writes and closes
+    for(std::vector<tcpdemux *>::iterator it=shards.begin();it!=shards.end();it++){
+	(*it)->close_all();
     }
-    openflows.clear();
+}
+
+
+void tcpdemux::close_bundles()
+{
+    std::vector<flow_bundle *> bundles;
+    if(bundle) bundles.push_back(bundle);
+    for(std::vector<tcpdemux *>::iterator it=shards.begin();it!=shards.end();it++){
+	if((*it)->bundle) bundles.push_back((*it)->bundle);
+    }
+    flow_bundle::write_index(outdir,bundles);
 }
 
 
@@ -63,25 +87,27 @@ void tcpdemux::close_tcpip(tcpip *i)
 }
 
 /**
- * find the flow that has been written to in the furthest past and close it.
+ * find the flow that has been written to in the furthest past and close it,
+ * unless it is keep.  Returns false if nothing was closed.
  */
-void tcpdemux::close_oldest()
+bool tcpdemux::close_oldest(const tcpip *keep)
 {
-    tcpip *oldest_tcp=0;
-    for(tcpset::iterator it = openflows.begin();it!=openflows.end();it++){
-	if(oldest_tcp==0 || (*it)->last_packet_number < oldest_tcp->last_packet_number){
-	    oldest_tcp = (*it);
-	}
-    }
-    if(oldest_tcp) close_tcpip(oldest_tcp);
+    if(openflows.empty() || openflows.back()==keep) return false;
+    fd_evictions++;
+    close_tcpip(openflows.back());
+    return true;
 }
 
 /* Open a file, closing one of the existing flows f necessary.
+ * keep is a flow that is being written, and must stay open.
+ * The flows' HTTP body files count against max_fds too; closing a
+ * flow closes its body.
  */
-int tcpdemux::retrying_open(const std::string &filename,int oflag,int mask)
+int tcpdemux::retrying_open(const std::string &filename,int oflag,int mask,const tcpip *keep)
 {
+    if(uring) uring->reap(false);	// finish closes that were waiting for writes
     while(true){
-	if(openflows.size() >= max_fds) close_oldest();
+	if(openflows.size() + http_body_fds >= max_fds) close_oldest(keep);
 	int fd = ::open(filename.c_str(),oflag,mask);
 	DEBUG(2)("::open(%s,%d,%d)=%d",filename.c_str(),oflag,mask,fd);
 	if(fd>=0) return fd;
@@ -90,16 +116,39 @@ int tcpdemux::retrying_open(const std::string &filename,int oflag,int mask)
 	    DEBUG(2)("retrying_open ::open failed with errno=%d (%s)",errno,strerror(errno));
 	    return -1;		// wonder what it was
 	}
+	if(uring && uring->outstanding){	// files are still waiting to be closed
+	    uring->reap(true);
+	    continue;
+	}
 	DEBUG(5) ("too many open files -- contracting FD ring to %d", max_fds);
-	close_oldest();
+	if(!close_oldest(keep)) return -1;
     }
 }
 
+/* Create dir and the directories above it that are missing.  A
+ * directory is remembered once it exists, so the common case, a new
+ * file in a directory already used, costs a lookup here and no system
+ * call.  mkdir() is tried first and its parent only made if that fails;
+ * EEXIST is fine, since shards share the directories.
+ */
+void tcpdemux::make_dirs(const std::string &dir)
+{
+    if(dir.size()==0 || known_dirs.find(dir)!=known_dirs.end()) return;
+    int r = MKDIR(dir.c_str(),0777);
+    if(r && errno==ENOENT){
+	size_t slash = dir.rfind('/');
+	if(slash!=std::string::npos && slash>0) make_dirs(dir.substr(0,slash));
+	r = MKDIR(dir.c_str(),0777);
+    }
+    if(r==0) dirs_created++;
+    if(r==0 || errno==EEXIST) known_dirs.insert(dir); // otherwise the open will say why
+}
+
 /* Find previously a previously created flow state in the database.
  */
 tcpip *tcpdemux::find_tcpip(const flow_addr &flow)
 {
-    flow_map_t::const_iterator it = flow_map.find(flow);
+    flow_map_t::const_iterator it = flow_map.find(flow_key(flow));
     if (it==flow_map.end()){
 	return NULL; // flow not found
     }
@@ -124,16 +173,25 @@ tcpip *tcpdemux::create_tcpip(const flow_addr &flowa, int32_t vlan,tcp_seq isn,
     flow flow(flowa,vlan,ts,ts,flow_counter++,connection_count);
 
     tcpip *new_tcpip = new tcpip(*this,flow,isn);
+    evict_flows(new_tcpip->memory_used());
+    flow_lru.push_front(new_tcpip);
+    flow_memory += new_tcpip->memory_used();
     new_tcpip->last_packet_number = packet_counter++;
     new_tcpip->nsn   = isn+1;		// expected
     DEBUG(5) ("%s: new flow. nsn:%d", new_tcpip->flow_pathname.c_str(),new_tcpip->nsn);
-    flow_map[flow] = new_tcpip;
+    if(opt.opt_hash_report && flow_map.full() && flow_map.size() > flow_map_peak.size){
+	flow_map.get_stats(flow_map_peak); // snapshot before the table grows
+    }
+    flow_map.insert(flow_key(flow),new_tcpip);
+    if(opt.idle_timeout){
+	flow_timers.schedule(&new_tcpip->idle_timer,ts.tv_sec + opt.idle_timeout);
+    }
     return new_tcpip;
 }
 
 void tcpdemux::remove_flow(const flow_addr &flow)
 {
-    flow_map_t::iterator it = flow_map.find(flow);
+    flow_map_t::iterator it = flow_map.find(flow_key(flow));
     if(it!=flow_map.end()){
 	close_tcpip(it->second);
 	delete it->second;
@@ -141,12 +199,216 @@ void tcpdemux::remove_flow(const flow_addr &flow)
     }
 }
 
+/**
+ * Run the flow timers up to packet time ts.
+ * The idle timer is not moved on every packet; when it fires we look
+ * at when the flow last saw a packet, and either close the flow or set
+ * the timer again for the new deadline. Flows closed this way go through
+ * remove_flow(), so they are written to the DFXML file like any other.
+ */
+void tcpdemux::expire_flows(const struct timeval &ts)
+{
+    std::vector<flow_timers_t::node *> expired;
+    flow_timers.advance(ts.tv_sec,expired);
+    for(std::vector<flow_timers_t::node *>::const_iterator it=expired.begin();it!=expired.end();it++){
+	tcpip *tcp = (*it)->owner;
+	if(!tcp->closing){
+	    uint64_t deadline = tcp->myflow.tlast.tv_sec + opt.idle_timeout;
+	    if(deadline > (uint64_t)ts.tv_sec){
+		flow_timers.schedule(*it,deadline);
+		continue;
+	    }
+	    DEBUG(5)("%s: idle for %d seconds; closing",tcp->flow_pathname.c_str(),(int)opt.idle_timeout);
+	}
+	flows_expired++;
+	remove_flow(flow_addr(tcp->myflow));
+    }
+}
+
+/**
+ * Called when a flow sees FIN or RST. With no close_linger the flow is
+ * removed now; otherwise it is kept for close_linger seconds to pick up
+ * retransmissions and reordered segments, and then removed.
+ */
+void tcpdemux::close_flow(tcpip *tcp,const struct timeval &ts)
+{
+    if(opt.close_linger==0){
+	remove_flow(flow_addr(tcp->myflow));
+	return;
+    }
+    if(tcp->closing) return;		// already lingering
+    tcp->closing = true;
+    flow_timers.schedule(&tcp->idle_timer,ts.tv_sec + opt.close_linger);
+}
+
+/* Close least recently active flows until one more flow of bytes_needed
+ * bytes fits within max_flows and max_flow_memory. flow_lru is kept in
+ * order of the flows' last packet, so each one is found in O(1).
+ */
+void tcpdemux::evict_flows(size_t bytes_needed)
+{
+    while(!flow_lru.empty()){
+	tcpip *oldest = flow_lru.back();
+	bool over_flows  = opt.max_flows && flow_map.size() >= opt.max_flows;
+	bool over_memory = opt.max_flow_memory && flow_memory + bytes_needed > opt.max_flow_memory;
+	if(!over_flows && !over_memory) return;
+	DEBUG(5)("%s: evicting least recently active flow",oldest->flow_pathname.c_str());
+	flows_evicted++;
+	remove_flow(flow_addr(oldest->myflow));
+    }
+}
+
+/* Close least recently active flows, other than keep, until the flows
+ * are back within max_flow_memory.  A flow's buffers, prefix, stored
+ * ranges and bundle chunks grow after it is created, so this is done
+ * after each packet is stored as well as when a flow is made.
+ */
+void tcpdemux::trim_flow_memory(const tcpip *keep)
+{
+    if(opt.max_flow_memory==0) return;
+    while(flow_memory > opt.max_flow_memory && !flow_lru.empty() && flow_lru.back()!=keep){
+	tcpip *oldest = flow_lru.back();
+	DEBUG(5)("%s: evicting least recently active flow",oldest->flow_pathname.c_str());
+	flows_evicted++;
+	remove_flow(flow_addr(oldest->myflow));
+    }
+}
+
 void tcpdemux::flow_map_clear()
 {
     for(flow_map_t::iterator it=flow_map.begin();it!=flow_map.end();it++){
 	delete it->second;
     }
     flow_map.clear();
+    for(std::vector<tcpdemux *>::iterator it=shards.begin();it!=shards.end();it++){
+	(*it)->flow_map_clear();
+    }
+}
+
+/**
+ * Report how well the flow hash spreads the flows in flow_map.
+ * The table is sampled just before each time it grew, and now;
+ * whichever sample held the most flows is reported. With shards,
+ * the samples of all of the shards' tables are added together.
+ */
+void tcpdemux::flow_table_stats(flow_map_t::stats_t &st)
+{
+    flow_map.get_stats(st);
+    if(flow_map_peak.size > st.size) st = flow_map_peak;
+    for(std::vector<tcpdemux *>::iterator it=shards.begin();it!=shards.end();it++){
+	flow_map_t::stats_t sst;
+	(*it)->flow_table_stats(sst);
+	st.add(sst);
+    }
+}
+
+void tcpdemux::flow_table_report()
+{
+    flow_map_t::stats_t st;
+    flow_table_stats(st);
+
+    DEBUG(1)("flow table: %d flows in %d slots; %d full-hash collisions; %d false tag matches",
+	     (int)st.size,(int)st.capacity,(int)st.hash_collisions,(int)st.tag_false_matches);
+    if(xreport==0) return;
+
+    std::stringstream attrs;
+    attrs << "flows='" << st.size << "' capacity='" << st.capacity << "' "
+	  << "tombstones='" << st.tombstones << "' "
+	  << "hash_collisions='" << st.hash_collisions << "' "
+	  << "tag_false_matches='" << st.tag_false_matches << "'";
+    xreport->push("flow_table",attrs.str());
+    for(size_t i=0;i<st.probe_length.size();i++){
+	std::stringstream a,v;
+	a << "groups='" << i+1 << "'";
+	v << st.probe_length[i];
+	xreport->xmlout("probe_length",v.str(),a.str(),false);
+    }
+    for(size_t i=0;i<st.group_fill.size();i++){
+	if(st.group_fill[i]==0) continue;
+	std::stringstream a,v;
+	a << "keys='" << i << "'";
+	v << st.group_fill[i];
+	xreport->xmlout("group_fill",v.str(),a.str(),false);
+    }
+    xreport->pop();
+}
+
+void tcpdemux::stats_report()
+{
+    if(xreport==0) return;
+    xreport->push("tcpdemux");
+    xreport->xmlout("flows_expired",(int64_t)flows_expired);
+    xreport->xmlout("flows_evicted",(int64_t)flows_evicted);
+    xreport->xmlout("max_fds",(int64_t)max_fds);
+    xreport->xmlout("fd_evictions",(int64_t)fd_evictions);
+    xreport->xmlout("fd_reopens",(int64_t)fd_reopens);
+    xreport->xmlout("fd_reopen_usec",(int64_t)fd_reopen_usec);
+    if(flow::filename_template.find('/')!=std::string::npos){
+	uint64_t n = dirs_created;
+	for(std::vector<tcpdemux *>::const_iterator it=shards.begin();it!=shards.end();it++){
+	    n += (*it)->dirs_created;
+	}
+	xreport->xmlout("dirs_created",(int64_t)n);
+    }
+    if(opt.digests){
+	/* counted as flows are deleted, which the shards may still be doing */
+	uint64_t streamed = digests_streamed, reread = digests_reread;
+	for(std::vector<tcpdemux *>::const_iterator it=shards.begin();it!=shards.end();it++){
+	    streamed += (*it)->digests_streamed;
+	    reread   += (*it)->digests_reread;
+	}
+	xreport->xmlout("digests_streamed",(int64_t)streamed);
+	xreport->xmlout("digests_reread",(int64_t)reread);
+	xreport->xmlout("digests_sha_extensions",(int64_t)digest_set::sha_extensions());
+    }
+    if(opt.opt_after_header && opt.opt_scan_http){
+	uint64_t streamed = http_streamed, reread = http_reread;
+	for(std::vector<tcpdemux *>::const_iterator it=shards.begin();it!=shards.end();it++){
+	    streamed += (*it)->http_streamed;
+	    reread   += (*it)->http_reread;
+	}
+	xreport->xmlout("http_streamed",(int64_t)streamed);
+	xreport->xmlout("http_reread",(int64_t)reread);
+    }
+    if(opt.opt_io_uring){
+	/* each shard has a queue of its own */
+	iouring_queue::stats_t st;
+	if(uring) st += uring->stats;
+	for(std::vector<tcpdemux *>::const_iterator it=shards.begin();it!=shards.end();it++){
+	    if((*it)->uring) st += (*it)->uring->stats;
+	}
+	xreport->xmlout("io_uring_depth",(int64_t)opt.io_uring_depth);
+	xreport->xmlout("io_uring_depth_peak",(int64_t)st.depth_peak);
+	xreport->xmlout("io_uring_full_waits",(int64_t)st.wait_count);
+	xreport->xmlout("io_uring_writes",(int64_t)st.writes);
+	xreport->xmlout("io_uring_write_errors",(int64_t)st.errors);
+	xreport->xmlout("io_uring_bytes",(int64_t)st.bytes);
+	xreport->xmlout("io_uring_latency_usec_avg",(int64_t)(st.writes ? st.latency_usec/st.writes : 0));
+	xreport->xmlout("io_uring_latency_usec_max",(int64_t)st.latency_usec_max);
+    }
+    if(post){
+	xreport->xmlout("post_threads",(int64_t)opt.post_threads);
+	xreport->xmlout("post_queue_depth",(int64_t)post->depth);
+	xreport->xmlout("post_queue_depth_peak",(int64_t)post->stats.depth_peak);
+	xreport->xmlout("post_jobs",(int64_t)post->stats.jobs);
+	xreport->xmlout("post_queue_full",(int64_t)post->stats.full);
+	xreport->xmlout("post_latency_usec_avg",
+			(int64_t)(post->stats.jobs ? post->stats.latency_usec/post->stats.jobs : 0));
+	xreport->xmlout("post_latency_usec_max",(int64_t)post->stats.latency_usec_max);
+    }
+    if(opt.opt_bundle){
+	flow_bundle::stats_t st;
+	if(bundle) st += bundle->stats;
+	for(std::vector<tcpdemux *>::const_iterator it=shards.begin();it!=shards.end();it++){
+	    if((*it)->bundle) st += (*it)->bundle->stats;
+	}
+	xreport->xmlout("bundle_segments",(int64_t)st.segments);
+	xreport->xmlout("bundle_bytes",(int64_t)st.bytes);
+	xreport->xmlout("bundle_chunks",(int64_t)st.chunks);
+	xreport->xmlout("bundle_index_records",(int64_t)st.records);
+	xreport->xmlout("bundle_index_runs",(int64_t)st.runs);
+    }
+    xreport->pop();
 }
 
 int tcpdemux::open_tcpfile(tcpip *tcp)
@@ -154,12 +416,47 @@ int tcpdemux::open_tcpfile(tcpip *tcp)
     /* This shouldn't be called if the file is already open */
     assert(tcp->fd < 0);
 
+    if(opt.opt_bundle){
+	/* Nothing to open; the flow's writes are appended to the bundle.
+	 * max_fds still bounds the flows holding write-back buffers.
+	 */
+	if(bundle==0) bundle = new flow_bundle(outdir,opt.bundle_segment_size);
+	if(openflows.size() + http_body_fds >= max_fds) close_oldest();
+	tcp->fd = 0;			// not a descriptor; see tcpip::chunks
+	tcp->file_created = true;
+	openflows.push_front(tcp);
+	tcp->pos = tcp->stored.extent();	// where the file would end
+	tcp->nsn = tcp->isn + 1 + tcp->pos;
+	return 0;
+    }
+
+    if(opt.opt_io_uring && uring==0){
+	uring = new iouring_queue();
+	if(!uring->setup(opt.io_uring_depth)){
+	    delete uring;		// write synchronously
+	    uring = 0;
+	    opt.opt_io_uring = false;
+	}
+    }
+    if(uring && tcp->uring_fd>=0){
+	uring->wait_fd(tcp->uring_fd);	// the size of the file is needed below
+	tcp->uring_fd = -1;
+    }
+
     /* Now try and open the file */
     if(tcp->file_created) {
 	DEBUG(5) ("%s: re-opening output file", tcp->flow_pathname.c_str());
+	struct timeval t0,t1;
+	gettimeofday(&t0,0);
 	tcp->fd = retrying_open(tcp->flow_pathname,O_RDWR | O_BINARY | O_CREAT,0666);
+	gettimeofday(&t1,0);
+	fd_reopens++;
+	fd_reopen_usec += (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_usec - t0.tv_usec);
     } else {
 	DEBUG(5) ("%s: opening new output file", tcp->flow_pathname.c_str());
+	if(flow::filename_template.find('/')!=std::string::npos){ // the template makes subdirectories
+	    make_dirs(tcp->flow_pathname.substr(0,tcp->flow_pathname.rfind('/')));
+	}
 	tcp->fd = retrying_open(tcp->flow_pathname,O_RDWR | O_BINARY | O_CREAT,0666);
 	tcp->file_created = true;		// remember we made it
     }
@@ -173,7 +470,7 @@ int tcpdemux::open_tcpfile(tcpip *tcp)
 	return -1;
     }
 
-    openflows.insert(tcp);
+    openflows.push_front(tcp);
     tcp->pos = lseek(tcp->fd,(off_t)0,SEEK_END);	// seek to end
     tcp->nsn = tcp->isn + 1 + tcp->pos;			// byte 0 is seq=isn+1; note this will handle files > 4GiB
     return 0;
@@ -274,34 +571,22 @@ void tcpdemux::write_to_file(std::stringstream &xmlattr,
  * Called to processes a tcp packet
  */
 
-#pragma GCC diagnostic ignored "-Wcast-align"
-void tcpdemux::process_tcp(const struct timeval &ts,const u_char *data, uint32_t length,
-			const ipaddr &src, const ipaddr &dst,int32_t vlan,sa_family_t family)
+void tcpdemux::process_tcp(const decoded_packet &pi)
 {
-    if (length < sizeof(struct tcphdr)) {
-	DEBUG(6) ("received truncated TCP segment!");
-	return;
-    }
-
-    struct tcphdr *tcp_header = (struct tcphdr *) data;
-
-    /* calculate the total length of the TCP header including options */
-    u_int tcp_header_len = tcp_header->th_off * 4;
+    const struct timeval &ts = pi.ts;
 
     /* fill in the flow_addr structure with info that identifies this flow */
-    flow_addr this_flow(src,dst,ntohs(tcp_header->th_sport),ntohs(tcp_header->th_dport),family);
+    flow_addr this_flow(pi.src,pi.dst,pi.sport,pi.dport,pi.family);
 
-    tcp_seq seq  = ntohl(tcp_header->th_seq);
-    bool syn_set = IS_SET(tcp_header->th_flags, TH_SYN);
-    bool ack_set = IS_SET(tcp_header->th_flags, TH_ACK);
+    tcp_seq seq  = pi.seq;
+    bool syn_set = IS_SET(pi.tcp_flags, TH_SYN);
+    bool ack_set = IS_SET(pi.tcp_flags, TH_ACK);
 
     //std::cerr << "\n*** process_tcp seq=" << seq << " \n";
 
-    /* recalculate the beginning of data and its length, moving past the
-     * TCP header
-     */
-    data   += tcp_header_len;
-    length -= tcp_header_len;
+    /* the data past the TCP header */
+    const u_char *data = pi.payload;
+    uint32_t length    = pi.payload_len;
 
     /* see if we have state about this flow; if not, create it */
     uint64_t connection_count = 0;
@@ -337,11 +622,12 @@ void tcpdemux::process_tcp(const struct timeval &ts,const u_char *data, uint32_t
 	 * delta will be 0, because it's a new connection!
 	 */
 	tcp_seq isn = syn_set ? seq : seq-1;
-	tcp = create_tcpip(this_flow, vlan, isn, ts,connection_count);
+	tcp = create_tcpip(this_flow, pi.vlan, isn, ts,connection_count);
     }
 
     /* Now tcp is valid */
     tcp->myflow.tlast = ts;		// most recently seen packet
+    flow_lru.touch(tcp);
     tcp->myflow.packet_count++;
 
     /*
@@ -384,175 +670,92 @@ void tcpdemux::process_tcp(const struct timeval &ts,const u_char *data, uint32_t
 	} else {
 	    if (opt.opt_output_enabled){
 		tcp->store_packet(data, length, delta);
+		trim_flow_memory(tcp);	// storing it may have grown the flow
 	    }
 	}
     }
 
-    /* Finally, if there is a FIN, then kill this TCP connection*/
-    if (IS_SET(tcp_header->th_flags, TH_FIN)){
+    /* Finally, if there is a FIN, then kill this TCP connection.
+     * A RST is taken as the end of the connection only when flows are
+     * being expired (idle_timeout or close_linger); it ends both
+     * directions, so the reverse flow goes as well.
+     */
+    bool fin_set = IS_SET(pi.tcp_flags, TH_FIN);
+    bool rst_set = IS_SET(pi.tcp_flags, TH_RST) && (opt.idle_timeout || opt.close_linger);
+    if (fin_set || rst_set){
 	if(opt.opt_no_purge==false){
-	    DEBUG(50)("packet is FIN; closing connection");
-	    remove_flow(this_flow);	// take it out of the map
+	    DEBUG(50)("packet is %s; closing connection",rst_set ? "RST" : "FIN");
+	    if(rst_set){
+		tcpip *reverse = find_tcpip(flow_addr(pi.dst,pi.src,this_flow.dport,this_flow.sport,pi.family));
+		if(reverse && reverse!=tcp) close_flow(reverse,ts); // a self-connected packet is its own reverse
+	    }
+	    close_flow(tcp,ts);		// take it out of the map
 	}
     }
 }
-#pragma GCC diagnostic warning "-Wcast-align"
 
 
-/* This is called when we receive an IPv4 datagram.  We make sure that
- * it's valid and contains a TCP segment; if so, we pass it to
- * process_tcp() for further processing.
+/* This is called when we receive an IPv4 or IPv6 datagram, decoded by
+ * the datalink handler.  If it holds a TCP segment we pass it to
+ * process_tcp(); otherwise we say why it was thrown away.
  *
- * Note: we currently don't know how to handle IP fragments. */
-#pragma GCC diagnostic ignored "-Wcast-align"
-void tcpdemux::process_ip4(const struct timeval &ts,const u_char *data, uint32_t caplen,int32_t vlan)
+ * Note: we currently don't know how to handle IP fragments or IPv6
+ * extension headers.
+ */
+void tcpdemux::process_ip(const decoded_packet &pi)
 {
-    const struct ip *ip_header = (struct ip *) data;
-    u_int ip_header_len;
-    u_int ip_total_len;
-
-    /* make sure that the packet is at least as long as the min IP header */
-    if (caplen < sizeof(struct ip)) {
-	DEBUG(6) ("received truncated IP datagram!");
+    if (pi.status==decoded_packet::SHORT) {
+	if (pi.family==AF_INET6) {
+	    DEBUG(6) ("received truncated IPv6 datagram!");
+	} else {
+	    DEBUG(6) ("can't determine IP datagram version!");
+	}
 	return;
     }
-
-    DEBUG(100)("process_ip4. caplen=%d vlan=%d  ip_p=%d",(int)caplen,(int)vlan,(int)ip_header->ip_p);
+    if (pi.family==AF_INET) {
+	DEBUG(100)("process_ip4. caplen=%d vlan=%d  ip_p=%d",(int)pi.caplen,(int)pi.vlan,(int)pi.ip_proto);
+    }
 
     /* for now we're only looking for TCP; throw away everything else */
-    if (ip_header->ip_p != IPPROTO_TCP) {
-	DEBUG(50) ("got non-TCP frame -- IP proto %d", ip_header->ip_p);
+    if (pi.status==decoded_packet::NOT_TCP) {
+	DEBUG(50) ("got non-TCP frame -- IP proto %d", pi.ip_proto);
 	return;
     }
 
-    /* check and see if we got everything.  NOTE: we must use
-     * ip_total_len after this, because we may have captured bytes
-     * beyond the end of the packet (e.g. ethernet padding).
-     */
-    ip_total_len = ntohs(ip_header->ip_len);
-    if (caplen < ip_total_len) {
-	DEBUG(6) ("warning: captured only %ld bytes of %ld-byte IP datagram",
-		  (long) caplen, (long) ip_total_len);
+    /* the part of the datagram that was not captured is a gap in the flow */
+    if (pi.caplen < pi.ip_len) {
+	if (pi.family==AF_INET6) {
+	    DEBUG(6) ("warning: captured only %ld bytes of %ld-byte IPv6 payload",
+		      (long) (pi.caplen - pi.l4_off), (long) (pi.ip_len - pi.l4_off));
+	} else {
+	    DEBUG(6) ("warning: captured only %ld bytes of %ld-byte IP datagram",
+		      (long) pi.caplen, (long) pi.ip_len);
+	}
     }
 
-    /* XXX - throw away everything but fragment 0; this version doesn't
-     * know how to do fragment reassembly.
-     */
-    if (ntohs(ip_header->ip_off) & 0x1fff) {
+    switch (pi.status) {
+    case decoded_packet::FRAGMENT:
 	DEBUG(2) ("warning: throwing away IP fragment from X to X");
 	return;
-    }
-
-    /* figure out where the IP header ends */
-    ip_header_len = ip_header->ip_hl * 4;
-
-    /* make sure there's some data */
-    if (ip_header_len > ip_total_len) {
+    case decoded_packet::TRUNCATED_IP:
 	DEBUG(6) ("received truncated IP datagram!");
 	return;
-    }
-
-    /* do TCP processing, faking an ipv6 address  */
-    process_tcp(ts,data + ip_header_len, ip_total_len - ip_header_len,
-		ipaddr(ip_header->ip_src.s_addr),
-		ipaddr(ip_header->ip_dst.s_addr),
-		vlan,AF_INET);
-}
-#pragma GCC diagnostic warning "-Wcast-align"
-
-
-/* This is called when we receive an IPv6 datagram.
- *
- * Note: we don't support IPv6 extended headers
- */
-
-struct private_ip6_hdr {
-	union {
-		struct ip6_hdrctl {
-			uint32_t ip6_un1_flow;	/* 20 bits of flow-ID */
-			uint16_t ip6_un1_plen;	/* payload length */
-			uint8_t  ip6_un1_nxt;	/* next header */
-			uint8_t  ip6_un1_hlim;	/* hop limit */
-		} ip6_un1;
-		uint8_t ip6_un2_vfc;	/* 4 bits version, top 4 bits class */
-	} ip6_ctlun;
-	struct private_in6_addr ip6_src;	/* source address */
-	struct private_in6_addr ip6_dst;	/* destination address */
-} __attribute__((__packed__));
-
-/* These might be defined from an include file, so undef them to be sure */
-#undef ip6_vfc
-#undef ip6_flow
-#undef ip6_plen	
-#undef ip6_nxt	
-#undef ip6_hlim	
-#undef ip6_hops	
-
-#define ip6_vfc		ip6_ctlun.ip6_un2_vfc
-#define ip6_flow	ip6_ctlun.ip6_un1.ip6_un1_flow
-#define ip6_plen	ip6_ctlun.ip6_un1.ip6_un1_plen
-#define ip6_nxt		ip6_ctlun.ip6_un1.ip6_un1_nxt
-#define ip6_hlim	ip6_ctlun.ip6_un1.ip6_un1_hlim
-#define ip6_hops	ip6_ctlun.ip6_un1.ip6_un1_hlim
-
-void tcpdemux::process_ip6(const struct timeval &ts,const u_char *data, const uint32_t caplen, const int32_t vlan)
-{
-    const struct private_ip6_hdr *ip_header = (struct private_ip6_hdr *) data;
-    u_int16_t ip_payload_len;
-
-    /* make sure that the packet is at least as long as the IPv6 header */
-    if (caplen < sizeof(struct private_ip6_hdr)) {
-	DEBUG(6) ("received truncated IPv6 datagram!");
-	return;
-    }
-
-
-    /* for now we're only looking for TCP; throw away everything else */
-    if (ip_header->ip6_nxt != IPPROTO_TCP) {
-	DEBUG(50) ("got non-TCP frame -- IP proto %d", ip_header->ip6_nxt);
-	return;
-    }
-
-    ip_payload_len = ntohs(ip_header->ip6_plen);
-
-    /* make sure there's some data */
-    if (ip_payload_len == 0) {
-	DEBUG(6) ("received truncated IP datagram!");
+    case decoded_packet::TRUNCATED_TCP:
+	DEBUG(6) ("received truncated TCP segment!");
 	return;
+    default:
+	break;
     }
 
-    /* do TCP processing */
-
-    process_tcp(ts,
-		data + sizeof(struct private_ip6_hdr),
-		ip_payload_len,
-		ipaddr(ip_header->ip6_src.s6_addr),
-		ipaddr(ip_header->ip6_dst.s6_addr),
-		vlan,AF_INET6);
-}
-
+    /* packet time drives the idle and linger timers */
+    expire_flows(pi.ts);
 
-
-/* This is called when we receive an IPv4 or IPv6 datagram.
- * This function calls process_ip4 or process_ip6
- */
-
-#pragma GCC diagnostic ignored "-Wcast-align"
-void tcpdemux::process_ip(const struct timeval &ts,const u_char *data, uint32_t caplen,int32_t vlan)
-{
-    const struct ip *ip_header = (struct ip *) data;
-    if (caplen < sizeof(struct ip)) {
-	DEBUG(6) ("can't determine IP datagram version!");
+    if (pi.status==decoded_packet::TRUNCATED_TCP_OPTIONS) {
+	DEBUG(6) ("received truncated TCP header!");
 	return;
     }
-
-    if(ip_header->ip_v == 6) {
-	process_ip6(ts,data, caplen,vlan);
-    } else {
-	process_ip4(ts,data, caplen,vlan);
-    }
+    process_tcp(pi);
 }
-#pragma GCC diagnostic warning "-Wcast-align"
  
  
 /************
@@ -644,21 +847,85 @@ static void process_gzip(class tcpdemux &demux,
 
 /** 
  * After the flow is finished, put it in an SBUF and process it.
- * if we are doing post-processing.
+ * if we are doing post-processing.  digests are the ones that could
+ * not be computed as the flow was stored; scan runs the scanners.
  * This is called from tcpip::~tcpip() in tcpip.cpp.
  */
 void tcpdemux::post_process_capture_flow(std::stringstream &xmladd,
-					 const std::string &flow_pathname)
+					 const std::string &flow_pathname,
+					 unsigned int digests,bool scan)
 {
-    int fd2 = retrying_open(flow_pathname,O_RDONLY|O_BINARY,0);
+    /* a worker has descriptors of its own; see start_post() */
+    int fd2 = post_queue::on_worker() ? ::open(flow_pathname.c_str(),O_RDONLY|O_BINARY) :
+	retrying_open(flow_pathname,O_RDONLY|O_BINARY,0);
     if(fd2<0){
 	perror("open");
 	return;
     }
     sbuf_t *sbuf = sbuf_t::map_file(flow_pathname,pos0_t(flow_pathname),fd2);
     if(sbuf){
-	process_sbuf(scanner_params(scanner_params::scan,*sbuf,*fs,&xmladd));
+	if(digests){
+	    digest_set ds(digests);
+	    ds.update(sbuf->buf,sbuf->bufsize);
+	    std::string xml;
+	    ds.final(xml);
+	    xmladd << xml;
+	}
+	if(scan) process_sbuf(scanner_params(scanner_params::scan,*sbuf,*fs,&xmladd));
     }
     ::close(fd2);
 }
 
+
+/* Workers for closed flows (post_queue.h).  Call before start_shards(),
+ * which shares them and divides up what is left of max_fds.
+ */
+void tcpdemux::start_post()
+{
+    if(opt.post_threads==0 || post) return;
+    if(!post_queue::available()){
+	DEBUG(1)("warning: this tcpflow was built without threads; ignoring post_threads=%d",(int)opt.post_threads);
+	return;
+    }
+    unsigned int worker_fds = 2 * opt.post_threads; // the flow file and an HTTP body each
+    max_fds = max_fds > worker_fds + 2 ? max_fds - worker_fds : 2;
+    post = new post_queue(*this,opt.post_threads,opt.post_queue_depth);
+}
+
+void tcpdemux::stop_post()
+{
+    if(post) post->stop();
+}
+
+void tcpdemux::post_flow(post_job *job)
+{
+    if(post && (job->digests || job->scan) && post->submit(job)) return;
+    post_process(*job);
+    delete job;
+}
+
+void tcpdemux::post_process(post_job &job)
+{
+    static const std::string fileobject_str("fileobject");
+    static const std::string filesize_str("filesize");
+    static const std::string filename_str("filename");
+    static const std::string tcpflow_str("tcpflow");
+
+    std::stringstream xmladd;		// for this <fileobject>
+    xmladd << job.xmladd;
+    if(job.digests || job.scan){
+	/* open the file and read it back */
+	post_process_capture_flow(xmladd,job.flow_pathname,job.digests,job.scan);
+    }
+    if(xreport){
+	lock_xreport();
+	xreport->push(fileobject_str);
+	if(job.flow_pathname.size()) xreport->xmlout(filename_str,job.flow_pathname);
+	xreport->xmlout(filesize_str,job.filesize);
+	xreport->xmlout(tcpflow_str,"",job.attrs,false);
+	if(job.gapxml.size()) xreport->xmlout("",job.gapxml,"",false);
+	if(xmladd.tellp()>0) xreport->xmlout("",xmladd.str(),"",false);
+	xreport->pop();
+	unlock_xreport();
+    }
+}
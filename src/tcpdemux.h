@@ -10,16 +10,28 @@
  * - IP, TCP and UDP structures
  * - class ipaddr    - IP address (IPv4 and IPv6)
  * - class flow_addr - The flow address (source addr & port; dest addr & port; family)
+ * - class flow_key  - A compact copy of a flow_addr, used as the flow table key
  * - class flow      - All of the information for a flow that's being tracked
  * - class tcp_header_t - convenience class for working with TCP headers
+ * - class decoded_packet - A packet_info with its IP and TCP headers decoded
  * - class tcpip     - A one-sided TCP implementation
  * - class tcpdemux  - Processes individual packets, identifies flows,
  *                     and creates tcpip objects as required
  */
 
 #include "md5.h"
-#include <tr1/unordered_map>
-#include <tr1/unordered_set>
+#include "digest.h"
+#include "flow_table.h"
+#include "timer_wheel.h"
+#include "lru_list.h"
+#include "packet_ring.h"
+#include "range_set.h"
+#include "bundle.h"
+#include "console.h"
+#include <set>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #ifdef WIN32
 /* Defines not present in Microsoft Windows stack */
@@ -156,6 +168,65 @@ inline bool operator <(const struct timeval &a,const struct timeval &b) {
     return (a.tv_sec<b.tv_sec) || ((a.tv_sec==b.tv_sec) && (a.tv_sec<b.tv_sec));
 }
 
+/*
+ * flow_hash():
+ * Seeded hash of one direction of a connection's 5-tuple.
+ *
+ * Direction matters (A->B and B->A hash differently) and the ports
+ * and family are mixed in as a full word, so NAT'd flows that differ
+ * only in their ports still spread out.  IPv4 addresses live in the
+ * first 4 bytes of an ipaddr, so the v4 path skips the 12 zero bytes.
+ *
+ * With SSE4.2 the words are run through two CRC32C lanes in opposite
+ * order (CRC is affine in its initial value, so two seeds over the
+ * same sequence would give correlated lanes).  Otherwise a
+ * multiply-xorshift round is used per word.
+ */
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+inline uint64_t flow_hash_round(uint64_t h,uint64_t w)
+{
+    h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 29);
+}
+
+inline uint64_t flow_hash(const uint8_t src[16],const uint8_t dst[16],
+			  uint16_t sport,uint16_t dport,uint16_t family,uint64_t seed)
+{
+    uint64_t w[4];
+    int n = 4;
+    if(family==AF_INET){
+	uint32_t s4,d4;
+	memcpy(&s4,src,4);
+	memcpy(&d4,dst,4);
+	w[0] = (uint64_t)s4 | ((uint64_t)d4 << 32);
+	n = 1;
+    } else {
+	memcpy(w,src,16);
+	memcpy(w+2,dst,16);
+    }
+    uint64_t ports = (uint64_t)sport | ((uint64_t)dport << 16) | ((uint64_t)family << 32);
+#ifdef __SSE4_2__
+    uint64_t lo = (uint32_t)seed;
+    uint64_t hi = seed >> 32;
+    for(int i=0;i<n;i++) lo = _mm_crc32_u64(lo,w[i]);
+    lo = _mm_crc32_u64(lo,ports);
+    hi = _mm_crc32_u64(hi,ports);
+    for(int i=n-1;i>=0;i--) hi = _mm_crc32_u64(hi,w[i]);
+    uint64_t h = ((hi << 32) | lo) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 32);
+#else
+    uint64_t h = seed;
+    for(int i=0;i<n;i++) h = flow_hash_round(h,w[i]);
+    h = flow_hash_round(h,ports);
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;	// murmur3 finalizer
+    h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+#endif
+}
+
 /*
  * describes the TCP flow.
  * No timing information; this is used as a map index.
@@ -176,19 +247,11 @@ public:
     uint16_t    dport;		// Destination port number 
     sa_family_t family;		// AF_INET or AF_INET6 */
 
-#pragma GCC diagnostic ignored "-Wcast-align"
+    static uint64_t hash_seed;	// seed for flow_hash(); set at startup (flow.cpp)
+
     uint64_t hash() const {
-	if(family==AF_INET){
-	    uint32_t *s =  (uint32_t *)src.addr; uint64_t S0 = s[0];
-	    uint32_t *d =  (uint32_t *)dst.addr; uint64_t D0 = d[0];
-	    return (S0<<32 | D0) ^ (D0<<32 | S0) ^ (sport<<16 | dport);
-	} else {
-	    uint64_t *s =  (uint64_t *)src.addr; uint64_t S0 = s[0];uint64_t S8 = s[1];
-	    uint64_t *d =  (uint64_t *)dst.addr; uint64_t D0 = d[0];uint64_t D8 = d[1];
-	    return (S0<<32 ^ D0) ^ (D0<<32 ^ S0) ^ (S8 ^ D8) ^ (sport<<16 | dport);
-	}
+	return flow_hash(src.addr,dst.addr,sport,dport,family,hash_seed);
     }
-#pragma GCC diagnostic warning "-Wcast-align"
 
     inline bool operator ==(const flow_addr &b) const {
 	return this->src==b.src &&
@@ -218,6 +281,36 @@ inline std::ostream & operator <<(std::ostream &os,const flow_addr &f)  {
     return os;
 }
 
+/*
+ * flow_key is the flow_addr packed into 40 bytes with no vtable, so that
+ * it can be stored inline in the flow table and compared with memcmp().
+ * The padding is always zero.
+ */
+class flow_key {
+public:
+    flow_key():src(),dst(),sport(0),dport(0),family(0),pad(0){
+	memset(src,0,sizeof(src));
+	memset(dst,0,sizeof(dst));
+    }
+    flow_key(const flow_addr &f):src(),dst(),sport(f.sport),dport(f.dport),family(f.family),pad(0){
+	memcpy(src,f.src.addr,sizeof(src));
+	memcpy(dst,f.dst.addr,sizeof(dst));
+    }
+    uint8_t	src[16];
+    uint8_t	dst[16];
+    uint16_t	sport;
+    uint16_t	dport;
+    uint16_t	family;
+    uint16_t	pad;
+
+    inline bool operator ==(const flow_key &b) const { return memcmp(this,&b,sizeof(*this))==0; }
+
+    /* must agree with flow_addr::hash() */
+    uint64_t hash() const {
+	return flow_hash(src,dst,sport,dport,family,flow_addr::hash_seed);
+    }
+};
+
 
 /*
  * A flow is a flow_addr that has additional information regarding when it was seen
@@ -241,6 +334,12 @@ public:;
     uint64_t packet_count;			// packet count
     uint64_t connection_count;		// how many times have we seen a flow with the same quad?
     std::string filename();		// returns filename for a flow based on the temlate
+    void filename(std::string &out);	// appends it to out
+    /* Parse filename_template into the form filename() uses; false and
+     * a reason if it is invalid.  It must be called, once the template
+     * is set, before any flow is named.
+     */
+    static bool compile_template(std::string &error);
 };
 
 /*
@@ -268,6 +367,51 @@ public:
     bool th_fin()    {return tcp_header->th_flags & TH_FIN;}
     bool th_ack()    {return tcp_header->th_flags & TH_ACK;}
     bool th_syn()    {return tcp_header->th_flags & TH_SYN;}
+    bool th_rst()    {return tcp_header->th_flags & TH_RST;}
+};
+
+
+/*
+ * A packet with its IP and TCP headers decoded once, by the datalink
+ * handler that received it (decoded_packet.cpp).  Every packet_info
+ * that tcpflow hands to process_packet_info() is one of these, so the
+ * packet callbacks get the decoded headers back with of() instead of
+ * parsing the packet again.  data is the IP header.
+ *
+ * status says how far the packet got.  family, ip_proto, src and dst
+ * are set once there is an IP header, and ip_len for TCP over IP; the
+ * TCP fields once there is a TCP header (TRUNCATED_TCP_OPTIONS or TCP);
+ * payload only for TCP.
+ */
+class decoded_packet : public packet_info {
+public:
+    enum status_t {
+	TCP,				// a TCP segment
+	SHORT,				// too short for an IP header
+	NOT_TCP,			// IP, but not carrying TCP
+	FRAGMENT,			// an IPv4 fragment other than the first
+	TRUNCATED_IP,			// the IP header is longer than the datagram, or IPv6 has no payload
+	TRUNCATED_TCP,			// too short for a TCP header
+	TRUNCATED_TCP_OPTIONS		// too short for the TCP header's options
+    };
+
+    decoded_packet(const struct timeval &ts_,const u_char *data_,uint32_t caplen_,int32_t vlan_);
+    static const decoded_packet &of(const packet_info &pi) { return static_cast<const decoded_packet &>(pi); }
+
+    bool has_tcp_header() const { return status==TCP || status==TRUNCATED_TCP_OPTIONS; }
+    uint64_t connection_hash() const;	// the same for both directions; 0 without a TCP header
+
+    status_t	status;
+    sa_family_t	family;			// AF_INET or AF_INET6; 0 before there is an IP header
+    uint8_t	ip_proto;		// IPv4 protocol or IPv6 next header
+    uint32_t	ip_len;			// the datagram's length in its header, which may be more than was captured
+    ipaddr	src,dst;
+    uint32_t	l4_off;			// of the TCP header, from data
+    uint16_t	sport,dport;		// host order
+    tcp_seq	seq;
+    uint8_t	tcp_flags;
+    const u_char *payload;		// after the TCP header and its options
+    uint32_t	payload_len;		// captured bytes of it within the IP datagram
 };
 
 
@@ -301,7 +445,9 @@ private:
 			  bytes_processed(),omitted_bytes(),
 			  last_packet_number(),
 			  out_of_order_count(),
-			  violations(){
+			  violations(),idle_timer(this),closing(),flow_lru(),fd_lru(),
+			  wbuf(),wbuf_off(),wbuf_extents(),flushes(),prefix(),uring_fd(),
+			  stored(),overlap_bytes(),chunks(),digests(),http(),stream_pos(){
 	throw new not_impl();
     }
     tcpip &operator=(const tcpip &that) { throw new not_impl(); }
@@ -319,7 +465,8 @@ public:;
     tcp_seq	nsn;			// expected next sequence number for current fd file position
     uint32_t	syn_count;		// has a SYN been seen?
 
-    uint64_t	pos;			// current position+1 (next byte in stream to be written)
+    uint64_t	pos;			// current position+1 (next byte in stream to be written);
+					// counts prefix, so file offset is pos-prefix.size()
 
     /* Archiving information */
     std::string flow_pathname;		// path where flow is stored
@@ -333,10 +480,72 @@ public:;
     uint64_t	out_of_order_count;	// all packets were contigious
     uint64_t    violations;		// protocol violation count
 
+    /* Expiry */
+    timer_wheel<tcpip>::node idle_timer; // in demux.flow_timers while the flow may expire
+    bool	closing;		// FIN or RST seen; flow is lingering
+
+    /* demux's lists of flows and of open files, most recently used first */
+    lru_hook<tcpip> flow_lru;		// on demux.flow_lru
+    lru_hook<tcpip> fd_lru;		// on demux.openflows while fd>=0
+
+    /* Write-back buffer of demux.opt.write_buffer bytes for file offsets
+     * [wbuf_off,wbuf_off+write_buffer).  Segments that fall in this
+     * window, in order or not, are copied here and written out when the
+     * window is full, when a segment falls outside it, and when the file
+     * is closed.  Only allocated while the file is open.
+     */
+    u_char	*wbuf;
+    uint64_t	wbuf_off;		// file offset of wbuf[0]
+    std::vector<std::pair<uint32_t,uint32_t> > wbuf_extents; // [start,end) of wbuf holding data; sorted, disjoint
+    uint64_t	flushes;		// write()s of this flow's data to its file
+
+    /* Bytes that turned out to come before the start of the file: data
+     * seen before the assumed ISN of a flow whose SYN was missed.  They
+     * are kept here while the file is open and put in front of it by
+     * resolve_prefix() once no more can arrive or when the file is
+     * closed, so that the file is not moved on every such packet.
+     */
+    std::string	prefix;
+
+    int		uring_fd;		// last fd handed to demux.uring to close; wait for it before reading the file
+
+    /* Stream positions (file offsets, once the prefix is in place) that
+     * have been stored.  Bytes that arrive again are not written again,
+     * and the holes are reported in the DFXML file.
+     */
+    range_set	stored;
+    uint64_t	overlap_bytes;		// bytes that arrived after they were already stored
+
+    /* With opt.bundle the flow has no file of its own: its writes are
+     * appended to demux.bundle and remembered here, and fd only marks
+     * the flow as open.  They go to the index when the flow is deleted.
+     */
+    flow_bundle::chunks_t chunks;
+
+    /* With opt.digests and a DFXML file, the flow's digests are computed
+     * as its bytes go through write_data(), for as long as they reach
+     * it, or leave wbuf, in order from the start of the file; with
+     * opt.http_stream its HTTP responses are parsed the same way.
+     * stream_pos is how far they have got.  Bytes written anywhere
+     * else, or a prefix, drop them, and the file is read back for them
+     * when the flow is closed.
+     */
+    digest_set	*digests;		// 0 when not hashing
+    class scan_http_stream *http;	// 0 when not parsing
+    uint64_t	stream_pos;
+
     /* Methods */
+    size_t memory_used() const;		// bytes charged against opt.max_flow_memory
     void close_file();				// close fp
     void print_packet(const u_char *data, uint32_t length);
     void store_packet(const u_char *data, uint32_t length, int32_t delta);
+    void store_bytes(uint64_t at,const u_char *data,size_t length); // to prefix or write_data()
+    void write_data(uint64_t offset,const u_char *data,size_t length); // through wbuf
+    void flush_wbuf();			// write out and empty wbuf
+    void write_file(uint64_t offset,const u_char *data,size_t length);
+    void resolve_prefix();		// move the file up and write prefix in front of it
+    void stream_update(uint64_t offset,const u_char *data,size_t length); // or stream_drop()
+    void stream_drop();			// stop hashing and parsing as bytes are stored
 };
 
 inline std::ostream & operator <<(std::ostream &os,const tcpip &f) {
@@ -358,50 +567,75 @@ private:
 	}
     };
     tcpdemux(const tcpdemux &t) __attribute__((__noreturn__)) :outdir("."),flow_counter(),packet_counter(),xreport(),
-				max_fds(),flow_map(),start_new_connections(),openflows(),opt(),fs(){
+				max_fds(),flow_map(),flow_map_peak(),flow_timers(),flows_expired(),
+				flow_lru(),flow_memory(),flows_evicted(),
+				start_new_connections(),openflows(),fd_evictions(),fd_reopens(),
+				fd_reopen_usec(),http_body_fds(),known_dirs(),dirs_created(),digests_streamed(),digests_reread(),
+				http_streamed(),http_reread(),uring(),bundle(),post(),console(),
+				shards(),shard_threads(),shard_tick(),opt(),fs(){
 	throw new not_impl();
     }
     tcpdemux &operator=(const tcpdemux &that){
 	throw new not_impl();
     }
 
-    /* see http://mikecvet.wordpress.com/tag/hashing/ */
-    typedef struct {
-	long operator() (const flow_addr &k) const {return k.hash(); }
-    } flow_addr_hash;
-
-    typedef struct {
-	bool operator() (const flow_addr &x, const flow_addr &y) const { return x==y;}
-    } flow_addr_key_eq;
-
-    typedef std::tr1::unordered_set<class tcpip *> tcpset;
-    typedef std::tr1::unordered_map<flow_addr,tcpip *,flow_addr_hash,flow_addr_key_eq> flow_map_t; // should be unordered_map
+    typedef lru_list<tcpip,&tcpip::fd_lru> tcpset;
+    typedef flow_table<flow_key,tcpip *> flow_map_t; // open-addressing; see flow_table.h
+    typedef timer_wheel<tcpip> flow_timers_t;
     tcpdemux();
 public:
     /* The pure options class means we can add new options without having to modify the tcpdemux constructor. */
     class options {
     public:;
 	enum { MAX_SEEK=1024*1024*16 };
-	options():console_output(false),opt_output_enabled(true),opt_md5(false),
-		  opt_after_header(false),opt_gzip_decompress(true),
+	enum { DEFAULT_WRITE_BUFFER=32*1024 };
+	enum { DEFAULT_IO_URING_DEPTH=64 };
+	enum { DEFAULT_POST_QUEUE=64 };
+	options():console_output(false),opt_output_enabled(true),digests(0),
+		  opt_after_header(false),opt_scan_http(false),opt_http_stream(true),opt_gzip_decompress(true),
 		  max_bytes_per_flow(),
 		  max_desired_fds(),max_flows(0),suppress_header(0),
 		  strip_nonprint(),use_color(0),max_seek(MAX_SEEK),
-		  opt_no_purge(false) {
+		  opt_no_purge(false),opt_hash_report(false),
+		  idle_timeout(0),close_linger(0),max_flow_memory(0),shards(1),
+		  write_buffer(DEFAULT_WRITE_BUFFER),
+		  opt_io_uring(false),io_uring_depth(DEFAULT_IO_URING_DEPTH),
+		  opt_bundle(false),bundle_segment_size(flow_bundle::DEFAULT_SEGMENT_SIZE),
+		  post_threads(0),post_queue_depth(DEFAULT_POST_QUEUE),
+		  console_buffer(console_writer::DEFAULT_BUFFER),console_flush_msec(console_writer::DEFAULT_FLUSH_MSEC),
+		  netviz_metric(0),netviz_dump() {
 	}
 	bool	console_output;
 	bool	opt_output_enabled;	// do we output?
-	bool	opt_md5;		// do we calculate MD5 on DFXML output?
+	unsigned int digests;		// digest_set algorithms for each flow in the DFXML output (-FM, -S digests)
 	bool	opt_after_header;	// decode headers after tcp connection closes
+	bool	opt_scan_http;		// the http scanner is enabled
+	bool	opt_http_stream;	// with both, parse HTTP as flows are stored (scan_http.h)
 	bool	opt_gzip_decompress;
 	uint64_t max_bytes_per_flow;
 	uint32_t max_desired_fds;
-	uint32_t max_flows;
+	uint32_t max_flows;		// most flows to keep in memory; 0=no limit
 	bool	suppress_header;
 	bool	strip_nonprint;
 	bool	use_color;
 	int32_t max_seek;		// signed becuase we compare with abs()
 	bool	opt_no_purge;
+	bool	opt_hash_report;	// report the flow table's hash distribution
+	uint32_t idle_timeout;		// seconds without a packet before a flow is closed; 0=never
+	uint32_t close_linger;		// seconds a flow is kept after FIN or RST
+	uint64_t max_flow_memory;	// most bytes of flow state to keep in memory; 0=no limit
+	uint32_t shards;		// demux threads; 1=demux on the capture thread
+	uint32_t write_buffer;		// bytes of write-back buffer per open file; 0=write each segment
+	bool	opt_io_uring;		// write flow files through io_uring
+	uint32_t io_uring_depth;	// most writes outstanding in it
+	bool	opt_bundle;		// append flows to segment files with an index (bundle.h)
+	uint64_t bundle_segment_size;	// bytes per segment file
+	uint32_t post_threads;		// threads to finish closed flows on (post_queue.h); 0=the closing thread
+	uint32_t post_queue_depth;	// most closed flows waiting for them
+	uint32_t console_buffer;	// bytes of -c/-C output to collect before writing it; 0=write each segment
+	uint32_t console_flush_msec;	// longest any of it waits
+	uint32_t netviz_metric;		// what the netviz graph shows (time_histogram::metric_t)
+	std::string netviz_dump;	// "csv" or "json" to write its buckets as well; "" not to
     };
 
     std::string outdir;			/* output directory */
@@ -411,20 +645,77 @@ public:
     unsigned int max_fds;		// maximum number of file descriptors for this tcpdemux
 
     flow_map_t	flow_map;		// the database
+    flow_map_t::stats_t flow_map_peak;	// flow_map statistics at its largest (for opt_hash_report)
+    flow_timers_t flow_timers;		// idle and linger timers, in packet time
+    uint64_t	flows_expired;		// flows closed by flow_timers
+    lru_list<tcpip,&tcpip::flow_lru> flow_lru; // all flows by last packet; back() is evicted first
+    uint64_t	flow_memory;		// sum of memory_used() over all flows
+    uint64_t	flows_evicted;		// flows closed to honor max_flows or max_flow_memory
     bool	start_new_connections;	// true if we should start new connections
-    tcpset	openflows;		// the tcpip flows with open FPs 
+    tcpset	openflows;		// the tcpip flows with open FPs, most recently written first
+    uint64_t	fd_evictions;		// files closed to stay under max_fds
+    uint64_t	fd_reopens;		// files opened again after an eviction
+    uint64_t	fd_reopen_usec;		// time spent in those reopens
+    unsigned int http_body_fds;		// HTTP body files open (scan_http.cpp); they count against max_fds
+    std::set<std::string> known_dirs;	// subdirectories of outdir known to exist
+    uint64_t	dirs_created;		// of them, the ones we made
+    uint64_t	digests_streamed;	// flows whose digests were computed as they were stored
+    uint64_t	digests_reread;		// flows whose file had to be read back for them
+    uint64_t	http_streamed;		// flows whose HTTP was parsed as they were stored
+    uint64_t	http_reread;		// flows whose file was read back to parse it
+    class iouring_queue *uring;		// with opt_io_uring, once the first file is opened; else 0
+    class flow_bundle *bundle;		// with opt_bundle, once the first flow is opened; else 0
+    class post_queue *post;		// with opt.post_threads, shared by the shards; else 0
+    class console_writer *console;	// with opt.console_output, shared by the shards; else 0
+
+    /* With opt.shards>1 this demux only dispatches packets. Each shard
+     * is a tcpdemux of its own, with its own flows, files and counters,
+     * running on its own thread (tcpdemux_shard.cpp).
+     */
+    class shard;			// a shard's thread and packet ring
+    std::vector<tcpdemux *> shards;	// the shards' demuxes
+    std::vector<shard *> shard_threads;
+    time_t	shard_tick;		// last capture second sent to all the shards' timers
     options	opt;
     class feature_recorder_set *fs;
     
-    static tcpdemux *getInstance();
+    static tcpdemux *getInstance();	// the shard running on this thread, else the main demux
+    static tcpdemux *current_shard();
+    void  start_shards();		// start opt.shards threads
+    void  stop_shards();		// drain and join them; fold their counters into ours
+    void  process_packet(const decoded_packet &pi); // hand to a shard, or process_ip() here
+    static void lock_xreport();		// shards share the DFXML file
+    static void unlock_xreport();
+    void  start_post();			// start opt.post_threads workers for closed flows
+    void  stop_post();			// finish what they have; later flows are done at once
+    void  post_flow(class post_job *job); // hand a closed flow to the workers, or do it here
+    void  post_process(class post_job &job); // read its file back if need be, and write its <fileobject>
+    size_t open_file_count() const;	// over all shards
+    size_t flow_count() const;		// over all shards
+
+    /* Several input files can be read at once, each on its own thread,
+     * with their packets merged into this demux in timestamp order
+     * (tcpdemux_merge.cpp).  reader is called on the file's thread to
+     * decode the file; its packets come back through process_packet().
+     */
+    typedef void (*infile_reader_t)(const std::string &expression,const std::string &infile);
+    void  merge_infiles(const std::vector<std::string> &files,const std::string &expression,
+			infile_reader_t reader);
+    static packet_ring *current_input();	// the ring of the file being read on this thread, if any
     void write_to_file(std::stringstream &ss,
 		       const std::string &fname,const sbuf_t &sbuf);
     void  close_all();
+    void  close_bundles();		// index the remaining flows and write bundle.idx
     void  close_tcpip(tcpip *);
     int   open_tcpfile(tcpip *);			// opens this file; return -1 if failure, 0 if success
-    void  close_oldest();
+    bool  close_oldest(const tcpip *keep=0);
     void  remove_flow(const flow_addr &flow); // remove a flow from the database, closing open files if necessary
-    int   retrying_open(const std::string &filename,int oflag,int mask);
+    void  expire_flows(const struct timeval &ts); // close flows whose idle or linger timer has run out
+    void  close_flow(tcpip *tcp,const struct timeval &ts); // FIN or RST: remove now or after close_linger
+    void  evict_flows(size_t bytes_needed);	// make room for one more flow
+    void  trim_flow_memory(const tcpip *keep);	// back within max_flow_memory, keeping keep
+    int   retrying_open(const std::string &filename,int oflag,int mask,const tcpip *keep=0);
+    void  make_dirs(const std::string &dir);	// mkdir -p, once per directory
 
     /* the flow database */
     tcpip *create_tcpip(const flow_addr &flow, int32_t vlan,tcp_seq isn, const timeval &ts,uint64_t connection_count);
@@ -439,13 +730,14 @@ public:
 	sa_family_t family;
     };
 #endif
-    void  process_tcp(const struct timeval &ts,const u_char *data, uint32_t length,
-			    const ipaddr &src, const ipaddr &dst,int32_t vlan,sa_family_t family);
-    void  process_ip4(const struct timeval &ts,const u_char *data, uint32_t caplen,int32_t vlan);
-    void  process_ip6(const struct timeval &ts,const u_char *data, const uint32_t caplen, const int32_t vlan);
-    void  process_ip(const struct timeval &ts,const u_char *data, uint32_t caplen,int32_t vlan);
+    void  process_tcp(const decoded_packet &pi);
+    void  process_ip(const decoded_packet &pi);
     void  flow_map_clear();		// clears out the map
-    void  post_process_capture_flow(std::stringstream &byte_runs,const std::string &flow_pathname);
+    void  flow_table_stats(flow_map_t::stats_t &st); // of flow_map, or all the shards' flow_maps
+    void  flow_table_report();		// hash distribution of flow_map (opt_hash_report)
+    void  stats_report();		// flow and file eviction counters for the DFXML file
+    void  post_process_capture_flow(std::stringstream &byte_runs,const std::string &flow_pathname,
+				    unsigned int digests,bool scan); // read the file back for digests and/or the scanners
 };
 
 #endif
@@ -0,0 +1,146 @@
+/**
+ * tcpdemux_merge.cpp
+ *
+ * Reading several input files at once.
+ *
+ * With -S merge_inputs=1 every -r file gets a reader thread.  The
+ * thread reads and decodes its file the usual way (memory-mapped or
+ * through libpcap, with the filter expression), and process_packet()
+ * copies each packet into that file's ring instead of demultiplexing
+ * it.  The main thread keeps a heap of the rings ordered by the time of
+ * their next packet and always feeds the demux the earliest one, so
+ * the demux sees one capture in time order no matter how the packets
+ * were spread over the files.  Reading, filtering and decoding of the
+ * next packets overlaps with reassembly of the current ones.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+
+#include <queue>
+#include <vector>
+
+#ifdef HAVE_PTHREAD
+
+static const size_t INPUT_RING_BYTES = 2*1024*1024; // per input file
+
+static pthread_key_t input_key;		// the packet_ring a reader thread fills
+static bool          input_key_created = false;
+
+class merge_input {
+public:
+    merge_input(const std::string &fname_,const std::string &expression_,tcpdemux::infile_reader_t reader_):
+	fname(fname_),expression(expression_),reader(reader_),ring(INPUT_RING_BYTES),thread(){}
+    std::string	fname;
+    std::string	expression;
+    tcpdemux::infile_reader_t reader;
+    packet_ring	ring;
+    pthread_t	thread;
+
+    static void *run(void *arg);
+
+    /* Wait for the next packet; 0 once the file is finished. */
+    const packet_ring::packet *next() {
+	unsigned int spins = 0;
+	while(true){
+	    const packet_ring::packet *p = ring.front();
+	    if(p) return p;
+	    if(ring.closed()) return ring.front(); // it may have pushed one more before closing
+	    packet_ring::backoff(spins);
+	}
+    }
+private:
+    /* not implemented */
+    merge_input(const merge_input &);
+    merge_input &operator=(const merge_input &);
+};
+
+void *merge_input::run(void *arg)
+{
+    merge_input *in = reinterpret_cast<merge_input *>(arg);
+    pthread_setspecific(input_key,&in->ring);
+    (*in->reader)(in->expression,in->fname);
+    in->ring.close();
+    return 0;
+}
+
+packet_ring *tcpdemux::current_input()
+{
+    if(!input_key_created) return 0;
+    return reinterpret_cast<packet_ring *>(pthread_getspecific(input_key));
+}
+
+/* A heap entry: the time of an input's next packet. Ties go to the
+ * input given first, so that a merge always comes out the same.
+ */
+class merge_head {
+public:
+    merge_head(const struct timeval &ts_,size_t input_):ts(ts_),input(input_){}
+    struct timeval ts;
+    size_t	input;
+    bool operator<(const merge_head &b) const { // reversed: priority_queue pops the largest
+	if(ts.tv_sec  != b.ts.tv_sec)  return ts.tv_sec  > b.ts.tv_sec;
+	if(ts.tv_usec != b.ts.tv_usec) return ts.tv_usec > b.ts.tv_usec;
+	return input > b.input;
+    }
+};
+
+void tcpdemux::merge_infiles(const std::vector<std::string> &files,const std::string &expression,
+			     infile_reader_t reader)
+{
+    if(!input_key_created){
+	if(pthread_key_create(&input_key,0)) die("pthread_key_create: %s",strerror(errno));
+	input_key_created = true;
+    }
+    DEBUG(2)("reading %d files at once",(int)files.size());
+
+    /* Start the readers one at a time, each once the one before has
+     * delivered its first packet, so that opening the files and
+     * compiling the filter (not thread-safe in older libpcaps) never
+     * happen at the same time.
+     */
+    std::vector<merge_input *> inputs;
+    std::priority_queue<merge_head> heap;
+    for(size_t i=0;i<files.size();i++){
+	merge_input *in = new merge_input(files[i],expression,reader);
+	if(pthread_create(&in->thread,0,merge_input::run,in)) die("pthread_create: %s",strerror(errno));
+	inputs.push_back(in);
+	const packet_ring::packet *p = in->next();
+	if(p) heap.push(merge_head(p->ts,i));
+    }
+
+    while(!heap.empty() && !terminate_requested){
+	size_t i = heap.top().input;
+	merge_input *in = inputs[i];
+	heap.pop();
+	const packet_ring::packet *p = in->ring.front();
+	decoded_packet pi(p->ts,p->data(),p->caplen,p->vlan);
+	process_packet(pi);
+	in->ring.pop();
+	p = in->next();
+	if(p) heap.push(merge_head(p->ts,i));
+    }
+
+    for(size_t i=0;i<inputs.size();i++){
+	pthread_join(inputs[i]->thread,0);
+	delete inputs[i];
+    }
+}
+
+#else
+
+packet_ring *tcpdemux::current_input() { return 0; }
+
+/* Without threads the files are read one after the other. */
+void tcpdemux::merge_infiles(const std::vector<std::string> &files,const std::string &expression,
+			     infile_reader_t reader)
+{
+    DEBUG(1)("warning: this tcpflow was built without threads; reading the files one at a time");
+    for(size_t i=0;i<files.size();i++){
+	(*reader)(expression,files[i]);
+    }
+}
+
+#endif
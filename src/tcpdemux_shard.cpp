@@ -0,0 +1,221 @@
+/**
+ * tcpdemux_shard.cpp
+ *
+ * Multi-threaded demultiplexing.
+ *
+ * With -S shards=N the demux returned by getInstance() becomes a
+ * dispatcher.  It hashes each packet's connection, the same way for
+ * both directions, and copies the packet into the ring of one of N
+ * shards.  Each shard is a complete tcpdemux with its own flow table,
+ * timers, file descriptor budget and counters, and runs process_ip() on
+ * its own thread.  Because both flows of a connection go to the same
+ * shard, no flow state is ever shared between threads.
+ *
+ * The threads share the DFXML file (guarded by lock_xreport()) and the
+ * feature recorders (which do their own locking).  At shutdown
+ * stop_shards() drains the rings, joins the threads and adds the
+ * shards' counters to the dispatcher's, so the report covers all of
+ * them.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+
+#include <iostream>
+#include <vector>
+
+#ifdef HAVE_PTHREAD
+
+static const size_t SHARD_RING_BYTES = 8*1024*1024; // per shard
+
+static pthread_mutex_t xreport_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t   shard_key;	// the tcpdemux a shard thread is running
+static bool            shard_key_created = false;
+
+class tcpdemux::shard {
+public:
+    shard(tcpdemux *demux_):demux(demux_),ring(SHARD_RING_BYTES),thread(){}
+    tcpdemux	*demux;
+    packet_ring	ring;
+    pthread_t	thread;
+
+    static void *run(void *arg);
+private:
+    /* not implemented */
+    shard(const shard &);
+    shard &operator=(const shard &);
+};
+
+void *tcpdemux::shard::run(void *arg)
+{
+    shard *s = reinterpret_cast<shard *>(arg);
+    pthread_setspecific(shard_key,s->demux);
+    unsigned int spins = 0;
+    while(true){
+	const packet_ring::packet *p = s->ring.front();
+	if(p){
+	    if(p->tick){
+		s->demux->expire_flows(p->ts);
+	    } else {
+		s->demux->start_new_connections = p->start_new;
+		decoded_packet pi(p->ts,p->data(),p->caplen,p->vlan);
+		s->demux->process_ip(pi);
+	    }
+	    s->ring.pop();
+	    spins = 0;
+	    continue;
+	}
+	if(s->ring.closed() && s->ring.front()==0) break;
+	packet_ring::backoff(spins);
+    }
+    return 0;
+}
+
+tcpdemux *tcpdemux::current_shard()
+{
+    if(!shard_key_created) return 0;
+    return reinterpret_cast<tcpdemux *>(pthread_getspecific(shard_key));
+}
+
+void tcpdemux::lock_xreport()   { pthread_mutex_lock(&xreport_mutex); }
+void tcpdemux::unlock_xreport() { pthread_mutex_unlock(&xreport_mutex); }
+
+void tcpdemux::start_shards()
+{
+    if(opt.shards<=1 || shards.size()>0) return;
+    if(!shard_key_created){
+	if(pthread_key_create(&shard_key,0)) die("pthread_key_create: %s",strerror(errno));
+	shard_key_created = true;
+    }
+    unsigned int shard_fds = max_fds / opt.shards;
+    if(shard_fds < 2) shard_fds = 2;
+    DEBUG(2)("starting %d demux shards with %d file descriptors each",(int)opt.shards,(int)shard_fds);
+    for(uint32_t i=0;i<opt.shards;i++){
+	tcpdemux *d = new tcpdemux();
+	d->outdir   = outdir;
+	d->xreport  = xreport;
+	d->max_fds  = shard_fds;
+	d->opt      = opt;
+	d->opt.shards = 1;
+	d->fs       = fs;
+	d->post     = post;
+	d->console  = console;
+	shard *s = new shard(d);
+	if(pthread_create(&s->thread,0,shard::run,s)) die("pthread_create: %s",strerror(errno));
+	shards.push_back(d);
+	shard_threads.push_back(s);
+    }
+}
+
+void tcpdemux::stop_shards()
+{
+    for(std::vector<shard *>::iterator it=shard_threads.begin();it!=shard_threads.end();it++){
+	(*it)->ring.close();
+    }
+    for(std::vector<shard *>::iterator it=shard_threads.begin();it!=shard_threads.end();it++){
+	pthread_join((*it)->thread,0);
+	tcpdemux *d = (*it)->demux;
+	flow_counter   += d->flow_counter;
+	packet_counter += d->packet_counter;
+	flows_expired  += d->flows_expired;
+	flows_evicted  += d->flows_evicted;
+	fd_evictions   += d->fd_evictions;
+	fd_reopens     += d->fd_reopens;
+	fd_reopen_usec += d->fd_reopen_usec;
+	d->flow_counter = d->packet_counter = d->flows_expired = d->flows_evicted = 0;
+	d->fd_evictions = d->fd_reopens = d->fd_reopen_usec = 0;
+	delete *it;
+    }
+    shard_threads.clear();
+}
+
+/* Called on the capture thread for every packet, or on a reader thread
+ * of merge_infiles().
+ */
+void tcpdemux::process_packet(const decoded_packet &pi)
+{
+    if(packet_ring *in = current_input()){	// on a merge_infiles() reader thread
+	if(pi.caplen > in->max_packet()){
+	    DEBUG(1)("packet of %d bytes is too large for the input ring; dropped",(int)pi.caplen);
+	    return;
+	}
+	unsigned int spins = 0;
+	while(!in->push(pi.ts,pi.data,pi.caplen,pi.vlan,start_new_connections)){
+	    if(terminate_requested) return;	// the merge has stopped reading
+	    packet_ring::backoff(spins);
+	}
+	return;
+    }
+    if(shard_threads.empty()){
+	process_ip(pi);
+	return;
+    }
+
+    /* A shard's timers only move with the packets it is given, so once
+     * a second of capture time every shard is told the time; a shard
+     * with no traffic still expires its flows.
+     */
+    if((opt.idle_timeout || opt.close_linger) && pi.ts.tv_sec > shard_tick){
+	shard_tick = pi.ts.tv_sec;
+	for(std::vector<shard *>::iterator it=shard_threads.begin();it!=shard_threads.end();it++){
+	    unsigned int spins = 0;
+	    while(!(*it)->ring.push(pi.ts,0,0,0,false,true)){
+		packet_ring::backoff(spins);
+	    }
+	}
+    }
+
+    uint64_t h = pi.connection_hash();
+    shard *s = shard_threads[((h >> 32) * shard_threads.size()) >> 32];
+    if(pi.caplen > s->ring.max_packet()){
+	DEBUG(1)("packet of %d bytes is too large for the shard ring; dropped",(int)pi.caplen);
+	return;
+    }
+    unsigned int spins = 0;
+    while(!s->ring.push(pi.ts,pi.data,pi.caplen,pi.vlan,start_new_connections)){
+	packet_ring::backoff(spins);
+    }
+}
+
+#else
+
+/* Without threads there are no shards; everything runs on the capture thread. */
+tcpdemux *tcpdemux::current_shard() { return 0; }
+void tcpdemux::lock_xreport() {}
+void tcpdemux::unlock_xreport() {}
+
+void tcpdemux::start_shards()
+{
+    if(opt.shards>1){
+	DEBUG(1)("warning: this tcpflow was built without threads; ignoring shards=%d",(int)opt.shards);
+    }
+}
+
+void tcpdemux::stop_shards() {}
+
+void tcpdemux::process_packet(const decoded_packet &pi)
+{
+    process_ip(pi);
+}
+
+#endif
+
+size_t tcpdemux::open_file_count() const
+{
+    size_t n = openflows.size();
+    for(std::vector<tcpdemux *>::const_iterator it=shards.begin();it!=shards.end();it++){
+	n += (*it)->openflows.size();
+    }
+    return n;
+}
+
+size_t tcpdemux::flow_count() const
+{
+    size_t n = flow_map.size();
+    for(std::vector<tcpdemux *>::const_iterator it=shards.begin();it!=shards.end();it++){
+	n += (*it)->flow_map.size();
+    }
+    return n;
+}
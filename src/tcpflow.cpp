@@ -11,6 +11,9 @@
 
 #include "tcpflow.h"
 #include "bulk_extractor_i.h"
+#include "afpacket.h"
+#include "pcap_reader.h"
+#include "time_histogram.h"
 #include <string>
 #include <vector>
 
@@ -39,18 +42,132 @@ scanner_t *scanners_builtin[] = {
     0};
 
 bool opt_no_promisc = false;		// true if we should not use promiscious mode
+static afpacket_options afpacket_opt;	// -S afpacket settings
+static bool opt_pcap_mmap = true;	// read classic pcap files with pcap_reader
+static bool opt_merge_inputs = false;	// read all -r files at once, merged by time
 
 /****************************************************************
  *** USAGE
  ****************************************************************/
 
+/****************************************************************
+ *** -S name=value SETTINGS
+ ****************************************************************/
+
+static void usage_settings()
+{
+    std::cout << "\nSettings for -S name=value:\n";
+    std::cout << "   hash_seed=N     : seed for the flow hash (default: random)\n";
+    std::cout << "   hash_report=1   : report the flow table's hash distribution in the DFXML file\n";
+    std::cout << "   idle_timeout=N  : close flows that have seen no packets for N seconds (default: never)\n";
+    std::cout << "   close_linger=N  : keep flows for N seconds after FIN or RST (default: 0)\n";
+    std::cout << "   max_flows=N     : most flows to keep in memory; the least recently\n";
+    std::cout << "                     active flow is closed to make room (default: no limit)\n";
+    std::cout << "   max_flow_memory=N : most bytes of flow state to keep in memory (default: no limit)\n";
+    std::cout << "   write_buffer=N  : bytes of each open flow to hold before writing; 0 writes\n";
+    std::cout << "                     every segment at once (default: "
+	      << (unsigned)tcpdemux::options::DEFAULT_WRITE_BUFFER << ")\n";
+    std::cout << "   io_uring=1      : write flow files asynchronously through io_uring (Linux)\n";
+    std::cout << "   io_uring_depth=N : most writes outstanding in it (default: "
+	      << (unsigned)tcpdemux::options::DEFAULT_IO_URING_DEPTH << ")\n";
+    std::cout << "   bundle=1        : append flows to a few segment files with an index,\n";
+    std::cout << "                     bundle.idx, instead of a file per flow\n";
+    std::cout << "   bundle_segment_size=N : bytes per segment file (default: "
+	      << (unsigned)flow_bundle::DEFAULT_SEGMENT_SIZE << ")\n";
+    std::cout << "   digests=LIST    : digests of each flow for the DFXML file, any of md5,sha1,sha256\n";
+    std::cout << "   http_stream=0   : with -AH, parse HTTP from the closed flow files instead of\n";
+    std::cout << "                     as the flows are stored\n";
+    std::cout << "   console_buffer=N : bytes of -c/-C output to collect before writing it; 0 writes\n";
+    std::cout << "                     every segment at once (default: "
+	      << (unsigned)console_writer::DEFAULT_BUFFER << ")\n";
+    std::cout << "   console_flush_msec=N : longest -c/-C output is held (default: "
+	      << (unsigned)console_writer::DEFAULT_FLUSH_MSEC << ")\n";
+    std::cout << "   shards=N        : demultiplex on N threads (default: 1)\n";
+    std::cout << "   post_threads=N  : read closed flows back for -AH and digests on N threads\n";
+    std::cout << "                     (default: 0, on the thread that closes them)\n";
+    std::cout << "   post_queue=N    : most closed flows waiting for those threads (default: "
+	      << (unsigned)tcpdemux::options::DEFAULT_POST_QUEUE << ")\n";
+    std::cout << "   netviz_metric=M : what the -e netviz graph shows: packets, bytes, new_flows\n";
+    std::cout << "                     (connections opened) or flows (connections active)\n";
+    std::cout << "                     (default: packets)\n";
+    std::cout << "   netviz_dump=csv|json : also write the netviz buckets to time_histogram.csv\n";
+    std::cout << "                     or time_histogram.json\n";
+    std::cout << "   pcap_mmap=0     : read -r files with libpcap instead of mapping them into memory\n";
+    std::cout << "   merge_inputs=1  : read all -r files at once, each on its own thread, and\n";
+    std::cout << "                     process their packets in timestamp order\n";
+    if(afpacket_available()){
+	std::cout << "   afpacket=1      : capture with a Linux TPACKET_V3 ring instead of libpcap\n";
+	std::cout << "   afpacket_block_size=N : bytes per ring block (default: " << afpacket_opt.block_size << ")\n";
+	std::cout << "   afpacket_blocks=N : blocks per ring (default: " << afpacket_opt.blocks << ")\n";
+	std::cout << "   afpacket_fanout=N : capture sockets in the fanout group (default: 1)\n";
+	std::cout << "   afpacket_timeout=N : msec before a partly filled block is delivered (default: "
+		  << afpacket_opt.block_timeout << ")\n";
+    }
+}
+
+static bool hash_seed_set = false;	// -S hash_seed was given
+
+/* Apply one -S name=value setting. Returns false if it is not recognized. */
+static bool apply_setting(tcpdemux &demux,const std::string &setting)
+{
+    size_t eq = setting.find('=');
+    if(eq==std::string::npos) return false;
+    std::string name  = setting.substr(0,eq);
+    std::string value = setting.substr(eq+1);
+    const char *v = value.c_str();
+
+    if(name=="hash_seed")  { flow_addr::hash_seed = strtoull(v,0,0); hash_seed_set = true; return true; }
+    if(name=="hash_report"){ demux.opt.opt_hash_report = atoi(v)!=0; return true; }
+    if(name=="idle_timeout"){ demux.opt.idle_timeout = atoi(v); return true; }
+    if(name=="close_linger"){ demux.opt.close_linger = atoi(v); return true; }
+    if(name=="max_flows")   { demux.opt.max_flows = atoi(v); return true; }
+    if(name=="max_flow_memory"){ demux.opt.max_flow_memory = strtoull(v,0,0); return true; }
+    if(name=="write_buffer"){ demux.opt.write_buffer = strtoul(v,0,0); return true; }
+    if(name=="io_uring")    { demux.opt.opt_io_uring = atoi(v)!=0; return true; }
+    if(name=="io_uring_depth"){ demux.opt.io_uring_depth = atoi(v); return true; }
+    if(name=="bundle")      { demux.opt.opt_bundle = atoi(v)!=0; return true; }
+    if(name=="bundle_segment_size"){ demux.opt.bundle_segment_size = strtoull(v,0,0); return true; }
+    if(name=="http_stream") { demux.opt.opt_http_stream = atoi(v)!=0; return true; }
+    if(name=="digests"){
+	unsigned int algs;
+	if(!digest_set::parse(value,algs)) return false;
+	demux.opt.digests |= algs;	// with -FM's MD5
+	return true;
+    }
+    if(name=="console_buffer"){ demux.opt.console_buffer = strtoul(v,0,0); return true; }
+    if(name=="console_flush_msec"){ demux.opt.console_flush_msec = atoi(v); return true; }
+    if(name=="shards")      { demux.opt.shards = atoi(v); return true; }
+    if(name=="post_threads"){ demux.opt.post_threads = atoi(v); return true; }
+    if(name=="post_queue")  { demux.opt.post_queue_depth = atoi(v); return true; }
+    if(name=="netviz_metric"){
+	time_histogram::metric_t metric;
+	if(!time_histogram::parse_metric(value,metric)) return false;
+	demux.opt.netviz_metric = metric;
+	return true;
+    }
+    if(name=="netviz_dump"){
+	if(value!="csv" && value!="json") return false;
+	demux.opt.netviz_dump = value;
+	return true;
+    }
+    if(name=="pcap_mmap")   { opt_pcap_mmap = atoi(v)!=0; return true; }
+    if(name=="merge_inputs"){ opt_merge_inputs = atoi(v)!=0; return true; }
+    if(name=="afpacket")    { afpacket_opt.enabled = atoi(v)!=0; return true; }
+    if(name=="afpacket_block_size"){ afpacket_opt.block_size = atoi(v); return true; }
+    if(name=="afpacket_blocks"){ afpacket_opt.blocks = atoi(v); return true; }
+    if(name=="afpacket_fanout"){ afpacket_opt.fanout = atoi(v); return true; }
+    if(name=="afpacket_timeout"){ afpacket_opt.block_timeout = atoi(v); return true; }
+    return false;
+}
+
 static void usage() __attribute__ ((__noreturn__));
 static void usage()
 {
     std::cout << PACKAGE << " version " << VERSION << "\n\n";
     std::cout << "usage: " << progname << " [-achpsv] [-b max_bytes] [-d debug_level] [-f max_fds]\n";
     std::cout << "      [-i iface] [-L semlock] [-r file] [-R file] [-o outdir] [-X xmlfile]\n";
-    std::cout << "      [-m min_bytes] [-F[ct]] [expression]\n\n";
+    std::cout << "      [-m min_bytes] [-F[ct]] [expression]\n";
+    std::cout << "       " << progname << " extract [-d debug_level] [-o outdir] bundledir [name ...]\n\n";
     std::cout << "   -a: do ALL processing (http expansion, create report.xml, etc.)\n";
     std::cout << "   -b: max number of bytes per flow to save\n";
     std::cout << "   -B: force binary output to console, even with -c or -C\n";
@@ -66,6 +183,7 @@ static void usage()
     std::cout << "   -r: read packets from tcpdump pcap file (may be repeated)\n";
     std::cout << "   -R: read packets from tcpdump pcap file TO FINISH CONNECTIONS\n";
     std::cout << "   -s: strip non-printable characters (change to '.')\n";
+    std::cout << "   -S name=value : set a tuning parameter (may be repeated; see below)\n";
     std::cout << "   -v: verbose operation equivalent to -d 10\n";
     std::cout << "   -V: print version number and exit\n";
     std::cout << "   -o  outdir   : specify output directory (default '.')\n";
@@ -77,11 +195,14 @@ static void usage()
     std::cout << "   -Fc : append the connection counter to ALL filenames\n";
     std::cout << "   -Ft : prepend the time_t timestamp to ALL filenames\n";
     std::cout << "   -FT : prepend the ISO8601 timestamp to ALL filenames\n";
+    std::cout << "   -Fk : put the files in 256x256 subdirectories by flow hash (%K/%k/)\n";
+    std::cout << "   -Fh : put the files in subdirectories by date and hour (%Y-%m-%d/%H/)\n";
     std::cout << "   -FX : Do not output any files (other than report files)\n";
-    std::cout << "   -FM : Calculate the MD5 for every flow\n";
+    std::cout << "   -FM : Calculate the MD5 for every flow (see also -S digests)\n";
     std::cout << "   -T<template> : specify an arbitrary filename template (default "
 	 << flow::filename_template << ")\n";
     std::cout << "   -Z: do not decompress gzip-compressed HTTP transactions\n";
+    usage_settings();
     info_scanners(false,scanners_builtin,'E','x');
     std::cout << "\n";
     std::cout << "Depricated: (don't use)\n";
@@ -135,8 +256,19 @@ void replace(std::string &str,const std::string &from,const std::string &to)
 /* These must be global variables so they are available in the signal handler */
 feature_recorder_set *the_fs = 0;
 xml *xreport = 0;
+volatile sig_atomic_t terminate_requested = 0;
+
+/* The first signal asks the input loops to stop, so that main() closes
+ * the flows and flushes what they have buffered; a second one exits at
+ * once.
+ */
 void terminate(int sig)
 {
+    if(!terminate_requested){
+	terminate_requested = 1;
+	DEBUG(1) ("terminating; signal again to exit without flushing");
+	return;
+    }
     DEBUG(1) ("terminating");
 
     phase_shutdown(*the_fs,*xreport);	// give plugins a chance to do a clean shutdown
@@ -144,6 +276,58 @@ void terminate(int sig)
 }
 
 
+/* set up signal handlers for graceful exit (pcap uses onexit to put
+ * interface back into non-promiscuous mode
+ */
+static void install_signal_handlers()
+{
+    portable_signal(SIGTERM, terminate);
+    portable_signal(SIGINT, terminate);
+#ifdef SIGHUP
+    portable_signal(SIGHUP, terminate);
+#endif
+}
+
+
+/*
+ * Read a classic pcap file with pcap_reader.  Returns false if the file
+ * has to go through libpcap instead.
+ */
+static bool process_mmap_file(const std::string &expression,const std::string &infile)
+{
+    pcap_reader reader;
+    if(!reader.open(infile)) return false;
+    pcap_handler handler = find_handler(reader.datalink(), infile.c_str());
+
+    /* libpcap compiles the filter, which is then run on each packet in place */
+#ifdef HAVE_LIBPCAP
+    struct bpf_program fcode;
+#endif
+    const struct bpf_program *filter = 0;
+    if(expression!=""){
+#ifdef HAVE_LIBPCAP
+	pcap_t *dead = pcap_open_dead(reader.datalink(),reader.snaplen());
+	if(dead==0) die("pcap_open_dead failed");
+	if (pcap_compile(dead, &fcode, expression.c_str(), 1, 0) < 0){
+	    die("%s", pcap_geterr(dead));
+	}
+	pcap_close(dead);
+	filter = &fcode;
+#else
+	return false;
+#endif
+    }
+    DEBUG(20) ("filter expression: '%s'",expression.c_str());
+
+    install_signal_handlers();
+    reader.loop(handler,(u_char *)tcpdemux::getInstance(),filter);
+#ifdef HAVE_LIBPCAP
+    if(filter) pcap_freecode(&fcode);
+#endif
+    return true;
+}
+
+
 /*
  * process an input file or device
  * May be repeated.
@@ -156,6 +340,10 @@ static void process_infile(const std::string &expression,const char *device,cons
     int dlt=0;
     pcap_handler handler;
 
+    if (infile!="" && opt_pcap_mmap && process_mmap_file(expression,infile)){
+	return;
+    }
+
     if (infile!=""){
 	if ((pd = pcap_open_offline(infile.c_str(), error)) == NULL){	/* open the capture file */
 	    die("%s", error);
@@ -221,20 +409,30 @@ static void process_infile(const std::string &expression,const char *device,cons
 
     /* initialize our flow state structures */
 
-    /* set up signal handlers for graceful exit (pcap uses onexit to put
-     * interface back into non-promiscuous mode
-     */
-    portable_signal(SIGTERM, terminate);
-    portable_signal(SIGINT, terminate);
-#ifdef SIGHUP
-    portable_signal(SIGHUP, terminate);
-#endif
+    install_signal_handlers();
 
     /* start listening or reading from the input file */
     if (infile == "") DEBUG(1) ("listening on %s", device);
+#ifdef HAVE_LIBPCAP
+    /* dispatch in batches so that a terminate() is noticed; a live
+     * capture returns at least once per read timeout
+     */
+    while(!terminate_requested){
+	int n = pcap_dispatch(pd, infile=="" ? -1 : 4096, handler, (u_char *)tcpdemux::getInstance());
+	if (n < 0) die("%s", pcap_geterr(pd));
+	if (n == 0 && infile!="") break;	// end of file
+    }
+#else
     if (pcap_loop(pd, -1, handler, (u_char *)tcpdemux::getInstance()) < 0){
 	die("%s", pcap_geterr(pd));
     }
+#endif
+}
+
+/* tcpdemux::merge_infiles() reads each file with this */
+static void read_infile(const std::string &expression,const std::string &infile)
+{
+    process_infile(expression,0,infile);
 }
 
 
@@ -266,13 +464,20 @@ int main(int argc, char *argv[])
 	exit(1);
     }
 
+    /* tcpflow extract: write out flows from a -S bundle=1 output directory */
+    if(argc>1 && strcmp(argv[1],"extract")==0){
+	exit(bundle_extract(argc-1,argv+1));
+    }
+
     int arg;
-    while ((arg = getopt(argc, argv, "aA:Bb:cCd:eE:F:f:Hhi:L:m:o:PpR:r:sT:Vvx:X:Z")) != EOF) {
+    while ((arg = getopt(argc, argv, "aA:Bb:cCd:eE:F:f:Hhi:L:m:o:PpR:r:sS:T:Vvx:X:Z")) != EOF) {
 	switch (arg) {
 	case 'a':
 	    demux.opt.opt_after_header = true;
-	    demux.opt.opt_md5 = true;
+	    demux.opt.digests |= digest_set::MD5;
 	    scanners_enable_all();
+	    scanners_disable("md5");		// MD5 is one of the digests
+	    demux.opt.opt_scan_http = true;
 	    opt_all = true;
 	    continue;
 	    
@@ -314,15 +519,24 @@ int main(int argc, char *argv[])
 	    demux.opt.use_color  = 1;
 	    DEBUG(10) ("using colors");
 	    break;
-        case 'E': scanners_enable(optarg); break;
+        case 'E':
+	    if(strcmp(optarg,"md5")==0){
+		demux.opt.digests |= digest_set::MD5; // computed with the other digests
+		break;
+	    }
+	    if(strcmp(optarg,"http")==0) demux.opt.opt_scan_http = true;
+	    scanners_enable(optarg);
+	    break;
 	case 'F':
 	    for(const char *cc=optarg;*cc;cc++){
 		switch(*cc){
 		case 'c': replace(flow::filename_template,"%c","%C"); break;
 		case 't': flow::filename_template = "%tT" + flow::filename_template; break;
 		case 'T': flow::filename_template = "%T"  + flow::filename_template; break;
+		case 'k': flow::filename_template = "%K/%k/" + flow::filename_template; break;
+		case 'h': flow::filename_template = "%Y-%m-%d/%H/" + flow::filename_template; break;
 		case 'X': demux.opt.opt_output_enabled = false;break;
-		case 'M': demux.opt.opt_md5 = true;break;
+		case 'M': demux.opt.digests |= digest_set::MD5;break;
 		default:
 		    fprintf(stderr,"-F invalid format specification '%c'\n",*cc);
 		    need_usage = true;
@@ -348,10 +562,19 @@ int main(int argc, char *argv[])
 	case 'r': rfiles.push_back(optarg); break;
 	case 's': demux.opt.strip_nonprint = 1;
 	    DEBUG(10) ("converting non-printable characters to '.'"); break;
+	case 'S':
+	    if(!apply_setting(demux,optarg)){
+		fprintf(stderr,"-S invalid setting '%s'\n",optarg);
+		need_usage = true;
+	    }
+	    break;
 	case 'T': flow::filename_template = optarg;break;
 	case 'V': std::cout << PACKAGE << " " << PACKAGE_VERSION << "\n"; exit (1);
 	case 'v': debug = 10; break;
-	case 'x': scanners_disable(optarg);break;
+	case 'x':
+	    if(strcmp(optarg,"http")==0) demux.opt.opt_scan_http = false;
+	    scanners_disable(optarg);
+	    break;
 	case 'X': reportfilename = optarg;break;
 	case 'Z': demux.opt.opt_gzip_decompress = 0; break;
 	case 'H': info_scanners(true,scanners_builtin,'E','x'); exit(0);
@@ -368,7 +591,6 @@ int main(int argc, char *argv[])
     if(getenv("TCPFLOW_MFS")) scanners_enable("pcapviz");    /* Special code for Mike */
 
     /* Load all the scanners and enable the ones we care about */
-    if(demux.opt.opt_md5) scanners_enable("md5");
     load_scanners(scanners_builtin);
     scanners_process_commands();
 
@@ -382,6 +604,12 @@ int main(int argc, char *argv[])
 	exit(1);
     }
 
+    std::string template_error;
+    if(!flow::compile_template(template_error)){
+	std::cerr << "Invalid filename template " << flow::filename_template << ": " << template_error << "\n";
+	exit(1);
+    }
+
     /* get the user's expression out of remainder of the arg... */
     std::string expression = "";
     for(int i=0;i<argc;i++){
@@ -403,6 +631,20 @@ int main(int argc, char *argv[])
 	demux.opt.strip_nonprint = false;
     }
 
+    /* The demux sized its FD ring before -f was seen. */
+    if(demux.opt.max_desired_fds){
+	demux.max_fds = demux.opt.max_desired_fds - NUM_RESERVED_FDS;
+    }
+
+    /* A random hash seed keeps crafted traffic from piling flows into
+     * one part of the flow table.
+     */
+    if(!hash_seed_set){
+	struct timeval tv;
+	gettimeofday(&tv,0);
+	flow_addr::hash_seed = ((uint64_t)tv.tv_sec << 32) ^ (uint64_t)tv.tv_usec ^ ((uint64_t)getpid() << 16);
+    }
+
     /* make sure outdir is a directory. If it isn't, try to make it.*/
     if(stat(demux.outdir.c_str(),&sbuf)==0){
 	if(!S_ISDIR(sbuf.st_mode)){
@@ -434,6 +676,11 @@ int main(int argc, char *argv[])
     the_fs   = &fs;
     demux.fs = &fs;
 
+    if(demux.opt.console_output){
+	demux.console = new console_writer(demux.opt.console_buffer,demux.opt.console_flush_msec);
+    }
+    demux.start_post();
+    demux.start_shards();
     if(rfiles.size()==0 && Rfiles.size()==0){
 	/* live capture */
 #if defined(HAVE_SETUID) && defined(HAVE_GETUID)
@@ -443,27 +690,46 @@ int main(int argc, char *argv[])
 	}
 #endif
 	demux.start_new_connections = true;
-        process_infile(expression,device,"");
+	if(afpacket_opt.enabled){
+	    install_signal_handlers();
+	    afpacket_capture(device,expression,!opt_no_promisc,afpacket_opt);
+	} else {
+	    process_infile(expression,device,"");
+	}
     }
     else {
 	/* first pick up the new connections with -r */
 	demux.start_new_connections = true;
-	for(std::vector<std::string>::const_iterator it=rfiles.begin();it!=rfiles.end();it++){
-	    process_infile(expression,device,*it);
+	if(opt_merge_inputs && rfiles.size()>1){
+	    demux.merge_infiles(rfiles,expression,read_infile);
+	} else {
+	    for(std::vector<std::string>::const_iterator it=rfiles.begin();it!=rfiles.end() && !terminate_requested;it++){
+		process_infile(expression,device,*it);
+	    }
 	}
 	/* now pick up the outstanding connection with -R, but don't start new connections */
 	demux.start_new_connections = false;
-	for(std::vector<std::string>::const_iterator it=Rfiles.begin();it!=Rfiles.end();it++){
+	for(std::vector<std::string>::const_iterator it=Rfiles.begin();it!=Rfiles.end() && !terminate_requested;it++){
 	    process_infile(expression,device,*it);
 	}
     }
 
     /* -1 causes pcap_loop to loop forever, but it finished when the input file is exhausted. */
+    demux.stop_shards();
+    if(demux.console){
+	delete demux.console;		// writes what is left of the console output
+	demux.console = 0;
+    }
 
-    DEBUG(2)("Open FDs at end of processing:      %d",(int)demux.openflows.size());
-    DEBUG(2)("Flow map size at end of processing: %d",(int)demux.flow_map.size());
+    DEBUG(2)("Open FDs at end of processing:      %d",(int)demux.open_file_count());
+    DEBUG(2)("Flow map size at end of processing: %d",(int)demux.flow_count());
 
     demux.close_all();
+    if(demux.opt.opt_bundle){
+	demux.flow_map_clear();		// index the flows that are left
+	demux.close_bundles();
+    }
+    demux.stop_post();			// the scanners must be done with the flows before they shut down
     phase_shutdown(fs,*xreport);
     
     /*
@@ -474,9 +740,14 @@ int main(int argc, char *argv[])
     
     DEBUG(2)(total_flow_processed.c_str(),demux.flow_counter);
     DEBUG(2)(total_packets_processed.c_str(),demux.packet_counter);
+    DEBUG(2)("Flows closed by idle_timeout or close_linger: %d",(int)demux.flows_expired);
+    DEBUG(2)("Flows evicted by max_flows or max_flow_memory: %d",(int)demux.flows_evicted);
+
+    if(demux.opt.opt_hash_report) demux.flow_table_report();
 
     if(xreport){
 	demux.flow_map_clear();	// empty the map to capture the state
+	demux.stats_report();
 	xreport->add_rusage();
 	xreport->pop();			// bulk_extractor
 	xreport->close();
@@ -277,7 +277,8 @@ void flow_close_all();
 
 /* tcpflow.cpp - CLI */
 extern const char *progname;
-void terminate(int sig) __attribute__ ((__noreturn__));
+void terminate(int sig);
+extern volatile sig_atomic_t terminate_requested; // set by the first SIGINT/SIGTERM/SIGHUP
 
 #ifdef HAVE_PTHREAD
 #include <semaphore.h>
@@ -290,6 +291,7 @@ extern int debug;
 #define DEBUG_PEDANTIC    0x0001       // check values more rigorously
 void init_debug(char *argv[]);
 void (*portable_signal(int signo, void (*func)(int)))(int);
+void set_file_times(int fd,const struct timeval &t);
 void debug_real(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 void die(const char *fmt, ...) __attribute__ ((__noreturn__))  __attribute__ ((format (printf, 1, 2)));
 
@@ -8,6 +8,9 @@
  */
 
 #include "tcpflow.h"
+#include "iouring.h"
+#include "scan_http.h"
+#include "post_queue.h"
 #include "bulk_extractor_i.h"
 
 #include <iostream>
@@ -24,15 +27,26 @@ tcpip::tcpip(tcpdemux &demux_,const flow &flow_,tcp_seq isn_):
     demux(demux_),myflow(flow_),dir(unknown),isn(isn_),nsn(0),syn_count(0),
     pos(0),
     flow_pathname(),fd(-1),file_created(false),
-    bytes_processed(0),omitted_bytes(),last_packet_number(),out_of_order_count(0),violations(0)
+    bytes_processed(0),omitted_bytes(),last_packet_number(),out_of_order_count(0),violations(0),
+    idle_timer(this),closing(false),flow_lru(),fd_lru(),
+    wbuf(0),wbuf_off(0),wbuf_extents(),flushes(0),prefix(),uring_fd(-1),
+    stored(),overlap_bytes(0),chunks(),digests(0),http(0),stream_pos(0)
 {
     /* If we are outputting the transcripts, compute the filename */
-    static const std::string slash("/");
     if(demux.opt.opt_output_enabled){
-	if(demux.outdir=="."){
-	    flow_pathname = myflow.filename();
-	} else {
-	    flow_pathname = demux.outdir + slash + myflow.filename();
+	if(demux.outdir!="."){
+	    flow_pathname.reserve(demux.outdir.size() + 64);
+	    flow_pathname = demux.outdir;
+	    flow_pathname += '/';
+	}
+	myflow.filename(flow_pathname);
+	if(demux.opt.digests && demux.xreport){
+	    digests = new digest_set(demux.opt.digests);
+	    demux.flow_memory += sizeof(digest_set);
+	}
+	if(demux.opt.opt_after_header && demux.opt.opt_scan_http && demux.opt.opt_http_stream && !demux.opt.opt_bundle){
+	    http = new scan_http_stream(flow_pathname,this);
+	    demux.flow_memory += sizeof(scan_http_stream);
 	}
     }
 }
@@ -40,28 +54,67 @@ tcpip::tcpip(tcpdemux &demux_,const flow &flow_,tcp_seq isn_):
 
 /**
  * Destructor is called when flow is closed.
- * It implements "after" processing.
+ * It implements "after" processing, through tcpdemux::post_flow().
  */
 tcpip::~tcpip()
 {
-    static const std::string fileobject_str("fileobject");
-    static const std::string filesize_str("filesize");
-    static const std::string filename_str("filename");
-    static const std::string tcpflow_str("tcpflow");
-
-    if(fd>=0) close_file();		// close the file if it is open for some reason
+    demux.flow_timers.cancel(&idle_timer);
+    demux.flow_lru.erase(this);
+    if(fd>=0) demux.close_tcpip(this);	// close the file if it is open for some reason
+    if(uring_fd>=0) demux.uring->wait_fd(uring_fd); // the file is read below
+    demux.flow_memory -= memory_used();
+    demux.flow_memory -= stored.memory_used();
+    if(demux.bundle){
+	demux.bundle->add_flow(myflow,chunks);
+	demux.flow_memory -= chunks.capacity() * sizeof(flow_bundle::chunk);
+    }
 
     std::stringstream xmladd;		// for this <fileobject>
 
-    if(demux.opt.opt_after_header && file_created){
-	/* open the file and see if it is a HTTP header */
-	demux.post_process_capture_flow(xmladd,flow_pathname);
+    /* What was made as the flow was stored holds if it covers every byte */
+    unsigned int need_digests = (demux.xreport && file_created) ? demux.opt.digests : 0;
+    bool need_scan = demux.opt.opt_after_header && demux.opt.opt_scan_http; // see if it is a HTTP header
+    if(stream_pos==stored.extent()){
+	if(digests && need_digests){
+	    std::string xml;
+	    digests->final(xml);
+	    xmladd << xml;
+	    demux.digests_streamed++;
+	    need_digests = 0;
+	}
+	if(http && file_created){
+	    http->finish();
+	    demux.http_streamed++;
+	    need_scan = false;
+	}
+    }
+    stream_drop();			// a finished http stream has nothing to undo
+
+    /* a bundled flow has no file to read back, but its chunks say where its bytes went */
+    if(need_digests && demux.bundle){
+	digest_set ds(need_digests);
+	demux.bundle->digest_flow(chunks,ds);
+	std::string xml;
+	ds.final(xml);
+	xmladd << xml;
+	demux.digests_reread++;
+	need_digests = 0;
+    }
+
+    /* the rest is done by tcpdemux::post_process(), maybe on another thread */
+    bool reread = (need_digests || need_scan) && file_created && !demux.bundle;
+    if(!reread && demux.xreport==0) return;
+    post_job *job = new post_job();
+    if(reread){
+	job->digests = need_digests;
+	job->scan    = need_scan;
+	if(need_digests) demux.digests_reread++;
+	if(need_scan) demux.http_reread++;
     }
+    job->flow_pathname = flow_pathname;
+    job->filesize = bytes_processed;
+    job->xmladd = xmladd.str();
     if(demux.xreport){
-	demux.xreport->push(fileobject_str);
-	if(flow_pathname.size()) demux.xreport->xmlout(filename_str,flow_pathname);
-	demux.xreport->xmlout(filesize_str,bytes_processed);
-	
 	std::stringstream attrs;
 	attrs << "startime='" << xml::to8601(myflow.tstart) << "' ";
 	attrs << "endtime='"  << xml::to8601(myflow.tlast)  << "' ";
@@ -73,15 +126,42 @@ tcpip::~tcpip()
 	attrs << "family='"   << (int)myflow.family << "' ";
 	if(out_of_order_count) attrs << "out_of_order_count='" << out_of_order_count << "' ";
 	if(violations)         attrs << "violations='" << violations << "' ";
-	
-	demux.xreport->xmlout(tcpflow_str,"",attrs.str(),false);
-	if(xmladd.tellp()>0) demux.xreport->xmlout("",xmladd.str(),"",false);
-	demux.xreport->pop();
+	if(flushes)            attrs << "flushes='" << flushes << "' ";
+	if(overlap_bytes)      attrs << "overlap_bytes='" << overlap_bytes << "' ";
+
+	/* bytes of the file that no packet supplied */
+	range_set::ranges_t gaps;
+	stored.gaps(gaps);
+	std::stringstream gapxml;
+	uint64_t gap_bytes = 0;
+	for(range_set::ranges_t::const_iterator it=gaps.begin();it!=gaps.end();it++){
+	    gapxml << "<byte_run file_offset='" << it->first << "' len='" << it->second - it->first
+		   << "' type='gap'/>\n";
+	    gap_bytes += it->second - it->first;
+	}
+	if(gap_bytes){
+	    attrs << "gaps='" << gaps.size() << "' gap_bytes='" << gap_bytes << "' ";
+	    attrs << "completeness='" << (double)(stored.extent() - gap_bytes) / stored.extent() << "' ";
+	}
+	job->attrs  = attrs.str();
+	job->gapxml = gapxml.str();
     }
+    demux.post_flow(job);
 }
 
 
 
+/* Memory held on behalf of this flow: the object, its strings, and
+ * its slot in the flow table.  The write-back buffer, the prefix and
+ * the stored ranges grow and shrink, and are added to
+ * demux.flow_memory separately.
+ */
+size_t tcpip::memory_used() const
+{
+    return sizeof(*this) + flow_pathname.capacity() + sizeof(flow_key) + sizeof(tcpip *) + 1;
+}
+
+
 /* Closes the file belonging to a flow.
  * Don't take it out of the map --- we're still thinking about it.
  * Don't reset pos; we will keep track of where we are, even if the file is not open
@@ -89,31 +169,25 @@ tcpip::~tcpip()
 void tcpip::close_file()
 {
     if (fd>=0){
-	struct timeval times[2];
-	times[0] = myflow.tstart;
-	times[1] = myflow.tstart;
-
 	DEBUG(5) ("%s: closing file", flow_pathname.c_str());
-	/* close the file and remember that it's closed */
-#ifdef OLD_CODE
-	fflush(fp);		/* flush the file */
-#endif
-#if defined(HAVE_FUTIMES)
-	if(futimes(fd,times)){
-	    perror("futimes");
-	}
-#endif
-#if defined(HAVE_FUTIMENS) && !defined(HAVE_FUTIMES)
-	struct timespec tstimes[2];
-	for(int i=0;i<2;i++){
-	    tstimes[i].tv_sec = times[i].tv_sec;
-	    tstimes[i].tv_nsec = times[i].tv_usec * 1000;
+	if(prefix.size()) resolve_prefix();
+	flush_wbuf();
+	if(http) http->close_body();	// so that a flow holds one descriptor at most between packets
+	if(wbuf){
+	    free(wbuf);
+	    wbuf = 0;
+	    demux.flow_memory -= demux.opt.write_buffer;
 	}
-	if(futimens(fileno(fp),tstimes)){
-	    perror("futimens");
+	/* close the file and remember that it's closed */
+	if(demux.bundle){
+	    /* there is no file */
+	} else if(demux.uring){
+	    demux.uring->close(fd,myflow.tstart); // once its writes are done
+	    uring_fd = fd;
+	} else {
+	    set_file_times(fd,myflow.tstart);
+	    close(fd);
 	}
-#endif
-	close(fd);
 	fd = -1;
     }
 }
@@ -138,51 +212,31 @@ void tcpip::print_packet(const u_char *data, uint32_t length)
 	}
     }
 
-#ifdef HAVE_PTHREAD
-    if(semlock){
-	if(sem_wait(semlock)){
-	    fprintf(stderr,"%s: attempt to acquire semaphore failed: %s\n",progname,strerror(errno));
-	    exit(1);
-	}
+    /* the semaphore and the write are console_writer's, once per batch */
+    console_writer &out = *demux.console;
+    out.lock();
+    if (demux.opt.use_color) out.append(dir==dir_cs ? color[1] : color[2]);
+    if (demux.opt.suppress_header == 0){
+	out.append(flow_pathname);
+	out.append(": ",2);
     }
-#endif
-
-    if (demux.opt.use_color) fputs(dir==dir_cs ? color[1] : color[2], stdout);
-    if (demux.opt.suppress_header == 0) printf("%s: ", flow_pathname.c_str());
-
-    size_t written = 0;
     if(demux.opt.strip_nonprint){
-	for(const u_char *cc = data;cc<data+length;cc++){
-	    if(isprint(*cc) || (*cc=='\n') || (*cc=='\r')){
-		written += fputc(*cc,stdout);
-	    }
-	}
+	out.append_printable(data,length);
     }
     else {
-	written = fwrite(data,1,length,stdout);
+	out.append(reinterpret_cast<const char *>(data),length);
     }
-    if(length != written) std::cerr << "\nwrite error to stdout\n";
 
     bytes_processed += length;
 
-    if (demux.opt.use_color) printf("\033[0m");
-
-    putchar('\n');
-    fflush(stdout);
-
-#ifdef HAVE_PTHREAD
-    if(semlock){
-	if(sem_post(semlock)){
-	    fprintf(stderr,"%s: attempt to post semaphore failed: %s\n",progname,strerror(errno));
-	    exit(1);
-	}
-    }
-#endif
+    if (demux.opt.use_color) out.append("\033[0m");
+    out.append("\n",1);
+    out.unlock();
 }
 
 /*
- * extend_file_and_insert():
- * A handy function for inserting in the middle or beginning of a file.
+ * insert():
+ * Move the whole file up by inslen bytes, to make room at the beginning.
  *
  * Based on:
  * http://stackoverflow.com/questions/10467711/c-write-in-the-middle-of-a-binary-file-without-overwriting-any-existing-content
@@ -208,13 +262,12 @@ static int insert(int fd, size_t inslen)
 	ssize_t bytes_this_time = MIN(BUFFERSIZE, bytes_to_move);
 	ssize_t rd_off = read_end_offset - bytes_this_time;
 	ssize_t wr_off = rd_off + inslen;
-	lseek(fd, rd_off, SEEK_SET);
-	if (read(fd, buffer, bytes_this_time) != bytes_this_time)
+	if (pread(fd, buffer, bytes_this_time, rd_off) != bytes_this_time)
 	    return -1;
-	lseek(fd, wr_off, SEEK_SET);
-	if (write(fd, buffer, bytes_this_time) != bytes_this_time)
+	if (pwrite(fd, buffer, bytes_this_time, wr_off) != bytes_this_time)
 	    return -1;
 	bytes_to_move -= bytes_this_time;
+	read_end_offset -= bytes_this_time;
     }   
     return 0;
 }
@@ -279,43 +332,63 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta)
 	    return;
 	}
     }
+    if (fd >= 0) demux.openflows.touch(this);	// most recently written
     
     if(insert_bytes>0){
-	if(fd>=0) insert(fd,insert_bytes);
+	if(fd>=0 && !stored.empty()){
+	    /* open up space in front of what has been written; the file
+	     * itself is not touched.  With nothing written yet there is
+	     * nothing to move, and the data simply starts the file.
+	     */
+	    prefix.insert((size_t)0,(size_t)insert_bytes,'\0');
+	    stream_drop();			// the file will move under it
+	    demux.flow_memory += insert_bytes;
+	    stored.shift(insert_bytes);
+	}
 	isn -= insert_bytes;		// it's really earlier
-	lseek(fd,(off_t)0,SEEK_SET);	// put at the beginning
 	pos = 0;
 	nsn = isn+1;
 	out_of_order_count++;
-	DEBUG(25)("%s: insert(0,%d); lseek(%d,0,SEEK_SET) out_of_order_count=%"PRId64,
-		  flow_pathname.c_str(), insert_bytes,
-		  fd,out_of_order_count);
+	DEBUG(25)("%s: prefix %d bytes (%d in all) out_of_order_count=%"PRId64,
+		  flow_pathname.c_str(), insert_bytes,(int)prefix.size(),out_of_order_count);
     }
 	
 
-    /* if we're not at the correct point in the file, seek there */
+    /* if we're not at the correct point in the file, move there */
     if (offset != pos) {
-	if(fd>=0) lseek(fd,(off_t)delta,SEEK_CUR);
 	if(delta<0) out_of_order_count++; // only increment for backwards seeks
-	DEBUG(25)("%s: lseek(%d,%d,SEEK_CUR) out_of_order_count=%"PRId64,
-		  flow_pathname.c_str(), fd,(int)delta,out_of_order_count);
+	DEBUG(25)("%s: seek %d out_of_order_count=%"PRId64,
+		  flow_pathname.c_str(), (int)delta,out_of_order_count);
 	pos += delta;			// where we are now
 	nsn += delta;			// what we expect the nsn to be now
     }
     
-    /* write the data into the file */
-    DEBUG(25) ("%s: writing %ld bytes @%"PRId64, flow_pathname.c_str(), (long) wlength, offset);
+    /* write the data into the file at pos (a reopened file starts at its
+     * end); anything past max_bytes_per_flow is skipped
+     */
+    DEBUG(25) ("%s: writing %ld bytes @%"PRId64, flow_pathname.c_str(), (long) wlength, pos);
     
-    if(fd>=0){
-	if (write(fd,data, wlength) != wlength) {
-	    DEBUG(1) ("write to %s failed: ", flow_pathname.c_str());
-	    if (debug >= 1) perror("");
-	}
-	if(wlength != length){
-	    lseek(fd,length-wlength,SEEK_CUR); // seek out the space we didn't write
+    if(fd>=0 && wlength>0){
+	uint64_t end = pos + wlength;
+	if(stored.contains(pos,end)){
+	    overlap_bytes += wlength;	// a retransmission of bytes already stored
+	} else {
+	    /* write only the parts that are not already stored */
+	    range_set::ranges_t todo;
+	    stored.missing(pos,end,todo);
+	    overlap_bytes += wlength;
+	    for(range_set::ranges_t::const_iterator it=todo.begin();it!=todo.end();it++){
+		store_bytes(it->first,data + (it->first - pos),it->second - it->first);
+		overlap_bytes -= it->second - it->first;
+	    }
+	    size_t before = stored.memory_used();
+	    stored.add(pos,end);
+	    demux.flow_memory += stored.memory_used() - before;
 	}
     }
     pos += length;
+    /* no packet can reach before the start any more; settle the prefix */
+    if(prefix.size() && pos > (uint64_t)demux.opt.max_seek) resolve_prefix();
     nsn += length;			// expected next sequence number
 
     if(pos>bytes_processed) bytes_processed = pos;
@@ -326,3 +399,167 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta)
 #endif
 }
 
+/* Give length bytes about to be written at file offset to the flow's
+ * digests and HTTP parser, or give up on them if they are not the next
+ * bytes of the file.
+ */
+void tcpip::stream_update(uint64_t offset,const u_char *data,size_t length)
+{
+    if(offset!=stream_pos){
+	DEBUG(25)("%s: writing @%"PRId64" while streamed to %"PRId64"; the file will be read back",
+		  flow_pathname.c_str(),offset,stream_pos);
+	stream_drop();
+	return;
+    }
+    if(digests) digests->update(data,length);
+    if(http) http->update(data,length);
+    stream_pos += length;
+}
+
+void tcpip::stream_drop()
+{
+    if(digests){
+	delete digests;
+	digests = 0;
+	demux.flow_memory -= sizeof(digest_set);
+    }
+    if(http){
+	http->abandon();		// a no-op once it is finished
+	delete http;
+	http = 0;
+	demux.flow_memory -= sizeof(scan_http_stream);
+    }
+}
+
+/* Put length bytes at stream position at: in the prefix if they are
+ * in front of the file, otherwise in the file.
+ */
+void tcpip::store_bytes(uint64_t at,const u_char *data,size_t length)
+{
+    if(at < prefix.size()){
+	size_t n = MIN((uint64_t)length,prefix.size()-at);
+	prefix.replace(at,n,reinterpret_cast<const char *>(data),n);
+	at += n;
+	data += n;
+	length -= n;
+    }
+    if(length>0) write_data(at-prefix.size(),data,length);
+}
+
+/* Write length bytes at file offset with a single pwrite(), queue
+ * them with demux.uring, or append them to demux.bundle.
+ */
+void tcpip::write_file(uint64_t offset,const u_char *data,size_t length)
+{
+    flushes++;
+    if(demux.bundle){
+	size_t before = chunks.capacity();
+	chunks.push_back(demux.bundle->append(data,length));
+	chunks.back().offset = offset;
+	demux.flow_memory += (chunks.capacity() - before) * sizeof(flow_bundle::chunk);
+	return;
+    }
+    if(demux.uring){
+	demux.uring->write(fd,flow_pathname,offset,data,length);
+	return;
+    }
+    if (pwrite(fd,data,length,(off_t)offset) != (ssize_t)length) {
+	DEBUG(1) ("write to %s failed: ", flow_pathname.c_str());
+	if (debug >= 1) perror("");
+    }
+}
+
+/*
+ * Put prefix in front of the file.  This moves the whole file, but only
+ * once the prefix is complete or the file is closed, and while the file
+ * is still within max_seek of its start.  pos is unchanged: it already
+ * counted the prefix.  With a bundle nothing moves; the offsets of the
+ * flow's chunks do.
+ */
+void tcpip::resolve_prefix()
+{
+    DEBUG(25)("%s: moving file up %d bytes for the prefix",flow_pathname.c_str(),(int)prefix.size());
+    flush_wbuf();
+    if(demux.bundle){
+	/* nothing to move: the chunks just say they are further in */
+	for(flow_bundle::chunks_t::iterator it=chunks.begin();it!=chunks.end();it++){
+	    it->offset += prefix.size();
+	}
+	write_file(0,reinterpret_cast<const u_char *>(prefix.data()),prefix.size());
+    } else {
+	if(demux.uring) demux.uring->wait_fd(fd); // insert() reads the file
+	if(insert(fd,prefix.size())){
+	    DEBUG(1)("%s: unable to make room for %d bytes before the first packet",
+		     flow_pathname.c_str(),(int)prefix.size());
+	} else {
+	    write_file(0,reinterpret_cast<const u_char *>(prefix.data()),prefix.size());
+	}
+    }
+    demux.flow_memory -= prefix.size();
+    std::string().swap(prefix);		// give back the memory
+}
+
+void tcpip::flush_wbuf()
+{
+    /* bytes past stream_pos are not contiguous with what was streamed */
+    if((digests || http) && wbuf_extents.size() && wbuf_off+wbuf_extents.back().second > stream_pos) stream_drop();
+    for(size_t i=0;i<wbuf_extents.size();i++){
+	write_file(wbuf_off+wbuf_extents[i].first,wbuf+wbuf_extents[i].first,
+		   wbuf_extents[i].second-wbuf_extents[i].first);
+    }
+    wbuf_extents.clear();
+}
+
+/*
+ * Put length bytes at file offset, by way of the write-back buffer.
+ * A run of in-order segments becomes one write per buffer-full, and a
+ * segment that arrives early waits in the buffer for the gap before it
+ * to be filled.  Segments outside the buffer's window flush it and
+ * start a new window.
+ */
+void tcpip::write_data(uint64_t offset,const u_char *data,size_t length)
+{
+    const size_t size = demux.opt.write_buffer;
+    if(length >= size){			// too big to buffer (or no buffer)
+	flush_wbuf();
+	if(digests || http) stream_update(offset,data,length);
+	write_file(offset,data,length);
+	return;
+    }
+    if(wbuf_extents.size()>0 && (offset < wbuf_off || offset+length > wbuf_off+size)){
+	flush_wbuf();
+    }
+    if(wbuf==0){
+	wbuf = static_cast<u_char *>(malloc(size));
+	if(wbuf==0){
+	    if(digests || http) stream_update(offset,data,length);
+	    write_file(offset,data,length);
+	    return;
+	}
+	demux.flow_memory += size;
+    }
+    if(wbuf_extents.empty()) wbuf_off = offset;
+
+    /* copy in, then merge [start,end) into the sorted list of extents */
+    uint32_t start = offset - wbuf_off;
+    uint32_t end   = start + length;
+    memcpy(wbuf+start,data,length);
+    std::vector<std::pair<uint32_t,uint32_t> >::iterator it = wbuf_extents.begin();
+    while(it!=wbuf_extents.end() && it->second < start) it++;	// extents entirely before
+    while(it!=wbuf_extents.end() && it->first <= end){		// extents touching or overlapping
+	if(it->first  < start) start = it->first;
+	if(it->second > end)   end   = it->second;
+	it = wbuf_extents.erase(it);
+    }
+    wbuf_extents.insert(it,std::make_pair(start,end));
+
+    /* stream as far as the buffer is contiguous with what has been streamed */
+    if((digests || http) && wbuf_off+start <= stream_pos && stream_pos < wbuf_off+end){
+	stream_update(stream_pos,wbuf+(stream_pos-wbuf_off),wbuf_off+end-stream_pos);
+    }
+
+    if(wbuf_extents.size()==1 && wbuf_extents[0].first==0 && wbuf_extents[0].second==size){
+	flush_wbuf();			// the window is full
+    }
+}
+
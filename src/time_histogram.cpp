@@ -21,25 +21,9 @@
 
 using namespace std;
 
-#define IPV6_HEADER_LEN 40
 #define PORT_HTTP 80
 #define PORT_HTTPS 443
 
-// copied from tcpdemux.cpp - should this be in a header somewhere?
-struct private_ip6_hdr {
-    union {
-	struct ip6_hdrctl {
-	    uint32_t ip6_un1_flow;	/* 20 bits of flow-ID */
-	    uint16_t ip6_un1_plen;	/* payload length */
-	    uint8_t  ip6_un1_nxt;	/* next header */
-	    uint8_t  ip6_un1_hlim;	/* hop limit */
-	} ip6_un1;
-	uint8_t ip6_un2_vfc;	/* 4 bits version, top 4 bits class */
-    } ip6_ctlun;
-    struct private_in6_addr ip6_src;	/* source address */
-    struct private_in6_addr ip6_dst;	/* destination address */
-} __attribute__((__packed__));
-
 time_histogram::graph_config_t default_graph_config = {
     /* filename */ "graph",
     /* title */ "graph of things",
@@ -73,7 +57,7 @@ const time_histogram::histogram_config_t time_histogram::default_histogram_confi
     /* graph */ default_graph_config,
     /* bar_space_factor */ 1.2,
     /* bucket_count */ 600,
-    /* first_bucket_factor */ 0.1,
+    /* metric */ time_histogram::PACKETS,
 };
 
 // Unit in libpcap is microsecond, so shall it be here
@@ -86,16 +70,37 @@ const uint64_t time_histogram::span_lengths[] = {
     /* year */ 12L * 30L * 24L * 60L * 60L * 1000L * 1000L
 };
 
-const char * units_strings[] = {
-    "packets vs time",
-    "kilopackets vs time",
-    "megapackets vs time",
-    "gigapackets vs time",
-    "terapackets vs time",
-    "petapackets vs time",
-    "exapackets vs time",
+const char *time_histogram::metric_names[] = {
+    "packets", "bytes", "new_flows", "flows"
+};
+
+const char * units_strings[][7] = {
+    { "packets vs time", "kilopackets vs time", "megapackets vs time",
+      "gigapackets vs time", "terapackets vs time", "petapackets vs time",
+      "exapackets vs time" },
+    { "bytes vs time", "kilobytes vs time", "megabytes vs time",
+      "gigabytes vs time", "terabytes vs time", "petabytes vs time",
+      "exabytes vs time" },
+    { "new flows vs time", "thousand new flows vs time",
+      "million new flows vs time", "billion new flows vs time",
+      "trillion new flows vs time", "quadrillion new flows vs time",
+      "quintillion new flows vs time" },
+    { "flows vs time", "thousand flows vs time", "million flows vs time",
+      "billion flows vs time", "trillion flows vs time",
+      "quadrillion flows vs time", "quintillion flows vs time" },
 };
 
+bool time_histogram::parse_metric(const std::string &name, metric_t &metric)
+{
+    for(int ii = 0; ii < METRICS; ii++) {
+	if(name == metric_names[ii]) {
+	    metric = (metric_t) ii;
+	    return true;
+	}
+    }
+    return false;
+}
+
 
 //
 // Helper functions
@@ -119,68 +124,80 @@ void time_format(struct tm *time, char *buf, int buflen)
 	     time->tm_sec);
 }
 
-// quickly try and get the port out of the packet.  It is assumed that the
-// packet is an IPv4 or 6 datagram in an ethernet frame.
-// any and all errors simply result in -1 being returned
-#pragma GCC diagnostic ignored "-Wcast-align"
-int get_tcp_port(const packet_info &pi)
+//
+// Buckets
+//
+
+void time_histogram::bucket_t::add(const bucket_t &b)
 {
-    // keep track of the length of the packet not yet examined
-    unsigned int unused_len = pi.caplen;
-    if(unused_len < sizeof(struct ether_header)) {
-        return -1;
-    }
-/* MAC layer now handled in caller. pi.data is an IPv4 or IPv6 packet */
-#if 0
-    unused_len -= sizeof(struct ether_header);
-
-    struct ether_header *eth_header = (struct ether_header *) p;
-    u_short *ether_type_location = &eth_header->ether_type;
-    const u_char *ether_data = p + sizeof(struct ether_header);
-
-    /* Handle basic VLAN packets */
-    if(ntohs(*ether_type_location) == ETHERTYPE_VLAN) {
-        // skip to real ethertype
-        ether_type_location += 2;
-        ether_data += 4;
-        unused_len -= 4;
+    for(int c = 0; c < CLASSES; c++) {
+	packets[c] += b.packets[c];
+	bytes[c] += b.bytes[c];
+	new_flows[c] += b.new_flows[c];
+	for(int r = 0; r < FLOW_REGISTERS; r++) {
+	    if(b.flows[c][r] > flows[c][r]) {
+		flows[c][r] = b.flows[c][r];
+	    }
+	}
     }
-#endif
-    // only one of these is safe to use!
-    const struct ip *ip_header = (struct ip *) pi.data;
-    const struct private_ip6_hdr *ip6_header = (struct private_ip6_hdr *) pi.data;
+}
 
-    u_char *ip_data=0;
+// The top 6 bits of the hash pick a register, which keeps the most
+// leading zeros (plus one) seen in the rest.
+void time_histogram::bucket_t::add_flow(int port_class, uint64_t hash)
+{
+    // the flow hash is seeded, but not mixed well enough for this
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    int r = hash >> 58;
+    uint64_t rest = (hash << 6) | (1ULL << 5);
+    uint8_t rank = __builtin_clzll(rest) + 1;
+    if(rank > flows[port_class][r]) {
+	flows[port_class][r] = rank;
+    }
+}
 
-    switch(ip_header->ip_v){
-    case 4:				// IPv4
-	if(unused_len < sizeof(struct ip) ||
-	   ip_header->ip_p != IPPROTO_TCP) {
-	    return -1;
-	}
-	unused_len -= sizeof(struct ip);
-	ip_data = (u_char *) pi.data + sizeof(struct ip);
-	break;
-    case 6:				// IPv6
-	if(unused_len < sizeof(struct private_ip6_hdr) ||
-	   ip6_header->ip6_ctlun.ip6_un1.ip6_un1_nxt != IPPROTO_TCP) {
-	    return -1;
-	}
-	unused_len -= sizeof(struct private_ip6_hdr);
-	ip_data = (u_char *) pi.data + sizeof(struct private_ip6_hdr);
-	break;
-    default:
-	return -1;
+double time_histogram::bucket_t::flow_estimate(int port_class) const
+{
+    double sum = 0;
+    int zeros = 0;
+    for(int r = 0; r < FLOW_REGISTERS; r++) {
+	sum += ldexp(1.0, -flows[port_class][r]);
+	zeros += flows[port_class][r] == 0;
+    }
+    if(zeros == FLOW_REGISTERS) {
+	return 0;
     }
+    double m = FLOW_REGISTERS;
+    double estimate = 0.709 * m * m / sum;
+    if(estimate <= 2.5 * m && zeros > 0) {
+	estimate = m * log(m / zeros);	// few flows: count the empty registers
+    }
+    return estimate;
+}
 
-    if(unused_len < sizeof(struct tcphdr)) {
-        return -1;
+double time_histogram::bucket_t::value(metric_t metric, int port_class) const
+{
+    switch(metric) {
+    case BYTES:
+	return bytes[port_class];
+    case NEW_FLOWS:
+	return new_flows[port_class];
+    case FLOWS:
+	return flow_estimate(port_class);
+    default:
+	return packets[port_class];
     }
+}
 
-    struct tcphdr *tcp_header = (struct tcphdr *) ip_data;
-    return ntohs(tcp_header->th_dport);
+double time_histogram::bucket_t::total(metric_t metric) const
+{
+    return value(metric, HTTP) + value(metric, HTTPS) + value(metric, OTHER);
 }
-#pragma GCC diagnostic warning "-Wcast-align"
 
 //
 // Rendering classes
@@ -358,46 +375,6 @@ public:
     }
 };
 
-void time_histogram::ingest_packet(const packet_info &pi)
-{
-    uint64_t time = pi.ts.tv_usec + pi.ts.tv_sec * 1000000L; // microsecondsx
-    // if we haven't received any data yet, we need to set the base time
-    if(!received_data) {
-	uint64_t first_bucket = (uint64_t) ((double) conf.bucket_count *
-					    conf.first_bucket_factor);
-	base_time = time - (bucket_width * first_bucket);
-	received_data = true;
-    }
-
-    int target_index = (time - base_time) / bucket_width;
-
-    if(target_index < 0) {
-	underflow_count++;
-	return;
-    }
-    if(target_index >= conf.bucket_count) {
-	overflow_count++;
-	return;
-    }
-
-    bucket_t *target_bucket = &buckets.at(target_index);
-
-    switch(get_tcp_port(pi)) {
-    case PORT_HTTP:
-	target_bucket->http++;
-	break;
-    case PORT_HTTPS:
-	target_bucket->https++;
-	break;
-    case -1:
-	// get_tcp_port() returns -1 for any error, including if
-	// there isn't a TCP segment in the packet
-	break;
-    default:
-	target_bucket->other++;
-    }
-}
-
 void time_histogram::render(const std::string &outdir)
 {
     render_vars vars;
@@ -440,6 +417,69 @@ void time_histogram::render(const std::string &outdir)
 #endif
 }
 
+// how far to write the buckets: to the last with packets
+static size_t used_buckets(const vector<time_histogram::bucket_t> &buckets)
+{
+    size_t used = buckets.size();
+    while(used > 0 && buckets[used - 1].total(time_histogram::PACKETS) == 0) {
+	used--;
+    }
+    return used;
+}
+
+static void write_time(std::ostream &os, uint64_t usec)
+{
+    os << usec / 1000000 << "." << setfill('0') << setw(6) << usec % 1000000
+       << setfill(' ');
+}
+
+void time_histogram::write_csv(std::ostream &os) const
+{
+    const char *classes[] = { "http", "https", "other" };
+    os << "start,width";
+    for(int m = 0; m < METRICS; m++) {
+	for(int c = 0; c < bucket_t::CLASSES; c++) {
+	    os << "," << metric_names[m] << "_" << classes[c];
+	}
+    }
+    os << "\n";
+
+    size_t used = used_buckets(buckets);
+    for(size_t ii = 0; ii < used; ii++) {
+	write_time(os, base_time + ii * bucket_width);
+	os << ",";
+	write_time(os, bucket_width);
+	for(int m = 0; m < METRICS; m++) {
+	    for(int c = 0; c < bucket_t::CLASSES; c++) {
+		os << "," << (uint64_t) (buckets[ii].value((metric_t) m, c) + 0.5);
+	    }
+	}
+	os << "\n";
+    }
+}
+
+void time_histogram::write_json(std::ostream &os) const
+{
+    os << "{\"bucket_width\": ";
+    write_time(os, bucket_width);
+    os << ", \"classes\": [\"http\", \"https\", \"other\"], \"buckets\": [";
+
+    size_t used = used_buckets(buckets);
+    for(size_t ii = 0; ii < used; ii++) {
+	os << (ii ? ",\n  " : "\n  ") << "{\"start\": ";
+	write_time(os, base_time + ii * bucket_width);
+	for(int m = 0; m < METRICS; m++) {
+	    os << ", \"" << metric_names[m] << "\": [";
+	    for(int c = 0; c < bucket_t::CLASSES; c++) {
+		os << (c ? ", " : "") << (uint64_t) (buckets[ii].value((metric_t) m, c) + 0.5);
+	    }
+	    os << "]";
+	}
+	os << "}";
+    }
+    os << "\n]}\n";
+}
+
 void time_histogram::render_prep(render_vars &vars)
 {
     // initial stat sweep:
@@ -453,8 +493,7 @@ void time_histogram::render_prep(render_vars &vars)
     vars.greatest_bucket_sum = 0;
     for(vector<bucket_t>::iterator bucket = buckets.begin();
 	bucket != buckets.end(); bucket++) {
-	uint64_t bucket_sum = (*bucket).http + (*bucket).https
-	    + (*bucket).other;
+	double bucket_sum = bucket->total(conf.metric);
 
 	// look for first and last significant bucket
 	if(bucket_sum > 0) {
@@ -464,7 +503,7 @@ void time_histogram::render_prep(render_vars &vars)
 	    }
 	}
 
-	// look for tallest bucket (most packets)
+	// look for tallest bucket
 	if(bucket_sum > vars.greatest_bucket_sum) {
 	    vars.greatest_bucket_sum = bucket_sum;
 	}
@@ -474,11 +513,11 @@ void time_histogram::render_prep(render_vars &vars)
     vars.num_sig_buckets = vars.last_index - vars.first_index;
 
     // choose subtitle based on magnitude of units
-    conf.graph.subtitle = units_strings[0];
+    conf.graph.subtitle = units_strings[conf.metric][0];
     vars.unit_log_1000 =
 	(uint64_t) (log(vars.greatest_bucket_sum) / log(1000));
-    if(vars.unit_log_1000 < (sizeof(units_strings) / sizeof(char *))) {
-	conf.graph.subtitle = units_strings[vars.unit_log_1000];
+    if(vars.unit_log_1000 < (sizeof(units_strings[0]) / sizeof(char *))) {
+	conf.graph.subtitle = units_strings[conf.metric][vars.unit_log_1000];
     }
 }
 
@@ -545,18 +584,16 @@ void time_histogram::render_bars(cairo_t *cr, render_vars &vars)
     for(vector<bucket_t>::iterator bucket =
 	    buckets.begin() + vars.first_index;
 	bucket != buckets.begin() + vars.last_index; bucket++) {
-	uint64_t bucket_sum = (*bucket).http + (*bucket).https
-	    + (*bucket).other;
-	double bar_height = (((double) bucket_sum)
-			     / ((double) vars.greatest_bucket_sum)) * conf.graph.height;
+	double bucket_sum = bucket->total(conf.metric);
+	double bar_height = (bucket_sum / vars.greatest_bucket_sum) * conf.graph.height;
 
 	if(bar_height > 0) {
-	    double http_height = (((double) bucket->http) /
-				  ((double) bucket_sum)) * bar_height;
-	    double https_height = (((double) bucket->https) /
-				   ((double) bucket_sum)) * bar_height;
-	    double other_height = (((double) bucket->other) /
-				   ((double) bucket_sum)) * bar_height;
+	    double http_height = (bucket->value(conf.metric, bucket_t::HTTP) /
+				  bucket_sum) * bar_height;
+	    double https_height = (bucket->value(conf.metric, bucket_t::HTTPS) /
+				   bucket_sum) * bar_height;
+	    double other_height = (bucket->value(conf.metric, bucket_t::OTHER) /
+				   bucket_sum) * bar_height;
 
 	    double current_height = conf.graph.height - bar_height;
 
@@ -593,5 +630,139 @@ void time_histogram::render_bars(cairo_t *cr, render_vars &vars)
 #endif
 }
 
+//
+// The base histogram
+//
+
+base_histogram::base_histogram(int bucket_count_) :
+    bucket_count(bucket_count_),
+    bucket_width(time_histogram::span_lengths[MINUTE] / bucket_count_),
+    buckets(), first_index(0), received_data(false), current(0),
+    current_start(0)
+{
+}
+
+void base_histogram::coarsen()
+{
+    uint64_t new_first = first_index / 2;
+    vector<time_histogram::bucket_t> merged((first_index + buckets.size() - 1) / 2 - new_first + 1);
+    for(size_t ii = 0; ii < buckets.size(); ii++) {
+	merged[(first_index + ii) / 2 - new_first].add(buckets[ii]);
+    }
+    buckets.swap(merged);
+    first_index = new_first;
+    bucket_width *= 2;
+    current = 0;
+}
+
+time_histogram::bucket_t *base_histogram::find_bucket(uint64_t time)
+{
+    if(!received_data) {
+	first_index = time / bucket_width;
+	buckets.resize(1);
+	received_data = true;
+    }
+
+    // widen the buckets until the time fits among bucket_count of them
+    while(true) {
+	uint64_t index = time / bucket_width;
+	uint64_t lo = index < first_index ? index : first_index;
+	uint64_t hi = first_index + buckets.size() - 1;
+	if(index > hi) {
+	    hi = index;
+	}
+	if(hi - lo < (uint64_t) bucket_count) {
+	    break;
+	}
+	coarsen();
+    }
+
+    uint64_t index = time / bucket_width;
+    if(index < first_index) {
+	buckets.insert(buckets.begin(), first_index - index, time_histogram::bucket_t());
+	first_index = index;
+    } else if(index - first_index >= buckets.size()) {
+	buckets.resize(index - first_index + 1);
+    }
+    current_start = index * bucket_width;
+    return &buckets[index - first_index];
+}
+
+static int port_class(int port)
+{
+    switch(port) {
+    case PORT_HTTP:
+	return time_histogram::bucket_t::HTTP;
+    case PORT_HTTPS:
+	return time_histogram::bucket_t::HTTPS;
+    default:
+	return time_histogram::bucket_t::OTHER;
+    }
+}
+
+void base_histogram::ingest_packet(const decoded_packet &pi)
+{
+    if(!pi.has_tcp_header()) {
+	return;
+    }
+    uint64_t time = pi.ts.tv_usec + pi.ts.tv_sec * 1000000L; // microseconds
+
+    // current is moved by any change to buckets, so it is found again
+    // whenever a packet is not in it
+    if(current == 0 || time - current_start >= bucket_width) {
+	current = find_bucket(time);
+    }
+
+    int c = port_class(pi.dport);
+    current->packets[c]++;
+    current->bytes[c] += pi.ip_len;
+    if((pi.tcp_flags & (TH_SYN | TH_ACK)) == TH_SYN) {
+	current->new_flows[c]++;
+    }
+    int flow_class = c;
+    if(flow_class == time_histogram::bucket_t::OTHER) {
+	flow_class = port_class(pi.sport);
+    }
+    current->add_flow(flow_class, pi.connection_hash());
+}
 
+void base_histogram::merge(const base_histogram &other)
+{
+    if(!other.received_data) {
+	return;
+    }
+    if(!received_data && bucket_width < other.bucket_width) {
+	bucket_width = other.bucket_width;
+    }
+    while(bucket_width < other.bucket_width) {
+	coarsen();
+    }
+    // each of other's buckets lies within one of ours, as the widths
+    // are the same power of 2 times the finest span's
+    for(size_t ii = 0; ii < other.buckets.size(); ii++) {
+	const time_histogram::bucket_t &bucket = other.buckets[ii];
+	if(bucket.total(time_histogram::PACKETS) == 0) {
+	    continue;
+	}
+	find_bucket((other.first_index + ii) * other.bucket_width)->add(bucket);
+    }
+    current = 0;
+}
 
+void base_histogram::rollup(time_histogram &h) const
+{
+    h.bucket_width = bucket_width;
+    h.length = bucket_width * h.buckets.size();
+    h.base_time = first_index * bucket_width;
+    // the finest span that the buckets fit in, for what it's worth
+    h.span = YEAR;
+    for(int span = YEAR; span >= MINUTE; span--) {
+	if(time_histogram::span_lengths[span] >= buckets.size() * bucket_width) {
+	    h.span = (span_t) span;
+	}
+    }
+
+    for(size_t ii = 0; ii < buckets.size(); ii++) {
+	h.buckets.at(ii).add(buckets[ii]);
+    }
+}
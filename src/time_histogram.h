@@ -102,34 +102,55 @@ public:
 	double legend_font_size;
     };
 
+    // what the bars show
+    typedef enum {
+	PACKETS = 0, BYTES, NEW_FLOWS, FLOWS, METRICS
+    } metric_t;
+    static const char *metric_names[];	// packets, bytes, new_flows, flows
+    static bool parse_metric(const std::string &name, metric_t &metric);
+
     class histogram_config_t {
     public:
 	// generic graph parent config
 	graph_config_t graph;
 	double bar_space_factor;
 	int bucket_count;
-	// multiplied by the length of the bucket vector to find the first bucket to
-	// insert into
-	double first_bucket_factor;
+	metric_t metric;
     };
     static const histogram_config_t default_histogram_config;
 
 
 
+    // Everything is counted for TCP packets only, split by port into
+    // HTTP, HTTPS and other.  Packets, bytes and new flows go by the
+    // destination port; flows by either port, so that both directions of
+    // a connection are one flow.  A bucket's flows are the connections
+    // that sent a packet in it, which is an estimate of those open at
+    // the time: each class keeps a HyperLogLog sketch, so that buckets
+    // stay a fixed size and can be merged.
     class bucket_t {
     public:
-        uint64_t http;
-        uint64_t https;
-        uint64_t other;
+	enum { HTTP = 0, HTTPS, OTHER, CLASSES };
+	enum { FLOW_REGISTERS = 64 };	// standard error of the estimate about 13%
+
+	uint64_t packets[CLASSES];
+	uint64_t bytes[CLASSES];		// of their IP datagrams, as sent
+	uint64_t new_flows[CLASSES];	// SYNs without ACK
+	uint8_t flows[CLASSES][FLOW_REGISTERS];
+
+	void add(const bucket_t &b);
+	void add_flow(int port_class, uint64_t hash);
+	double flow_estimate(int port_class) const;
+	double value(metric_t metric, int port_class) const;
+	double total(metric_t metric) const;
     };
 
     
 
     time_histogram(const span_t span_, histogram_config_t conf_) :
         span(span_), conf(conf_), length(span_lengths[span_]),
-        bucket_width(length / conf.bucket_count), underflow_count(0),
-        overflow_count(0), buckets(vector<bucket_t>(conf.bucket_count)),
-        base_time(0), received_data(false),
+        bucket_width(length / conf.bucket_count),
+        buckets(vector<bucket_t>(conf.bucket_count)), base_time(0),
         color_http(0.05, 0.33, 0.65), color_https(0.00, 0.75, 0.20),
         color_other(1.00, 0.77, 0.00)   { }
 
@@ -141,39 +162,69 @@ public:
     uint64_t length;
     // number of microseconds each bucket represents
     uint64_t bucket_width;
-    // number of packets that occurred before the span of this histogram
-    uint64_t underflow_count;
-    // number of packets that occurred after the span of this histogram
-    uint64_t overflow_count;
-    // packet counts
+    // packet counts, filled in by base_histogram::rollup()
     vector<bucket_t> buckets;
-    // the earliest time this histogram represents (unknown until first
-    // packet received)
+    // the earliest time this histogram represents
     uint64_t base_time;
-    // have we received that first packet? (beats having to examine buckets)
-    bool received_data;
 
     rgb_t color_http;
     rgb_t color_https;
     rgb_t color_other;
 
-    void ingest_packet(const packet_info &pi);
-
     class render_vars {
     public:
         int first_index;
         int last_index;
-        uint64_t greatest_bucket_sum;
+        double greatest_bucket_sum;
         int num_sig_buckets;
         uint64_t unit_log_1000;
     };
     void render(const std::string &outdir);
+    // the buckets up to the last with packets, for reading into other tools
+    void write_csv(std::ostream &os) const;
+    void write_json(std::ostream &os) const;
     void render_prep(render_vars &vars);
     ticks_t build_tick_labels(render_vars &vars);
     legend_t build_legend(render_vars &vars);
     void render_bars(cairo_t *cr, render_vars &vars);
 };
 
+// The packet counts that the time_histogram is rolled up from when it
+// is rendered.  Each packet is counted once, here.
+//
+// The buckets start at the finest span's width, and their number never
+// passes bucket_count: when a packet falls outside of them, adjacent
+// pairs are merged, doubling the width, until it fits.  So memory stays
+// fixed however long the capture, and no packet is dropped.  A bucket
+// covers [index * bucket_width, (index+1) * bucket_width) microseconds
+// since the epoch, so histograms kept by different threads line up
+// once they are brought to the same width, and merge() adds them.
+class base_histogram {
+public:
+    base_histogram(int bucket_count_);
+
+    void ingest_packet(const decoded_packet &pi);
+    void merge(const base_histogram &other);	// add other's packets
+    // count the packets into h's buckets, setting its width to ours
+    void rollup(time_histogram &h) const;
+
+private:
+    int bucket_count;			// most buckets kept; that of the time_histogram
+    uint64_t bucket_width;		// microseconds per bucket: the finest span's, times a power of 2
+    vector<time_histogram::bucket_t> buckets;
+    uint64_t first_index;		// time / bucket_width of buckets[0]
+    bool received_data;
+    // the bucket the last packet went into; packets mostly arrive in
+    // time order, so most go into it as well
+    time_histogram::bucket_t *current;
+    uint64_t current_start;
+
+    void coarsen();			// merge adjacent pairs of buckets
+    time_histogram::bucket_t *find_bucket(uint64_t time);
 
+    /* not implemented */
+    base_histogram(const base_histogram &);
+    base_histogram &operator=(const base_histogram &);
+};
 
 #endif
@@ -0,0 +1,181 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+/**
+ * timer_wheel.h
+ *
+ * A hierarchical timing wheel with one-second ticks, used to expire
+ * idle flows.
+ *
+ * There are LEVELS wheels of SLOTS slots each; level 0 holds timers due
+ * in the next 64 seconds, level 1 those due in the next 64^2 seconds,
+ * and so on.  When level 0 wraps, the next slot of level 1 is
+ * redistributed ("cascaded") into level 0, and likewise up the
+ * hierarchy.  Scheduling, cancelling and firing a timer are all O(1);
+ * the nodes are intrusive, so the wheel never allocates.
+ *
+ * Time is whatever the caller says it is.  tcpflow drives the wheel
+ * from packet timestamps, so that a pcap file expires flows the same
+ * way as the live capture it was made from.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+template <class T>
+class timer_wheel {
+public:
+    /** A timer; embed one in each object that can expire. */
+    class node {
+    public:
+	node(T *owner_):owner(owner_),expires(0),prev(0),next(0),head(0){}
+	T	*owner;			// the object this timer belongs to
+	uint64_t expires;		// tick (second) at which the timer is due
+	bool pending() const { return prev!=0; }
+    private:
+	friend class timer_wheel;
+	node	*prev;			// circular list of the slot we are in;
+	node	*next;			// both 0 if not scheduled
+	node	**head;			// the slot we were linked into
+	/* not implemented */
+	node(const node &);
+	node &operator=(const node &);
+    };
+
+    enum { SLOT_BITS=6, SLOTS=1<<SLOT_BITS, LEVELS=4 };
+
+    timer_wheel():current(0),started(false),count(0){
+	for(int l=0;l<LEVELS;l++){
+	    for(int s=0;s<SLOTS;s++){
+		heads[l][s] = 0;
+	    }
+	}
+    }
+
+    size_t   size() const { return count; }	// number of pending timers
+    uint64_t now() const  { return current; }	// the last tick processed
+
+    /**
+     * (Re)schedule n to fire at tick expires; a time in the past fires
+     * on the next tick.  The wheel's clock starts at the first call to
+     * advance(), so call that first.
+     */
+    void schedule(node *n,uint64_t expires) {
+	if(!started){
+	    current = expires ? expires-1 : 0;
+	    started = true;
+	}
+	cancel(n);
+	n->expires = expires;
+	link(n,current+1);
+	count++;
+    }
+
+    void cancel(node *n) {
+	if(!n->pending()) return;
+	if(n->next==n){
+	    *n->head = 0;
+	} else {
+	    if(*n->head==n) *n->head = n->next;
+	    n->prev->next = n->next;
+	    n->next->prev = n->prev;
+	}
+	n->prev = n->next = 0;
+	count--;
+    }
+
+    /**
+     * Advance the wheel to tick t, appending every timer that came due
+     * to expired.  The expired nodes are no longer pending, so the
+     * caller may reschedule or destroy them.  Time never runs backwards;
+     * a t earlier than now() does nothing.
+     */
+    void advance(uint64_t t,std::vector<node *> &expired) {
+	if(!started){
+	    current = t;
+	    started = true;
+	    return;
+	}
+	if(count==0 && t>current){		// nothing to do; jump ahead
+	    current = t;
+	    return;
+	}
+	while(current < t){
+	    current++;
+	    /* cascade: each time a level wraps, spread out the next slot of the level above */
+	    for(int l=1;l<LEVELS;l++){
+		if(((current >> ((l-1)*SLOT_BITS)) & (SLOTS-1)) != 0) break;
+		node *n = take(l,(current >> (l*SLOT_BITS)) & (SLOTS-1));
+		while(n){
+		    node *nx = n->next;
+		    link(n,current);	// current's level 0 slot is about to fire
+		    n = nx;
+		}
+	    }
+	    for(node *n = take(0,current & (SLOTS-1)); n; ){
+		node *nx = n->next;
+		n->prev = n->next = 0;
+		count--;
+		expired.push_back(n);
+		n = nx;
+	    }
+	    if(count==0){
+		current = t;
+		break;
+	    }
+	}
+    }
+
+private:
+    uint64_t	current;		// last tick processed
+    bool	started;		// current has been set
+    size_t	count;			// scheduled timers
+    node	*heads[LEVELS][SLOTS];	// circular doubly-linked lists
+
+    /* not implemented */
+    timer_wheel(const timer_wheel &);
+    timer_wheel &operator=(const timer_wheel &);
+
+    /* The level of a timer is picked by how far in the future it is;
+     * timers past the top of the hierarchy park in the top level's
+     * furthest slot and are re-sorted each time it cascades.
+     */
+    node **slot_of(const node *n,uint64_t earliest) {
+	uint64_t when  = n->expires > earliest ? n->expires : earliest;
+	uint64_t delta = when - current;
+	for(int l=0;l<LEVELS;l++){
+	    if(delta < ((uint64_t)1 << ((l+1)*SLOT_BITS))){
+		return &heads[l][(when >> (l*SLOT_BITS)) & (SLOTS-1)];
+	    }
+	}
+	const int top = LEVELS-1;
+	return &heads[top][(current >> (top*SLOT_BITS)) & (SLOTS-1)];
+    }
+
+    /* link n into the slot for its tick, but no earlier than tick earliest */
+    void link(node *n,uint64_t earliest) {
+	node **head = slot_of(n,earliest);
+	n->head = head;
+	if(*head==0){
+	    n->prev = n->next = n;
+	    *head = n;
+	} else {
+	    n->next = *head;
+	    n->prev = (*head)->prev;
+	    (*head)->prev->next = n;
+	    (*head)->prev = n;
+	}
+    }
+
+    /* detach slot s of level l; returns a 0-terminated list */
+    node *take(int l,uint64_t s) {
+	node *h = heads[l][s];
+	if(h==0) return 0;
+	heads[l][s] = 0;
+	h->prev->next = 0;
+	return h;
+    }
+};
+
+#endif
@@ -104,6 +104,31 @@ void die(const char *fmt, ...)
  *
  * 10/6/08 - slg - removed RETSIGTYPE, since it hasn't been needed to 15 years
  */
+/* Set a file's access and modification times, for flow files closed
+ * once they are written.
+ */
+void set_file_times(int fd,const struct timeval &t)
+{
+#if defined(HAVE_FUTIMES)
+    struct timeval times[2];
+    times[0] = t;
+    times[1] = t;
+    if(futimes(fd,times)){
+	perror("futimes");
+    }
+#endif
+#if defined(HAVE_FUTIMENS) && !defined(HAVE_FUTIMES)
+    struct timespec tstimes[2];
+    for(int i=0;i<2;i++){
+	tstimes[i].tv_sec = t.tv_sec;
+	tstimes[i].tv_nsec = t.tv_usec * 1000;
+    }
+    if(futimens(fd,tstimes)){
+	perror("futimens");
+    }
+#endif
+}
+
 void (*portable_signal(int signo, void (*func)(int)))(int)
 {
 #if defined(HAVE_SIGACTION)
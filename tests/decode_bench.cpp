@@ -0,0 +1,280 @@
+/**
+ * decode_bench.cpp:
+ * Microbenchmark for decoding packet headers once (decoded_packet in
+ * src/tcpdemux.h) against each packet callback parsing them itself.
+ *
+ * A mix of synthetic packets (IPv4 TCP with and without IP options,
+ * IPv6 TCP, and UDP) is run through two copies of the per-packet work
+ * that tcpflow does with netviz enabled:
+ *
+ *   before: the tcpdemux walk of the IP and TCP headers, the shard
+ *           connection hash's own walk, and netviz's port lookup once
+ *           for each of its six histograms (copied here as they were);
+ *   after:  one decoded_packet, whose fields all of them read.
+ *
+ * and the cycles (or nanoseconds, without a cycle counter) per packet
+ * are printed for each.
+ *
+ * usage: decode_bench [packets]     (default: 50000000)
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+
+#include <sys/time.h>
+#include <stdlib.h>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+uint64_t flow_addr::hash_seed = 0x5eed;		// defined in flow.cpp for tcpflow
+
+static const int NUM_HISTOGRAMS = 6;		// scan_netviz.cpp
+
+static uint64_t ticks()
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    struct timeval tv;
+    gettimeofday(&tv,0);
+    return tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#endif
+}
+
+/****************************************************************
+ *** The packets
+ ****************************************************************/
+
+static void put16(std::vector<u_char> &p,size_t at,uint16_t v) { p[at] = v >> 8; p[at+1] = v & 0xff; }
+static void put32(std::vector<u_char> &p,size_t at,uint32_t v) { put16(p,at,v >> 16); put16(p,at+2,v & 0xffff); }
+
+static void tcp_header(std::vector<u_char> &p,size_t at,uint16_t sport,uint16_t dport,uint32_t seq)
+{
+    put16(p,at,sport);
+    put16(p,at+2,dport);
+    put32(p,at+4,seq);
+    p[at+12] = 5 << 4;
+    p[at+13] = 0x18;			// PSH ACK
+}
+
+static std::vector<u_char> ip4_packet(uint8_t proto,int options,uint16_t sport,uint16_t dport,size_t payload)
+{
+    size_t hl = 20 + options*4;
+    std::vector<u_char> p(hl + 20 + payload,0x41);
+    p[0] = 0x40 | (hl/4);
+    put16(p,2,p.size());
+    put16(p,6,0x4000);			// DF
+    p[8] = 64;
+    p[9] = proto;
+    put32(p,12,0x0a000001 + sport);
+    put32(p,16,0xc0a80001);
+    for(size_t i=20;i<hl;i++) p[i] = 1; // NOPs
+    tcp_header(p,hl,sport,dport,sport*1000);
+    return p;
+}
+
+static std::vector<u_char> ip6_packet(uint16_t sport,uint16_t dport,size_t payload)
+{
+    std::vector<u_char> p(40 + 20 + payload,0x42);
+    p[0] = 0x60;
+    put16(p,4,20 + payload);
+    p[6] = IPPROTO_TCP;
+    p[7] = 64;
+    for(int i=8;i<40;i++) p[i] = i;
+    put16(p,22,sport);
+    tcp_header(p,40,sport,dport,sport*1000);
+    return p;
+}
+
+/****************************************************************
+ *** Before: each consumer parses the packet itself
+ ****************************************************************/
+
+struct old_ip6_hdr {			// private_ip6_hdr
+    uint32_t flow;
+    uint16_t plen;
+    uint8_t  nxt;
+    uint8_t  hlim;
+    struct private_in6_addr src;
+    struct private_in6_addr dst;
+} __attribute__((__packed__));
+
+/* netviz's get_tcp_port() */
+#pragma GCC diagnostic ignored "-Wcast-align"
+static int old_get_tcp_port(const u_char *data,uint32_t caplen)
+{
+    unsigned int unused_len = caplen;
+    if(unused_len < sizeof(struct ether_header)) return -1;
+    const struct ip *ip_header = (struct ip *) data;
+    const struct old_ip6_hdr *ip6_header = (struct old_ip6_hdr *) data;
+    const u_char *ip_data = 0;
+    switch(ip_header->ip_v){
+    case 4:
+	if(unused_len < sizeof(struct ip) || ip_header->ip_p != IPPROTO_TCP) return -1;
+	unused_len -= sizeof(struct ip);
+	ip_data = data + sizeof(struct ip);
+	break;
+    case 6:
+	if(unused_len < sizeof(struct old_ip6_hdr) || ip6_header->nxt != IPPROTO_TCP) return -1;
+	unused_len -= sizeof(struct old_ip6_hdr);
+	ip_data = data + sizeof(struct old_ip6_hdr);
+	break;
+    default:
+	return -1;
+    }
+    if(unused_len < sizeof(struct tcphdr)) return -1;
+    return ntohs(((struct tcphdr *) ip_data)->th_dport);
+}
+
+/* tcpdemux_shard.cpp's connection_hash() */
+static uint64_t old_connection_hash(const u_char *data,uint32_t caplen)
+{
+    uint8_t a[16],b[16];
+    memset(a,0,sizeof(a));
+    memset(b,0,sizeof(b));
+    sa_family_t family;
+    uint32_t tcp_off;
+    size_t alen;
+    if(caplen < 1) return 0;
+    switch(data[0] >> 4){
+    case 4:
+	if(caplen < 20 || data[9]!=IPPROTO_TCP) return 0;
+	family = AF_INET; alen = 4;
+	memcpy(a,data+12,alen); memcpy(b,data+16,alen);
+	tcp_off = (data[0] & 0x0f) * 4;
+	break;
+    case 6:
+	if(caplen < 40 || data[6]!=IPPROTO_TCP) return 0;
+	family = AF_INET6; alen = 16;
+	memcpy(a,data+8,alen); memcpy(b,data+24,alen);
+	tcp_off = 40;
+	break;
+    default:
+	return 0;
+    }
+    if(caplen < tcp_off+4) return 0;
+    uint16_t aport = (data[tcp_off]   << 8) | data[tcp_off+1];
+    uint16_t bport = (data[tcp_off+2] << 8) | data[tcp_off+3];
+    int c = memcmp(a,b,alen);
+    if(c > 0 || (c==0 && aport > bport)) return flow_hash(b,a,bport,aport,family,flow_addr::hash_seed);
+    return flow_hash(a,b,aport,bport,family,flow_addr::hash_seed);
+}
+
+/* tcpdemux's process_ip() / process_ip4() / process_ip6() / process_tcp(),
+ * down to the flow_addr and the payload
+ */
+static uint64_t old_process_ip(const u_char *data,uint32_t caplen)
+{
+    if(caplen < sizeof(struct ip)) return 0;
+    const struct ip *ip_header = (struct ip *) data;
+    const u_char *tcp;
+    uint32_t length;
+    ipaddr src,dst;
+    sa_family_t family;
+    if(ip_header->ip_v == 6){
+	const struct old_ip6_hdr *ip6 = (struct old_ip6_hdr *) data;
+	if(caplen < sizeof(struct old_ip6_hdr) || ip6->nxt != IPPROTO_TCP) return 0;
+	length = ntohs(ip6->plen);
+	if(caplen - sizeof(struct old_ip6_hdr) < length) length = caplen - sizeof(struct old_ip6_hdr);
+	if(length==0) return 0;
+	tcp = data + sizeof(struct old_ip6_hdr);
+	src = ipaddr(ip6->src.s6_addr);
+	dst = ipaddr(ip6->dst.s6_addr);
+	family = AF_INET6;
+    } else {
+	if(ip_header->ip_p != IPPROTO_TCP) return 0;
+	uint32_t total = ntohs(ip_header->ip_len);
+	if(caplen < total) total = caplen;
+	if(ntohs(ip_header->ip_off) & 0x1fff) return 0;
+	uint32_t hl = ip_header->ip_hl * 4;
+	if(hl > total) return 0;
+	tcp = data + hl;
+	length = total - hl;
+	src = ipaddr(ip_header->ip_src.s_addr);
+	dst = ipaddr(ip_header->ip_dst.s_addr);
+	family = AF_INET;
+    }
+    if(length < sizeof(struct tcphdr)) return 0;
+    const struct tcphdr *tcp_header = (struct tcphdr *) tcp;
+    uint32_t tcp_header_len = tcp_header->th_off * 4;
+    if(tcp_header_len > length) return 0;
+    flow_addr f(src,dst,ntohs(tcp_header->th_sport),ntohs(tcp_header->th_dport),family);
+    return f.hash() + ntohl(tcp_header->th_seq) + tcp_header->th_flags + (length - tcp_header_len);
+}
+#pragma GCC diagnostic warning "-Wcast-align"
+
+static uint64_t before(const std::vector<u_char> &p,const struct timeval &ts)
+{
+    uint64_t sum = old_connection_hash(&p[0],p.size());
+    sum += old_process_ip(&p[0],p.size());
+    for(int h=0;h<NUM_HISTOGRAMS;h++) sum += old_get_tcp_port(&p[0],p.size());
+    return sum;
+}
+
+/****************************************************************
+ *** After: one decode, read by all of them
+ ****************************************************************/
+
+static uint64_t after(const std::vector<u_char> &p,const struct timeval &ts)
+{
+    decoded_packet pi(ts,&p[0],p.size(),flow::NO_VLAN);
+    if(pi.status!=decoded_packet::TCP) return 0;
+    uint64_t sum = pi.connection_hash();
+    flow_addr f(pi.src,pi.dst,pi.sport,pi.dport,pi.family);
+    sum += f.hash() + pi.seq + pi.tcp_flags + pi.payload_len;
+    int port = pi.dport;
+    for(int h=0;h<NUM_HISTOGRAMS;h++) sum += port;
+    return sum;
+}
+
+typedef uint64_t consumer_t(const std::vector<u_char> &p,const struct timeval &ts);
+
+static double run(consumer_t *fn,const std::vector<std::vector<u_char> > &packets,uint64_t count,uint64_t &check)
+{
+    struct timeval ts;
+    gettimeofday(&ts,0);
+    uint64_t t0 = ticks();
+    for(uint64_t i=0;i<count;i++){
+	check += fn(packets[i % packets.size()],ts);
+    }
+    return (double)(ticks()-t0) / count;
+}
+
+int main(int argc,char **argv)
+{
+    uint64_t count = argc>1 ? strtoull(argv[1],0,0) : 50000000;
+
+    std::vector<std::vector<u_char> > packets;
+    for(uint16_t i=0;i<64;i++){
+	packets.push_back(ip4_packet(IPPROTO_TCP,0,40000+i,80,1460));
+	packets.push_back(ip4_packet(IPPROTO_TCP,0,40000+i,443,0));
+	packets.push_back(ip4_packet(IPPROTO_TCP,3,40000+i,80,512));
+	packets.push_back(ip6_packet(40000+i,80,1200));
+	packets.push_back(ip4_packet(IPPROTO_UDP,0,40000+i,53,64));
+    }
+
+    uint64_t check = 0;
+    run(before,packets,count/10,check);	// warm up
+    double b = run(before,packets,count,check);
+    double a = run(after,packets,count,check);
+
+#ifdef HAVE_RDTSC
+    const char *unit = "cycles";
+#else
+    const char *unit = "ns";
+#endif
+    std::cout << std::fixed << std::setprecision(1)
+	      << "before: " << std::setw(6) << b << " " << unit << "/packet (parsed by each callback)\n"
+	      << "after:  " << std::setw(6) << a << " " << unit << "/packet (decoded once)\n"
+	      << "speedup " << std::setprecision(2) << b/a << "x"
+	      << "   (check " << (check & 0xffff) << ")\n";
+    return 0;
+}
@@ -0,0 +1,89 @@
+/**
+ * digest_bench.cpp:
+ * Microbenchmark for the flow digests (src/digest.h).
+ *
+ * Hashes the same data cut into flows of a given size, first with each
+ * algorithm on its own and then with all three in one digest_set, and
+ * prints the throughput of each.  The last line is the time for the
+ * three one-algorithm passes against the one three-algorithm pass.
+ *
+ * usage: digest_bench [flowsize ...]     (default: 1024 65536 1048576)
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "config.h"
+#include "digest.h"
+
+#include <sys/time.h>
+#include <stdlib.h>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+static const size_t TOTAL = 256*1024*1024; // bytes hashed per pass
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv,0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Hash TOTAL bytes as flows of flowsize bytes, each written in
+ * 1460-byte segments as tcpflow sees them; returns the seconds taken.
+ */
+static double run(const std::vector<uint8_t> &data,size_t flowsize,unsigned int algs)
+{
+    std::string xml;
+    double t0 = now();
+    for(size_t done=0;done<TOTAL;done+=flowsize){
+	digest_set ds(algs);
+	for(size_t off=0;off<flowsize;off+=1460){
+	    size_t n = flowsize-off < 1460 ? flowsize-off : 1460;
+	    ds.update(&data[off],n);
+	}
+	xml.clear();
+	ds.final(xml);
+    }
+    return now()-t0;
+}
+
+int main(int argc,char **argv)
+{
+    std::vector<size_t> sizes;
+    for(int i=1;i<argc;i++) sizes.push_back(strtoul(argv[i],0,0));
+    if(sizes.empty()){
+	sizes.push_back(1024);
+	sizes.push_back(65536);
+	sizes.push_back(1048576);
+    }
+
+    size_t largest = 0;
+    for(size_t i=0;i<sizes.size();i++) if(sizes[i]>largest) largest = sizes[i];
+    std::vector<uint8_t> data(largest);
+    uint32_t x = 1;
+    for(size_t i=0;i<data.size();i++){
+	x = x*1103515245 + 12345;
+	data[i] = (uint8_t)(x >> 16);
+    }
+
+    std::cout << "SHA extensions: " << (digest_set::sha_extensions() ? "yes" : "no") << "\n";
+    std::cout << std::fixed << std::setprecision(0);
+    for(size_t i=0;i<sizes.size();i++){
+	double md5    = run(data,sizes[i],digest_set::MD5);
+	double sha1   = run(data,sizes[i],digest_set::SHA1);
+	double sha256 = run(data,sizes[i],digest_set::SHA256);
+	double all    = run(data,sizes[i],digest_set::MD5|digest_set::SHA1|digest_set::SHA256);
+	double mb = TOTAL / 1048576.0;
+	std::cout << "flows of " << sizes[i] << " bytes (MB/s):"
+		  << "  md5 " << mb/md5
+		  << "  sha1 " << mb/sha1
+		  << "  sha256 " << mb/sha256
+		  << "  all three " << mb/all << "\n";
+	std::cout << "    three passes " << std::setprecision(2) << md5+sha1+sha256
+		  << "s, one pass " << all << "s\n" << std::setprecision(0);
+    }
+    return 0;
+}
@@ -0,0 +1,134 @@
+/**
+ * flow_table_bench.cpp:
+ * Microbenchmark for the open-addressing flow table (src/flow_table.h).
+ *
+ * Fills the table with N synthetic IPv4 flows and then measures
+ * lookups per second for flows that are present (hits) and flows that
+ * are not (misses).  With -u the same workload is also run against the
+ * std::tr1::unordered_map that tcpflow used previously.
+ *
+ * usage: flow_table_bench [-u] [nflows ...]     (default: 1M 10M 50M)
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+
+#include <sys/time.h>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <tr1/unordered_map>
+
+static const size_t LOOKUPS = 4*1000*1000; // lookups timed per pass
+
+uint64_t flow_addr::hash_seed = 0x5eed;		// defined in flow.cpp for tcpflow
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv,0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Flow number i maps to a unique 5-tuple; the bits are scattered so
+ * that neighbouring flows do not share addresses or ports.
+ */
+static flow_addr make_flow(uint64_t i)
+{
+    uint64_t x = (i+1) * 0x9e3779b97f4a7c15ULL;
+    x ^= x >> 29;
+    in_addr_t s = htonl(0x0a000000 | (uint32_t)(i & 0xffffff));	// 10.x.x.x
+    in_addr_t d = htonl(0xc0a80000 | (uint32_t)(x & 0xffff));	// 192.168.x.x
+    return flow_addr(ipaddr(s),ipaddr(d),(uint16_t)(1024 + ((i >> 24) & 0x3fff)),
+		     (uint16_t)(x >> 48),AF_INET);
+}
+
+static uint64_t xorshift(uint64_t &s)
+{
+    s ^= s << 13; s ^= s >> 7; s ^= s << 17;
+    return s;
+}
+
+struct bench_key_hash {
+    size_t operator()(const flow_key &k) const { return k.hash(); }
+};
+
+typedef flow_table<flow_key,uintptr_t> table_t;
+typedef std::tr1::unordered_map<flow_key,uintptr_t,bench_key_hash> umap_t;
+
+template <class T> static uintptr_t lookup(const T &t,const flow_key &k);
+template <> uintptr_t lookup(const table_t &t,const flow_key &k)
+{
+    table_t::iterator it = t.find(k);
+    return it==t.end() ? 0 : it->second;
+}
+template <> uintptr_t lookup(const umap_t &t,const flow_key &k)
+{
+    umap_t::const_iterator it = t.find(k);
+    return it==t.end() ? 0 : it->second;
+}
+static void store(table_t &t,const flow_key &k,uintptr_t v) { t.insert(k,v); }
+static void store(umap_t &t,const flow_key &k,uintptr_t v)  { t[k] = v; }
+
+template <class T>
+static void run(const char *name,uint64_t nflows)
+{
+    T *table = new T();
+    double t0 = now();
+    for(uint64_t i=0;i<nflows;i++){
+	store(*table,flow_key(make_flow(i)),(uintptr_t)(i+1));
+    }
+    double t1 = now();
+
+    /* Pre-build the probe keys so that key construction is not timed. */
+    std::vector<flow_key> hits(LOOKUPS);
+    std::vector<flow_key> misses(LOOKUPS);
+    uint64_t seed = 88172645463325252ULL;
+    for(size_t i=0;i<LOOKUPS;i++){
+	hits[i]   = flow_key(make_flow(xorshift(seed) % nflows));
+	misses[i] = flow_key(make_flow(nflows + (xorshift(seed) % nflows)));
+    }
+
+    uint64_t found = 0;
+    double t2 = now();
+    for(size_t i=0;i<LOOKUPS;i++) found += lookup(*table,hits[i]) ? 1 : 0;
+    double t3 = now();
+    for(size_t i=0;i<LOOKUPS;i++) found += lookup(*table,misses[i]) ? 1 : 0;
+    double t4 = now();
+
+    if(found!=LOOKUPS){
+	std::cerr << name << ": expected " << LOOKUPS << " hits, got " << found << "\n";
+	exit(1);
+    }
+    std::cout << std::setw(14) << name
+	      << std::setw(12) << nflows
+	      << std::setw(14) << (uint64_t)(nflows/(t1-t0))
+	      << std::setw(14) << (uint64_t)(LOOKUPS/(t3-t2))
+	      << std::setw(14) << (uint64_t)(LOOKUPS/(t4-t3)) << "\n";
+    delete table;
+}
+
+int main(int argc,char **argv)
+{
+    bool with_umap = false;
+    std::vector<uint64_t> sizes;
+    for(int i=1;i<argc;i++){
+	if(strcmp(argv[i],"-u")==0){ with_umap = true; continue; }
+	sizes.push_back(strtoull(argv[i],0,10));
+    }
+    if(sizes.size()==0){
+	sizes.push_back(1000000);
+	sizes.push_back(10000000);
+	sizes.push_back(50000000);
+    }
+    std::cout << std::setw(14) << "table" << std::setw(12) << "flows"
+	      << std::setw(14) << "inserts/s" << std::setw(14) << "hits/s"
+	      << std::setw(14) << "misses/s" << "\n";
+    for(size_t i=0;i<sizes.size();i++){
+	run<table_t>("flow_table",sizes[i]);
+	if(with_umap) run<umap_t>("unordered_map",sizes[i]);
+    }
+    return 0;
+}
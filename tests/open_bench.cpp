@@ -0,0 +1,157 @@
+/**
+ * open_bench.cpp:
+ * Benchmark for creating flow files in one flat directory versus in
+ * hashed subdirectories (%K/ or %K/%k/ at the start of the
+ * filename template).
+ *
+ * Creates N files with tcpflow-style names the way tcpdemux does: one
+ * open(O_CREAT) and close() each, with the subdirectories made on first
+ * use and remembered.  The mean open latency is printed for each tenth
+ * of the run, so that the slowdown as the flat directory grows shows
+ * up, followed by the mean and 99th percentile over the whole run.  The
+ * files are removed afterwards unless -k is given.  -l picks the layouts
+ * to run by their levels of subdirectories: 0 (flat), 1 (%K/) and/or
+ * 2 (%K/%k/).
+ *
+ * usage: open_bench [-k] [-l levels] [-n nfiles] dir  (default: -l 012, 1M files)
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <set>
+#include <string>
+#include <vector>
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv,0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* File number i gets the name of a distinct flow, and a hash to shard it by. */
+static std::string flow_name(uint64_t i,uint64_t &hash)
+{
+    uint64_t x = (i+1) * 0x9e3779b97f4a7c15ULL;
+    x ^= x >> 29;
+    hash = x * 0xbf58476d1ce4e5b9ULL;
+    char buf[64];
+    snprintf(buf,sizeof(buf),"010.%03d.%03d.%03d.%05d-192.168.%03d.%03d.00080",
+	     (int)((i>>16) & 0xff),(int)((i>>8) & 0xff),(int)(i & 0xff),
+	     1024 + (int)((i>>24) & 0x3fff),(int)(x & 0xff),(int)((x>>8) & 0xff));
+    return std::string(buf);
+}
+
+/* levels of 256 hashed subdirectories: 0 is flat, 1 is %K/, 2 is %K/%k/ */
+static std::string path_for(const std::string &top,int levels,uint64_t i)
+{
+    uint64_t hash;
+    std::string name = flow_name(i,hash);
+    char dirs[8];
+    switch(levels){
+    case 0: return top + "/" + name;
+    case 1: snprintf(dirs,sizeof(dirs),"%02x/",(unsigned int)(hash >> 56)); break;
+    default: snprintf(dirs,sizeof(dirs),"%02x/%02x/",(unsigned int)(hash >> 56),(unsigned int)(hash >> 48) & 0xff);
+    }
+    return top + "/" + dirs + name;
+}
+
+/* mkdir -p, remembering what exists, as tcpdemux::make_dirs() does */
+static void make_dirs(std::set<std::string> &known,const std::string &dir)
+{
+    if(known.find(dir)!=known.end()) return;
+    if(mkdir(dir.c_str(),0777) && errno==ENOENT && dir.rfind('/')!=std::string::npos){
+	make_dirs(known,dir.substr(0,dir.rfind('/')));
+	mkdir(dir.c_str(),0777);
+    }
+    known.insert(dir);
+}
+
+static void run(const std::string &dir,int levels,uint64_t nfiles,bool keep)
+{
+    static const char *layouts[] = {"flat","K","Kk"};
+    std::string top = dir + "/" + layouts[levels];
+    std::set<std::string> known;
+    make_dirs(known,top);
+    std::vector<float> usec(nfiles);
+
+    std::cout << layouts[levels] << ": creating " << nfiles << " files in " << top << "\n";
+    uint64_t step = nfiles/10 ? nfiles/10 : 1;
+    double t0 = now();
+    for(uint64_t i=0;i<nfiles;i++){
+	std::string path = path_for(top,levels,i);
+	double t1 = now();
+	if(levels) make_dirs(known,path.substr(0,path.rfind('/')));
+	int fd = open(path.c_str(),O_RDWR|O_CREAT,0666);
+	if(fd<0){
+	    perror(path.c_str());
+	    exit(1);
+	}
+	close(fd);
+	usec[i] = (now() - t1) * 1000000.0;
+	if((i+1)%step==0){
+	    double sum = 0;
+	    for(uint64_t j=i+1-step;j<=i;j++) sum += usec[j];
+	    std::cout << "  " << std::setw(10) << i+1 << " files: "
+		      << std::fixed << std::setprecision(1) << sum/step << " usec/open\n";
+	}
+    }
+    double elapsed = now() - t0;
+    std::sort(usec.begin(),usec.end());
+    double sum = 0;
+    for(uint64_t i=0;i<nfiles;i++) sum += usec[i];
+    size_t ndirs = 0;
+    for(std::set<std::string>::const_iterator it=known.begin();it!=known.end();it++){
+	if(it->compare(0,top.size()+1,top+"/")==0) ndirs++;
+    }
+    std::cout << "  total " << std::setprecision(2) << elapsed << " s; mean "
+	      << std::setprecision(1) << sum/nfiles << " usec, p99 " << usec[nfiles*99/100]
+	      << " usec; " << ndirs << " directories\n";
+
+    if(!keep){
+	for(uint64_t i=0;i<nfiles;i++) unlink(path_for(top,levels,i).c_str());
+	for(std::set<std::string>::reverse_iterator it=known.rbegin();it!=known.rend();it++){
+	    rmdir(it->c_str());		// children sort after their parents
+	}
+    }
+}
+
+int main(int argc,char **argv)
+{
+    uint64_t nfiles = 1000*1000;
+    bool keep = false;
+    std::string layouts("012");
+    int ch;
+    while((ch = getopt(argc,argv,"kl:n:"))!=-1){
+	switch(ch){
+	case 'k': keep = true; break;
+	case 'l': layouts = optarg; break;
+	case 'n': nfiles = strtoull(optarg,0,10); break;
+	default:
+	    std::cerr << "usage: open_bench [-k] [-l levels] [-n nfiles] dir\n";
+	    return 1;
+	}
+    }
+    if(optind!=argc-1 || nfiles==0){
+	std::cerr << "usage: open_bench [-k] [-l levels] [-n nfiles] dir\n";
+	return 1;
+    }
+    std::string dir = argv[optind];
+    for(size_t i=0;i<layouts.size();i++){
+	if(layouts[i]>='0' && layouts[i]<='2') run(dir,layouts[i]-'0',nfiles,keep);
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+/**
+ * pcap_read_bench.cpp:
+ * Benchmark for reading pcap files: libpcap's pcap_loop() against the
+ * memory-mapped pcap_reader (src/pcap_reader.cpp) that tcpflow uses for
+ * -r.
+ *
+ * Each file is read PASSES times by each reader with a handler that
+ * touches every packet, and the packet rates are compared.  The two
+ * readers must deliver the same packets.  The files in tests/ are small
+ * and stay in the page cache, so this measures the per-packet overhead
+ * of the two paths rather than the disk.
+ *
+ * usage: pcap_read_bench [-n passes] file.pcap ...
+ *        (e.g. "make pcap_read_bench && ./pcap_read_bench -n 2000 *.pcap")
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * LICENSE for details.
+ */
+
+#include "tcpflow.h"
+#include "pcap_reader.h"
+
+#include <sys/time.h>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+int debug = 0;				// for util.cpp
+volatile sig_atomic_t terminate_requested = 0; // for pcap_reader.cpp
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv,0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+class tally {
+public:
+    tally():packets(0),bytes(0),check(0){}
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t check;			// depends on the packet bytes, so they must be read
+};
+
+static void count_packet(u_char *user,const struct pcap_pkthdr *h,const u_char *p)
+{
+    tally *t = reinterpret_cast<tally *>(user);
+    t->packets++;
+    t->bytes += h->caplen;
+    for(uint32_t i=0;i<h->caplen;i+=64) t->check += p[i];
+}
+
+static double run_libpcap(const char *fname,int passes,tally &t)
+{
+    char error[PCAP_ERRBUF_SIZE];
+    double t0 = now();
+    for(int i=0;i<passes;i++){
+	pcap_t *pd = pcap_open_offline(fname,error);
+	if(pd==0) die("%s",error);
+	if(pcap_loop(pd,-1,count_packet,reinterpret_cast<u_char *>(&t)) < 0) die("%s",pcap_geterr(pd));
+	pcap_close(pd);
+    }
+    return now()-t0;
+}
+
+static double run_mmap(const char *fname,int passes,tally &t)
+{
+    double t0 = now();
+    for(int i=0;i<passes;i++){
+	pcap_reader reader;
+	if(!reader.open(fname)) return -1;
+	reader.loop(count_packet,reinterpret_cast<u_char *>(&t),0);
+    }
+    return now()-t0;
+}
+
+int main(int argc,char **argv)
+{
+    int passes = 1000;
+    std::vector<const char *> files;
+    for(int i=1;i<argc;i++){
+	if(strcmp(argv[i],"-n")==0 && i+1<argc){ passes = atoi(argv[++i]); continue; }
+	files.push_back(argv[i]);
+    }
+    if(files.size()==0 || passes<1){
+	std::cerr << "usage: " << argv[0] << " [-n passes] file.pcap ...\n";
+	exit(1);
+    }
+
+    std::cout << std::setw(32) << "file" << std::setw(10) << "packets"
+	      << std::setw(14) << "libpcap pk/s" << std::setw(14) << "mmap pk/s"
+	      << std::setw(9) << "speedup" << "\n";
+    double total_libpcap = 0, total_mmap = 0;
+    for(size_t i=0;i<files.size();i++){
+	tally a,b;
+	double tm = run_mmap(files[i],passes,b);
+	if(tm<0){
+	    std::cout << std::setw(32) << files[i] << "  (not a classic pcap file; skipped)\n";
+	    continue;
+	}
+	double tl = run_libpcap(files[i],passes,a);
+	if(a.packets!=b.packets || a.bytes!=b.bytes || a.check!=b.check){
+	    std::cerr << files[i] << ": readers disagree: libpcap " << a.packets << " packets, "
+		      << a.bytes << " bytes; mmap " << b.packets << " packets, " << b.bytes << " bytes\n";
+	    exit(1);
+	}
+	total_libpcap += tl;
+	total_mmap    += tm;
+	std::cout << std::setw(32) << files[i] << std::setw(10) << a.packets/passes
+		  << std::setw(14) << (uint64_t)(a.packets/tl)
+		  << std::setw(14) << (uint64_t)(b.packets/tm)
+		  << std::setw(8) << std::fixed << std::setprecision(2) << tl/tm << "x\n";
+    }
+    if(total_mmap>0){
+	std::cout << std::setw(32) << "total" << std::setw(10) << ""
+		  << std::setw(14) << "" << std::setw(14) << ""
+		  << std::setw(8) << std::fixed << std::setprecision(2) << total_libpcap/total_mmap << "x\n";
+    }
+    return 0;
+}
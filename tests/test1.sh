@@ -101,4 +101,526 @@ do
   echo Packet file $t completed successfully
 done
 
+echo
+echo ========
+echo check that out-of-order captures give the same flows as in-order ones
+echo ========
+/bin/rm -rf out-inorder out-randomized
+cmd="$TCPFLOW -o out-inorder -r $DMPDIR/test5-lines.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+for p in test5-lines-randomized test5-lines-randomized2 ; do
+  /bin/rm -rf out-randomized
+  cmd="$TCPFLOW -o out-randomized -r $DMPDIR/$p.pcap"
+  echo $cmd
+  if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+  if ! diff -r out-inorder out-randomized ; then
+    echo flows from $p.pcap differ from test5-lines.pcap
+    exit 1
+  fi
+done
+/bin/rm -rf out-inorder out-randomized
+
+# test1-out-of-order.pcap holds two segments of one direction of
+# test1.pcap's 50955 connection, the later one first, with 22 bytes
+# lost between them.  The flow starts 1309 bytes into test1.pcap's.
+/bin/rm -rf out-inorder out-ooo out-ooo.part out-inorder.part
+cmd="$TCPFLOW -o out-inorder -r $DMPDIR/test1.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+cmd="$TCPFLOW -o out-ooo -r $DMPDIR/test1-out-of-order.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+FLOW="074.125.019.104.00080-192.168.001.102.50955"
+checkmd5 out-ooo/$FLOW "ddcb1b66d09008847b1c59f063729f9f" "1483"
+for part in "0 1309 1396" "1418 2727 65" ; do
+  set -- $part
+  dd if=out-ooo/$FLOW bs=1 skip=$1 count=$3 of=out-ooo.part 2>/dev/null
+  dd if=out-inorder/$FLOW bs=1 skip=$2 count=$3 of=out-inorder.part 2>/dev/null
+  if ! cmp out-ooo.part out-inorder.part ; then
+    echo flow from test1-out-of-order.pcap differs from test1.pcap at its byte $1
+    exit 1
+  fi
+done
+/bin/rm -rf out-inorder out-ooo out-ooo.part out-inorder.part
+echo out-of-order captures completed successfully
+
+echo
+echo ========
+echo check that -r files merged by timestamp give the same flows as one file
+echo ========
+/bin/rm -rf out-whole out-merged
+cmd="$TCPFLOW -o out-whole -r $DMPDIR/test1.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+for parts in "test1-part1 test1-part2" "test1-part2 test1-part1" ; do
+  set -- $parts
+  /bin/rm -rf out-merged
+  cmd="$TCPFLOW -o out-merged -S merge_inputs=1 -r $DMPDIR/$1.pcap -r $DMPDIR/$2.pcap"
+  echo $cmd
+  if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+  if ! diff -r out-whole out-merged ; then
+    echo flows merged from $1.pcap and $2.pcap differ from test1.pcap
+    exit 1
+  fi
+done
+/bin/rm -rf out-whole out-merged
+echo merged input files completed successfully
+
+echo
+echo ========
+echo check that sharded demultiplexing gives the same flows as one thread
+echo ========
+for t in 1 3 ; do
+  /bin/rm -rf out-1shard out-4shards
+  cmd="$TCPFLOW -o out-1shard -X out-1shard/report.xml -r $DMPDIR/test$t.pcap"
+  echo $cmd
+  if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+  cmd="$TCPFLOW -o out-4shards -S shards=4 -X out-4shards/report.xml -r $DMPDIR/test$t.pcap"
+  echo $cmd
+  if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+  if ! diff -r -x report.xml out-1shard out-4shards ; then
+    echo flows from test$t.pcap differ with shards=4
+    exit 1
+  fi
+  n1=`grep -o '<fileobject>' out-1shard/report.xml | wc -l`
+  n4=`grep -o '<fileobject>' out-4shards/report.xml | wc -l`
+  if [ $n1 -eq 0 ] || [ $n1 -ne $n4 ]; then
+    echo test$t.pcap: $n1 fileobjects with one shard, $n4 with shards=4
+    exit 1
+  fi
+done
+/bin/rm -rf out-1shard out-4shards
+echo sharded demultiplexing completed successfully
+
+echo
+echo ========
+echo check bundle output
+echo ========
+/bin/rm -rf out-bundle out-extract
+cmd="$TCPFLOW -o out-bundle -S bundle=1 -r $DMPDIR/test1.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+if ! [ -r out-bundle/bundle.idx ]; then echo bundle.idx was not created; exit 1; fi
+cmd="$TCPFLOW extract -o out-extract out-bundle"
+echo $cmd
+if ! $cmd; then echo tcpflow extract failed; exit 1 ; fi
+checkmd5 out-extract/"074.125.019.101.00080-192.168.001.102.50956" "ae30a88136feb0655492bdb75e078643" "136"
+checkmd5 out-extract/"074.125.019.104.00080-192.168.001.102.50955" "61051e417d34e1354559e3a8901d19d3" "2792"
+checkmd5 out-extract/"192.168.001.102.50955-074.125.019.104.00080" "14e9c335bf54dc4652999e25d99fecfe" "655"
+checkmd5 out-extract/"192.168.001.102.50956-074.125.019.101.00080" "78b8073093d107207327103e80fbdf43" "604"
+/bin/rm -rf out-bundle out-extract
+echo Bundle output completed successfully
+
+echo
+echo ========
+echo check MD5 digests in the DFXML file
+echo ========
+/bin/rm -rf out-md5
+cmd="$TCPFLOW -o out-md5 -FM -X out-md5/report.xml -r $DMPDIR/test1.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+for md5 in ae30a88136feb0655492bdb75e078643 61051e417d34e1354559e3a8901d19d3 \
+           14e9c335bf54dc4652999e25d99fecfe 78b8073093d107207327103e80fbdf43 ; do
+  if ! grep "<hashdigest type='MD5'>$md5</hashdigest>" out-md5/report.xml >/dev/null ; then
+    echo MD5 $md5 missing from out-md5/report.xml
+    exit 1
+  fi
+done
+/bin/rm -rf out-md5
+echo MD5 digests completed successfully
+
+echo
+echo ========
+echo check the DFXML file when closed flows are finished on post_threads
+echo ========
+/bin/rm -rf out-md5 out-md5-post
+cmd="$TCPFLOW -o out-md5 -FM -X out-md5/report.xml -r $DMPDIR/test1.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+cmd="$TCPFLOW -o out-md5-post -FM -S post_threads=2 -X out-md5-post/report.xml -r $DMPDIR/test1.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+if ! grep '</dfxml>' out-md5-post/report.xml >/dev/null ; then
+  echo out-md5-post/report.xml was not finished
+  exit 1
+fi
+for f in out-md5 out-md5-post ; do
+  grep -o '<fileobject>' $f/report.xml | wc -l > $f.count
+  grep -o '<hashdigest[^<]*</hashdigest>' $f/report.xml | sort > $f.digests
+done
+if ! cmp out-md5.count out-md5-post.count || ! cmp out-md5.digests out-md5-post.digests ; then
+  echo DFXML fileobjects written on post_threads differ
+  exit 1
+fi
+/bin/rm -rf out-md5 out-md5-post out-md5.count out-md5-post.count out-md5.digests out-md5-post.digests
+echo post_threads DFXML completed successfully
+
+echo
+echo ========
+echo check MD5 digests of bundled flows that were not written in order
+echo ========
+/bin/rm -rf out-md5 out-md5-bundle
+cmd="$TCPFLOW -o out-md5 -FM -X out-md5/report.xml -r $DMPDIR/test1-out-of-order.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+cmd="$TCPFLOW -o out-md5-bundle -FM -S bundle=1 -X out-md5-bundle/report.xml -r $DMPDIR/test1-out-of-order.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+for f in out-md5 out-md5-bundle ; do
+  grep -o '<hashdigest[^<]*</hashdigest>' $f/report.xml | sort > $f.digests
+done
+if [ ! -s out-md5.digests ]; then echo no MD5 digests in out-md5/report.xml; exit 1 ; fi
+if ! cmp out-md5.digests out-md5-bundle.digests ; then
+  echo MD5 digests of bundled flows differ
+  exit 1
+fi
+/bin/rm -rf out-md5 out-md5-bundle out-md5.digests out-md5-bundle.digests
+echo bundled MD5 digests completed successfully
+
+echo
+echo ========
+echo check SHA-256 digests in the DFXML file
+echo ========
+/bin/rm -rf out-sha
+cmd="$TCPFLOW -o out-sha -S digests=sha256 -X out-sha/report.xml -r $DMPDIR/test1.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+for sha in 00d2d15673cf950f24e8b28c5fe6e3b6ca5ea22813d94d3b4575d246beea1eb8 \
+           88d94aa85f286b98bf803e12372942de726e2a8f032b258622ce9c5e7968faf3 \
+           b7de88ffa5505fa0276829dc6ccf060451d46ebfc55685b0c8a5dd5bf3691d01 \
+           11b4c960c50df3525f0bed98eb8639beb0b7014272f524752022391860da8242 ; do
+  if ! grep "<hashdigest type='SHA256'>$sha</hashdigest>" out-sha/report.xml >/dev/null ; then
+    echo SHA256 $sha missing from out-sha/report.xml
+    exit 1
+  fi
+done
+if grep "<hashdigest type='MD5'>" out-sha/report.xml >/dev/null ; then
+  echo -S digests=sha256 also produced MD5 digests
+  exit 1
+fi
+/bin/rm -rf out-sha
+echo SHA-256 digests completed successfully
+
+echo
+echo ========
+echo check that HTTP bodies parsed as the flows are written match a re-read of the files
+echo ========
+/bin/rm -rf out-http out-http-reread
+cmd="$TCPFLOW -AH -E http -o out-http -r $DMPDIR/test1.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+cmd="$TCPFLOW -AH -E http -S http_stream=0 -o out-http-reread -r $DMPDIR/test1.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+if [ -z "`ls out-http | grep HTTPBODY`" ]; then echo no HTTPBODY files in out-http; exit 1 ; fi
+if ! diff -r -x report.xml out-http out-http-reread ; then
+  echo streamed HTTP output differs from re-read HTTP output
+  exit 1
+fi
+/bin/rm -rf out-http-post
+cmd="$TCPFLOW -AH -E http -S http_stream=0 -S post_threads=2 -o out-http-post -r $DMPDIR/test1.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+if ! diff -r -x report.xml out-http-reread out-http-post ; then
+  echo HTTP output re-read on post_threads differs
+  exit 1
+fi
+/bin/rm -rf out-http out-http-reread out-http-post
+echo streamed HTTP parsing completed successfully
+
+echo
+echo ========
+echo check that batched console output matches unbatched console output
+echo ========
+cmd="$TCPFLOW -cs -r $DMPDIR/test1.pcap"
+echo $cmd
+if ! $cmd > out-console.txt; then echo tcpflow failed; exit 1 ; fi
+cmd="$TCPFLOW -cs -S console_buffer=0 -r $DMPDIR/test1.pcap"
+echo $cmd
+if ! $cmd > out-console0.txt; then echo tcpflow failed; exit 1 ; fi
+if [ ! -s out-console.txt ]; then echo no console output; exit 1 ; fi
+if ! cmp out-console.txt out-console0.txt ; then
+  echo batched console output differs
+  exit 1
+fi
+/bin/rm -f out-console.txt out-console0.txt
+echo console output completed successfully
+
+echo
+echo ========
+echo check that a bad filename template is refused before any packets are read
+echo ========
+/bin/rm -rf out-badtemplate
+cmd="$TCPFLOW -o out-badtemplate -T %A.%z -r $DMPDIR/test1.pcap"
+echo $cmd
+if $cmd; then echo tcpflow accepted a bad template; exit 1 ; fi
+if [ -n "`ls out-badtemplate 2>/dev/null`" ]; then echo tcpflow wrote flows with a bad template; exit 1 ; fi
+/bin/rm -rf out-badtemplate
+
+echo
+echo ========
+echo check a capture whose packets were cut short
+echo ========
+# test1-truncated.pcap is test1.pcap captured with a 100-byte snaplen,
+# and one packet cut inside its TCP options, which is dropped.  What was
+# not captured is a gap in the flow.
+/bin/rm -rf out-truncated
+cmd="$TCPFLOW -o out-truncated -X out-truncated/report.xml -r $DMPDIR/test1-truncated.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+checkmd5 out-truncated/"074.125.019.101.00080-192.168.001.102.50956" "df4d3d2e574eab0e5ca7cef6402ccc38" "34"
+checkmd5 out-truncated/"074.125.019.104.00080-192.168.001.102.50955" "2e7992fa5c2ebe3d1d1f366243090baa" "2761"
+checkmd5 out-truncated/"192.168.001.102.50955-074.125.019.104.00080" "0aad59c1d4d9c383bd8414f3606bb58d" "34"
+checkmd5 out-truncated/"192.168.001.102.50956-074.125.019.101.00080" "4a0334ab4421a99ccaf46f76e9bc6a47" "34"
+if ! grep "gap_bytes='2659'" out-truncated/report.xml >/dev/null ; then
+  echo uncaptured bytes are not reported as gaps in out-truncated/report.xml
+  exit 1
+fi
+/bin/rm -rf out-truncated
+echo truncated capture completed successfully
+
+echo
+echo ========
+echo check that a RST ends a connection only when flows are expired
+echo ========
+# test7-rst.pcap: a connection with a RST in the middle of it and another
+# at the end, and a self-connected packet and RST, which is its own
+# reverse flow.
+for opt in "" "-S idle_timeout=60" ; do
+  /bin/rm -rf out-rst
+  cmd="$TCPFLOW -o out-rst $opt -X out-rst/report.xml -r $DMPDIR/test7-rst.pcap"
+  echo $cmd
+  if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+  checkmd5 out-rst/"010.000.000.001.40001-010.000.000.002.00080" "738bb2e514e4c8141281efa630650db0" "11"
+  checkmd5 out-rst/"010.000.000.002.00080-010.000.000.001.40001" "2eb41e6ac431d4435405e96cc059d4b5" "11"
+  checkmd5 out-rst/"010.000.000.001.40002-010.000.000.001.40002" "901c9d71622e26b7baf5e597455d95c0" "5"
+  n=`grep -o '<fileobject>' out-rst/report.xml | wc -l`
+  case "$opt" in
+    "") want=3 ;;		# the RSTs are ignored
+    *)  want=5 ;;		# the first RST closes both directions
+  esac
+  if [ $n -ne $want ]; then
+    echo "RST with '$opt': $n fileobjects, expected $want"
+    exit 1
+  fi
+done
+/bin/rm -rf out-rst
+echo RST handling completed successfully
+
+echo
+echo ========
+echo check that idle flows are closed by idle_timeout
+echo ========
+# test6-idle.pcap: a request and its answer, 120 seconds of quiet, and
+# another request and answer on the same connection.  With a 60-second
+# idle_timeout both directions are closed in the gap, so each gets two
+# <fileobject>s; the second instance goes on the end of the same file.
+/bin/rm -rf out-idle
+cmd="$TCPFLOW -o out-idle -S idle_timeout=60 -X out-idle/report.xml -r $DMPDIR/test6-idle.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+checkmd5 out-idle/"010.000.000.001.40000-010.000.000.002.00080" "747f24bb583d08c2246b3874df58cdf5" "24"
+checkmd5 out-idle/"010.000.000.002.00080-010.000.000.001.40000" "dc974811aa599d6218c0c55ca2b3ca58" "27"
+if ! grep '<flows_expired>2<' out-idle/report.xml >/dev/null ; then
+  echo flows_expired is not 2 in out-idle/report.xml
+  exit 1
+fi
+for f in "010.000.000.001.40000-010.000.000.002.00080" "010.000.000.002.00080-010.000.000.001.40000" ; do
+  n=`grep -c "<filename>.*$f" out-idle/report.xml`
+  if [ $n -ne 2 ]; then echo $f was closed $n times, expected 2; exit 1 ; fi
+done
+/bin/rm -rf out-idle
+echo idle_timeout completed successfully
+
+echo
+echo ========
+echo check that flows closed by max_flows or max_flow_memory are still written
+echo ========
+# test2.pcap's two flows take turns, so with room for one flow each
+# packet of the other closes it; it is reopened and written on.
+for opt in "-S max_flows=1" "-S max_flow_memory=1" ; do
+  /bin/rm -rf out-evict
+  cmd="$TCPFLOW -o out-evict $opt -X out-evict/report.xml -r $DMPDIR/test2.pcap"
+  echo $cmd
+  if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+  checkmd5 out-evict/"010.000.000.001.09999-010.000.000.002.36559--42" "b7d0b9ee8a7c1ea94b6b43b5a3e0da83"
+  checkmd5 out-evict/"010.000.000.002.36559-010.000.000.001.09999--42" "c4b95c552616bda3e21d063e8ee2e332"
+  evicted=`sed -n 's/.*<flows_evicted>\([0-9]*\)<.*/\1/p' out-evict/report.xml`
+  if [ x$evicted != x6 ]; then
+    echo "$opt: flows_evicted is '$evicted', expected 6"
+    exit 1
+  fi
+done
+/bin/rm -rf out-evict
+echo flow eviction completed successfully
+
+echo
+echo ========
+echo check that flows are written correctly when they share a few file descriptors
+echo ========
+# -f 7 leaves two descriptors for flow files, fewer than local2.pcap's
+# four flows, so some are closed and reopened; without a write buffer
+# every segment goes to its file at once.
+/bin/rm -rf out-fds out-fds-unlimited
+cmd="$TCPFLOW -o out-fds-unlimited -r $DMPDIR/local2.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+cmd="$TCPFLOW -o out-fds -f 7 -S write_buffer=0 -X out-fds/report.xml -r $DMPDIR/local2.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+if ! grep '<max_fds>2<' out-fds/report.xml >/dev/null ; then
+  echo max_fds is not 2 in out-fds/report.xml
+  exit 1
+fi
+if grep '<fd_reopens>0<' out-fds/report.xml >/dev/null ; then
+  echo no flow files were reopened
+  exit 1
+fi
+if ! diff -r -x report.xml out-fds-unlimited out-fds ; then
+  echo flows written with -f 7 differ
+  exit 1
+fi
+/bin/rm -rf out-fds out-fds-unlimited
+echo file descriptor limit completed successfully
+
+echo
+echo ========
+echo check the flows written with no write buffer and with a small one
+echo ========
+# The reply on port 50955 is four segments, two of them out of order.
+# With no buffer each is its own write; 4096 bytes hold the whole reply,
+# so it is written once.
+for wb in 0:4 4096:1 ; do
+  size=`echo $wb | cut -d: -f1`
+  want=`echo $wb | cut -d: -f2`
+  /bin/rm -rf out-wb
+  cmd="$TCPFLOW -o out-wb -S write_buffer=$size -X out-wb/report.xml -r $DMPDIR/test1.pcap"
+  echo $cmd
+  if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+  checkmd5 out-wb/"074.125.019.101.00080-192.168.001.102.50956" "ae30a88136feb0655492bdb75e078643" "136"
+  checkmd5 out-wb/"074.125.019.104.00080-192.168.001.102.50955" "61051e417d34e1354559e3a8901d19d3" "2792"
+  checkmd5 out-wb/"192.168.001.102.50955-074.125.019.104.00080" "14e9c335bf54dc4652999e25d99fecfe" "655"
+  checkmd5 out-wb/"192.168.001.102.50956-074.125.019.101.00080" "78b8073093d107207327103e80fbdf43" "604"
+  if ! grep "srcport='80' dstport='50955'.* flushes='$want'" out-wb/report.xml >/dev/null ; then
+    echo "write_buffer=$size: the reply was not written in $want flushes"
+    exit 1
+  fi
+done
+/bin/rm -rf out-wb
+echo write buffer completed successfully
+
+echo
+echo ========
+echo check that flows written through io_uring match those written synchronously
+echo ========
+# Where io_uring is not available tcpflow writes synchronously, and the
+# DFXML has no io_uring_writes; the output must match either way.  The
+# second pair of runs closes and reopens files with writes in flight.
+for opt in "" "-f 7 -S write_buffer=0" ; do
+  for p in test1 local2 ; do
+    /bin/rm -rf out-sync out-uring
+    cmd="$TCPFLOW -o out-sync $opt -r $DMPDIR/$p.pcap"
+    echo $cmd
+    if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+    cmd="$TCPFLOW -o out-uring $opt -S io_uring=1 -X out-uring/report.xml -r $DMPDIR/$p.pcap"
+    echo $cmd
+    if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+    if ! grep '<io_uring_writes>' out-uring/report.xml >/dev/null ; then
+      echo io_uring is not available, so $p.pcap was written synchronously
+    elif ! grep '<io_uring_write_errors>0<' out-uring/report.xml >/dev/null ; then
+      echo io_uring writes of $p.pcap failed
+      exit 1
+    fi
+    if ! diff -r -x report.xml out-sync out-uring ; then
+      echo "flows from $p.pcap written through io_uring with '$opt' differ"
+      exit 1
+    fi
+  done
+done
+/bin/rm -rf out-sync out-uring
+echo io_uring completed successfully
+
+echo
+echo ========
+echo check that -Fh, -Fk and %N/%n put flows in the expected subdirectories
+echo ========
+# test1.pcap's flows start in the hour 2008-10-06T17Z.  The %K/%k hash
+# is not seeded, so each flow has the same directories on every run.
+checkdirs()
+{
+  checkmd5 out-dirs/$1"074.125.019.101.00080-192.168.001.102.50956" "ae30a88136feb0655492bdb75e078643" "136"
+  checkmd5 out-dirs/$2"074.125.019.104.00080-192.168.001.102.50955" "61051e417d34e1354559e3a8901d19d3" "2792"
+  checkmd5 out-dirs/$3"192.168.001.102.50955-074.125.019.104.00080" "14e9c335bf54dc4652999e25d99fecfe" "655"
+  checkmd5 out-dirs/$4"192.168.001.102.50956-074.125.019.101.00080" "78b8073093d107207327103e80fbdf43" "604"
+}
+for opt in -Fh -Fk -T%N/%n/%A.%a-%B.%b ; do
+  /bin/rm -rf out-dirs
+  cmd="$TCPFLOW -o out-dirs $opt -r $DMPDIR/test1.pcap"
+  echo $cmd
+  if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+  case "$opt" in
+    -Fh) checkdirs 2008-10-06/17/ 2008-10-06/17/ 2008-10-06/17/ 2008-10-06/17/ ;;
+    -Fk) checkdirs a8/75/ b3/ee/ 66/b7/ 93/b9/ ;;
+    *)   checkdirs 074.125/192.168/ 074.125/192.168/ 192.168/074.125/ 192.168/074.125/ ;;
+  esac
+done
+/bin/rm -rf out-dirs
+echo filename template directories completed successfully
+
+echo
+echo ========
+echo check that the netviz histogram counts every TCP packet once
+echo ========
+# test1.pcap has 21 TCP packets; its other packets are not counted.
+/bin/rm -rf out-netviz
+cmd="$TCPFLOW -o out-netviz -E netviz -S netviz_dump=csv -r $DMPDIR/test1.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+packets=`awk -F, 'NR>1 { n += $3 + $4 + $5 } END { print n }' out-netviz/time_histogram.csv`
+if [ x$packets != x21 ]; then
+  echo "netviz counted '$packets' packets in test1.pcap, expected 21"
+  exit 1
+fi
+/bin/rm -rf out-netviz
+echo netviz packet count completed successfully
+
+echo
+echo ========
+echo check that the netviz histogram is the same when inputs are merged
+echo ========
+/bin/rm -rf out-netviz out-netviz-merged
+cmd="$TCPFLOW -o out-netviz -E netviz -S netviz_dump=csv -r $DMPDIR/test1-part1.pcap -r $DMPDIR/test1-part2.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+cmd="$TCPFLOW -o out-netviz-merged -E netviz -S netviz_dump=csv -S merge_inputs=1 -r $DMPDIR/test1-part1.pcap -r $DMPDIR/test1-part2.pcap"
+echo $cmd
+if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+if ! cmp out-netviz/time_histogram.csv out-netviz-merged/time_histogram.csv ; then
+  echo netviz histogram of merged inputs differs
+  exit 1
+fi
+/bin/rm -rf out-netviz out-netviz-merged
+echo netviz with merged inputs completed successfully
+
+echo
+echo ========
+echo check that a shard with no traffic still expires its idle flows
+echo ========
+# test8-quiet.pcap: one packet on port 40003, then 300 seconds of
+# another connection's packets.  Whichever shard holds the quiet flow,
+# it must be closed by idle_timeout, as it is without shards.
+for shards in 1 4 ; do
+  /bin/rm -rf out-quiet
+  cmd="$TCPFLOW -o out-quiet -S shards=$shards -S idle_timeout=60 -X out-quiet/report.xml -r $DMPDIR/test8-quiet.pcap"
+  echo $cmd
+  if ! $cmd; then echo tcpflow failed; exit 1 ; fi
+  if ! grep '<flows_expired>1<' out-quiet/report.xml >/dev/null ; then
+    echo "shards=$shards: flows_expired is not 1 in out-quiet/report.xml"
+    exit 1
+  fi
+done
+/bin/rm -rf out-quiet
+echo idle_timeout with shards completed successfully
+
 exit 0
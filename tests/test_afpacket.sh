@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# test AF_PACKET capture (-S afpacket=1) on the loopback device of a
+# private network namespace.  Skipped (exit 77) unless unshare(1),
+# ip(8) and python3 are available and we may create a namespace.
+#
+
+case x"$srcdir" in
+  x|x.) TCPFLOW=../src/tcpflow ;;
+  *)    TCPFLOW=../../_build/src/tcpflow ;;
+esac
+TCPFLOW=`cd \`dirname $TCPFLOW\` && pwd`/`basename $TCPFLOW`
+OUT=`pwd`/out_afpacket
+
+skip() { echo "skipping AF_PACKET test: $1"; exit 77; }
+
+$TCPFLOW -h 2>&1 | grep afpacket_fanout >/dev/null || skip "tcpflow built without AF_PACKET"
+for prog in unshare ip python3; do
+  command -v $prog >/dev/null 2>&1 || skip "$prog not found"
+done
+unshare -rn true 2>/dev/null || skip "cannot create a network namespace"
+
+/bin/rm -rf $OUT
+mkdir $OUT
+
+# 20 connections to port 9999: the client sends one line 200 times,
+# the server sends back "reply" and the first line 50 times.
+cat > $OUT/traffic.py <<'PY'
+import socket,threading
+N=20
+srv=socket.socket()
+srv.setsockopt(socket.SOL_SOCKET,socket.SO_REUSEADDR,1)
+srv.bind(('127.0.0.1',9999))
+srv.listen(N)
+def serve():
+    for i in range(N):
+        c,_=srv.accept()
+        d=b''
+        while not d.endswith(b'END\n'):
+            x=c.recv(65536)
+            if not x: break
+            d+=x
+        c.sendall(b'reply\n'+d.split(b'\n')[0]*50)
+        c.close()
+t=threading.Thread(target=serve)
+t.start()
+for i in range(N):
+    s=socket.create_connection(('127.0.0.1',9999))
+    s.sendall(b'afpacket test line\n'*200+b'END\n')
+    while s.recv(65536): pass
+    s.close()
+t.join()
+PY
+
+unshare -rn sh -c "
+  ip link set lo up
+  $TCPFLOW -S afpacket=1 -S afpacket_fanout=2 -S afpacket_block_size=65536 -S afpacket_blocks=8 \
+      -i lo -o $OUT port 9999 &
+  pid=\$!
+  sleep 1
+  python3 $OUT/traffic.py
+  sleep 1
+  kill -TERM \$pid
+  wait \$pid
+" || { echo "capture failed"; exit 1; }
+
+fail() { echo "failure: $1"; ls -l $OUT; exit 1; }
+
+n=`ls $OUT | grep -c '^127.000.000.001.09999-'`
+[ $n -eq 20 ] || fail "expected 20 server flows, got $n"
+n=`ls $OUT | grep -c -- '-127.000.000.001.09999$'`
+[ $n -eq 20 ] || fail "expected 20 client flows, got $n"
+for f in $OUT/*-127.000.000.001.09999; do
+  [ `wc -c < $f` -eq 3804 ] || fail "$f has the wrong length"
+done
+for f in $OUT/127.000.000.001.09999-*; do
+  [ `wc -c < $f` -eq 906 ] || fail "$f has the wrong length"
+done
+
+/bin/rm -rf $OUT
+echo AF_PACKET capture completed successfully
+exit 0